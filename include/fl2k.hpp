@@ -0,0 +1,478 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FL2K_HPP
+#define __FL2K_HPP
+
+/*
+ * Header-only C++17 wrapper of the write mode of libosmo-fl2k, C++20 span
+ * and coroutine support is used when available.
+ *
+ *	fl2k::device dev(0);
+ *	dev.set_sample_rate(14318181);
+ *	fl2k::stream tx(dev);
+ *
+ *	// produce in place, the lease blocks while the ring is full
+ *	auto lease = tx.acquire(910);
+ *	render_line(lease.r());
+ *	lease.commit();
+ *
+ *	// or let the stream pull from a coroutine
+ *	tx.pump(lines());
+ */
+
+#include <osmo-fl2k.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#if __has_include(<version>)
+#include <version>
+#endif
+
+#ifdef __cpp_lib_span
+#include <span>
+#endif
+
+#if defined(__cpp_impl_coroutine) && defined(__cpp_lib_coroutine)
+#include <coroutine>
+#include <exception>
+#include <iterator>
+#define FL2K_HAVE_COROUTINES 1
+#endif
+
+namespace fl2k {
+
+#ifdef __cpp_lib_span
+template <class T> using span = std::span<T>;
+#else
+/* just enough of std::span for C++17 */
+template <class T> class span {
+public:
+	constexpr span() noexcept : data_(nullptr), size_(0) {}
+	constexpr span(T *data, std::size_t size) noexcept
+		: data_(data), size_(size) {}
+
+	/* from contiguous containers and other spans */
+	template <class C, class = decltype(std::declval<C &>().data()),
+		  class = decltype(std::declval<C &>().size())>
+	constexpr span(C &c) noexcept : data_(c.data()), size_(c.size()) {}
+
+	constexpr T *data() const noexcept { return data_; }
+	constexpr std::size_t size() const noexcept { return size_; }
+	constexpr bool empty() const noexcept { return !size_; }
+	constexpr T &operator[](std::size_t i) const { return data_[i]; }
+	constexpr T *begin() const noexcept { return data_; }
+	constexpr T *end() const noexcept { return data_ + size_; }
+
+	constexpr span first(std::size_t n) const { return span(data_, n); }
+	constexpr span subspan(std::size_t off, std::size_t n) const
+	{
+		return span(data_ + off, n);
+	}
+
+private:
+	T *data_;
+	std::size_t size_;
+};
+#endif
+
+class error : public std::runtime_error {
+public:
+	error(int code, const char *what)
+		: std::runtime_error(std::string(what) + " failed (" +
+				     std::to_string(code) + ")"),
+		  code_(code) {}
+
+	int code() const noexcept { return code_; }
+
+private:
+	int code_;
+};
+
+inline int check(int r, const char *what)
+{
+	if (r < 0)
+		throw error(r, what);
+
+	return r;
+}
+
+/* an opened device, closed on destruction */
+class device {
+public:
+	explicit device(uint32_t index = 0)
+	{
+		check(fl2k_open(&dev_, index), "fl2k_open");
+		if (!dev_)
+			throw error(FL2K_ERROR_NOT_FOUND, "fl2k_open");
+	}
+
+	~device()
+	{
+		if (dev_)
+			fl2k_close(dev_);
+	}
+
+	device(device &&o) noexcept : dev_(std::exchange(o.dev_, nullptr)) {}
+
+	device &operator=(device &&o) noexcept
+	{
+		if (this != &o) {
+			if (dev_)
+				fl2k_close(dev_);
+			dev_ = std::exchange(o.dev_, nullptr);
+		}
+		return *this;
+	}
+
+	device(const device &) = delete;
+	device &operator=(const device &) = delete;
+
+	static uint32_t count() { return fl2k_get_device_count(); }
+	static const char *name(uint32_t index)
+	{
+		return fl2k_get_device_name(index);
+	}
+
+	void set_sample_rate(uint32_t rate)
+	{
+		check(fl2k_set_sample_rate(dev_, rate), "fl2k_set_sample_rate");
+	}
+
+	uint32_t sample_rate() const { return fl2k_get_sample_rate(dev_); }
+
+	void set_dac_lut(enum fl2k_dac dac, const uint8_t *lut)
+	{
+		check(fl2k_set_dac_lut(dev_, dac, lut), "fl2k_set_dac_lut");
+	}
+
+	void set_adaptive_buffers(uint32_t max_buf_num)
+	{
+		check(fl2k_set_adaptive_buffers(dev_, max_buf_num),
+		      "fl2k_set_adaptive_buffers");
+	}
+
+	fl2k_dev_t *get() const noexcept { return dev_; }
+
+private:
+	fl2k_dev_t *dev_ = nullptr;
+};
+
+/* one block of samples from a producer, a channel left empty is unused */
+struct block {
+	span<const uint8_t> r, g, b;
+};
+
+/*
+ * State of a stream shared with its leases. It moves with the stream, so a
+ * lease stays valid when the stream is moved, and the device is cleared
+ * when the stream is destroyed, so a late commit() does nothing.
+ */
+struct stream_state {
+	fl2k_dev_t *dev = nullptr;
+	bool sign[3] = { false, false, false };
+};
+
+/*
+ * Writable view of the free part of the ring, move-only. The samples are
+ * handed to the device by commit(), dropping the lease without commit()
+ * discards them.
+ */
+class lease {
+public:
+	lease() noexcept = default;
+
+	lease(lease &&o) noexcept
+		: st_(std::move(o.st_)), info_(o.info_)
+	{
+		std::memcpy(use_, o.use_, sizeof(use_));
+	}
+
+	lease &operator=(lease &&o) noexcept
+	{
+		st_ = std::move(o.st_);
+		info_ = o.info_;
+		std::memcpy(use_, o.use_, sizeof(use_));
+		return *this;
+	}
+
+	lease(const lease &) = delete;
+	lease &operator=(const lease &) = delete;
+
+	std::size_t size() const noexcept { return st_ ? info_.len : 0; }
+	explicit operator bool() const noexcept { return st_ != nullptr; }
+
+	/* accessing a channel marks it as used */
+	span<uint8_t> r() { return channel(FL2K_DAC_R, info_.r_buf); }
+	span<uint8_t> g() { return channel(FL2K_DAC_G, info_.g_buf); }
+	span<uint8_t> b() { return channel(FL2K_DAC_B, info_.b_buf); }
+
+	/* hand the first n samples (all by default) to the device */
+	void commit(std::size_t n = SIZE_MAX)
+	{
+		fl2k_data_info_t info = info_;
+		std::shared_ptr<stream_state> st = std::move(st_);
+
+		/* the stream is gone and streaming stopped */
+		if (!st || !st->dev)
+			return;
+
+		if (n < info.len)
+			info.len = (uint32_t)n;
+
+		info.r_buf = use_[FL2K_DAC_R] ? info.r_buf : nullptr;
+		info.g_buf = use_[FL2K_DAC_G] ? info.g_buf : nullptr;
+		info.b_buf = use_[FL2K_DAC_B] ? info.b_buf : nullptr;
+		info.sampletype_signed_r = st->sign[FL2K_DAC_R];
+		info.sampletype_signed_g = st->sign[FL2K_DAC_G];
+		info.sampletype_signed_b = st->sign[FL2K_DAC_B];
+
+		check(fl2k_write_end(st->dev, &info), "fl2k_write_end");
+	}
+
+private:
+	friend class stream;
+
+	lease(std::shared_ptr<stream_state> st,
+	      const fl2k_data_info_t &info) noexcept
+		: st_(std::move(st)), info_(info) {}
+
+	span<uint8_t> channel(enum fl2k_dac dac, char *buf)
+	{
+		use_[dac] = true;
+		return span<uint8_t>(reinterpret_cast<uint8_t *>(buf), size());
+	}
+
+	std::shared_ptr<stream_state> st_;
+	fl2k_data_info_t info_ = {};
+	bool use_[3] = { false, false, false };
+};
+
+/*
+ * Streaming session in write mode, stopped on destruction. fl2k_close() (the
+ * device destructor) waits for the device to go idle, so a stream should not
+ * outlive its device. Outstanding leases follow a moved stream.
+ */
+class stream {
+public:
+	explicit stream(device &dev, uint32_t ring_len = 0, uint32_t buf_num = 0)
+		: st_(std::make_shared<stream_state>())
+	{
+		check(fl2k_start_tx_write(dev.get(), ring_len, buf_num),
+		      "fl2k_start_tx_write");
+		st_->dev = dev.get();
+	}
+
+	~stream()
+	{
+		if (st_ && st_->dev)
+			fl2k_stop_tx(std::exchange(st_->dev, nullptr));
+	}
+
+	stream(stream &&o) noexcept : st_(std::move(o.st_)) {}
+
+	stream &operator=(stream &&) = delete;
+	stream(const stream &) = delete;
+	stream &operator=(const stream &) = delete;
+
+	/* interpret the samples of a channel as signed, also applies to
+	 * outstanding leases */
+	void set_signed(enum fl2k_dac dac, bool sign)
+	{
+		if (st_)
+			st_->sign[dac] = sign;
+	}
+
+	/* zero-copy access to up to len samples, blocks while the ring is
+	 * full, an empty lease once streaming has stopped */
+	lease acquire(std::size_t len)
+	{
+		fl2k_data_info_t info = {};
+
+		if (fl2k_write_begin(get(), &info, (uint32_t)len) < 0)
+			return lease();
+
+		return lease(st_, info);
+	}
+
+	/* copy a block into the ring, returns false once streaming stopped */
+	bool write(const block &blk)
+	{
+		std::size_t len = std::max({ blk.r.size(), blk.g.size(),
+					     blk.b.size() });
+		std::size_t done = 0;
+
+		while (done < len) {
+			lease l = acquire(len - done);
+			if (!l)
+				return false;
+
+			if (!blk.r.empty())
+				copy(l.r(), blk.r, done);
+			if (!blk.g.empty())
+				copy(l.g(), blk.g, done);
+			if (!blk.b.empty())
+				copy(l.b(), blk.b, done);
+
+			done += l.size();
+			l.commit();
+		}
+
+		return true;
+	}
+
+	/* call f(lease &) with a lease of up to len samples until it returns
+	 * false or streaming stopped, f commits what it produced */
+	template <class F> void produce(std::size_t len, F &&f)
+	{
+		for (;;) {
+			lease l = acquire(len);
+			if (!l || !f(l))
+				break;
+		}
+	}
+
+	/* pull blocks from any range of fl2k::block, e.g. a generator */
+	template <class Range> void pump(Range &&blocks)
+	{
+		for (const block &blk : blocks) {
+			if (!write(blk))
+				break;
+		}
+	}
+
+	int64_t clock_slips() const { return fl2k_get_clock_slips(get()); }
+
+	fl2k_dev_t *get() const noexcept { return st_ ? st_->dev : nullptr; }
+
+private:
+	static void copy(span<uint8_t> dst, span<const uint8_t> src,
+			 std::size_t off)
+	{
+		/* shorter channels are padded with zeros */
+		std::size_t n = (off < src.size()) ? src.size() - off : 0;
+		if (n > dst.size())
+			n = dst.size();
+
+		std::memcpy(dst.data(), src.data() + off, n);
+		std::memset(dst.data() + n, 0, dst.size() - n);
+	}
+
+	std::shared_ptr<stream_state> st_;
+};
+
+#ifdef FL2K_HAVE_COROUTINES
+/*
+ * Minimal generator for producers written as coroutines:
+ *
+ *	fl2k::generator<fl2k::block> lines()
+ *	{
+ *		std::vector<uint8_t> line(910);
+ *		for (;;) {
+ *			render_line(line);
+ *			co_yield fl2k::block{ line, {}, {} };
+ *		}
+ *	}
+ *
+ * The yielded value stays valid until the stream asks for the next one.
+ */
+template <class T> class generator {
+public:
+	struct promise_type {
+		const T *value = nullptr;
+		std::exception_ptr error;
+
+		generator get_return_object()
+		{
+			return generator(handle::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+
+		std::suspend_always yield_value(const T &v) noexcept
+		{
+			value = &v;
+			return {};
+		}
+
+		void return_void() noexcept {}
+		void unhandled_exception() { error = std::current_exception(); }
+	};
+
+	using handle = std::coroutine_handle<promise_type>;
+
+	class iterator {
+	public:
+		explicit iterator(handle h) : h_(h) { next(); }
+
+		const T &operator*() const { return *h_.promise().value; }
+		iterator &operator++()
+		{
+			next();
+			return *this;
+		}
+
+		bool operator!=(std::default_sentinel_t) const
+		{
+			return !h_.done();
+		}
+
+	private:
+		void next()
+		{
+			h_.resume();
+			if (h_.promise().error)
+				std::rethrow_exception(h_.promise().error);
+		}
+
+		handle h_;
+	};
+
+	explicit generator(handle h) : h_(h) {}
+	generator(generator &&o) noexcept : h_(std::exchange(o.h_, {})) {}
+	generator(const generator &) = delete;
+	generator &operator=(const generator &) = delete;
+	generator &operator=(generator &&) = delete;
+
+	~generator()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	iterator begin() { return iterator(h_); }
+	std::default_sentinel_t end() { return {}; }
+
+private:
+	handle h_;
+};
+#endif
+
+} /* namespace fl2k */
+
+#endif /* __FL2K_HPP */
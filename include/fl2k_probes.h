@@ -0,0 +1,94 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FL2K_PROBES_H
+#define __FL2K_PROBES_H
+
+/*
+ * USDT (SystemTap/DTrace style) static tracepoints of libosmo-fl2k,
+ * provider "fl2k". Every probe gets the transfer/buffer sequence number and
+ * a CLOCK_MONOTONIC timestamp in ns as its first two arguments:
+ *
+ *   cb_enter, cb_exit		application callback in the sample worker
+ *   convert_start, convert_end	interleaving into the transfer buffer
+ *   xfer_fill			transfer handed to the USB side, arg3: index
+ *   xfer_complete		transfer completed, arg3: libusb status
+ *   xfer_submit		next filled transfer submitted, arg3: result
+ *   underflow			no filled transfer, arg3: underflow count
+ *   get_next_xfer		arg3: requested state, arg4: index or -1
+ *
+ * The probes are a single nop when nothing is attached. The timestamp is
+ * only taken while a tracer has enabled the probe, e.g.:
+ *
+ *   bpftrace -e 'usdt:/usr/lib/libosmo-fl2k.so:fl2k:underflow
+ *	{ printf("%d %d\n", arg0, arg2); }'
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <stdint.h>
+#include <time.h>
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+/* declare in exactly one translation unit, tracers set it while attached */
+#define FL2K_PROBE_DEFINE(name) \
+	__extension__ unsigned short fl2k_##name##_semaphore \
+	__attribute__((unused)) __attribute__((section(".probes")))
+
+#define FL2K_PROBE_ENABLED(name) \
+	__builtin_expect(fl2k_##name##_semaphore, 0)
+
+static inline uint64_t fl2k_probe_ts(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define FL2K_PROBE(name, seq) do { \
+	if (FL2K_PROBE_ENABLED(name)) \
+		DTRACE_PROBE2(fl2k, name, (uint64_t)(seq), fl2k_probe_ts()); \
+	} while (0)
+
+#define FL2K_PROBE1(name, seq, a) do { \
+	if (FL2K_PROBE_ENABLED(name)) \
+		DTRACE_PROBE3(fl2k, name, (uint64_t)(seq), fl2k_probe_ts(), \
+			      (int64_t)(a)); \
+	} while (0)
+
+#define FL2K_PROBE2(name, seq, a, b) do { \
+	if (FL2K_PROBE_ENABLED(name)) \
+		DTRACE_PROBE4(fl2k, name, (uint64_t)(seq), fl2k_probe_ts(), \
+			      (int64_t)(a), (int64_t)(b)); \
+	} while (0)
+
+#else
+
+#define FL2K_PROBE_DEFINE(name)		extern int fl2k_probe_unused
+#define FL2K_PROBE_ENABLED(name)	0
+#define FL2K_PROBE(name, seq)		do { } while (0)
+#define FL2K_PROBE1(name, seq, a)	do { } while (0)
+#define FL2K_PROBE2(name, seq, a, b)	do { } while (0)
+
+#endif
+
+#endif /* __FL2K_PROBES_H */
@@ -42,11 +42,17 @@ enum fl2k_error {
 	FL2K_ERROR_NO_MEM = -11,
 };
 
+enum fl2k_dac {
+	FL2K_DAC_R = 0,
+	FL2K_DAC_G = 1,
+	FL2K_DAC_B = 2,
+};
+
 typedef struct fl2k_data_info {
 	/* information provided by library */
 	void *ctx;
 	uint32_t underflow_cnt;		/* underflows since last callback */
-	uint32_t len;			/* buffer length */
+	uint32_t len;			/* buffer length, set by application for fl2k_write() */
 	int using_zerocopy;		/* using zerocopy kernel buffers */
 	int device_error;		/* device error happened, terminate application */
 
@@ -116,6 +122,55 @@ FL2K_API int fl2k_set_sample_rate(fl2k_dev_t *dev, uint32_t target_freq);
  */
 FL2K_API uint32_t fl2k_get_sample_rate(fl2k_dev_t *dev);
 
+/*!
+ * Get the sample rate fl2k_set_sample_rate() would configure, without
+ * a device (offline processing at the rate of the hardware).
+ *
+ * \param target_freq the requested sample rate
+ * \return the closest sample rate the PLL can produce, in Hz
+ */
+FL2K_API uint32_t fl2k_get_nearest_sample_rate(uint32_t target_freq);
+
+/*!
+ * Set the transfer lookup table of one DAC. Every sample of that channel is
+ * mapped through the table while it is interleaved into the transfer buffer,
+ * after the sign offset has been applied, so the index is always the
+ * unsigned 8 bit value as seen by the DAC.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param dac the DAC to set the table for (FL2K_DAC_R, _G or _B)
+ * \param lut array of 256 output values, NULL to disable the table
+ * \return 0 on success
+ */
+FL2K_API int fl2k_set_dac_lut(fl2k_dev_t *dev, enum fl2k_dac dac,
+			      const uint8_t *lut);
+
+/*!
+ * Get the transfer lookup table of one DAC, so it can be composed with
+ * another mapping before being set again.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param dac the DAC to get the table of (FL2K_DAC_R, _G or _B)
+ * \param lut array of 256 values, filled with the identity if no table is set
+ * \return 0 on success
+ */
+FL2K_API int fl2k_get_dac_lut(fl2k_dev_t *dev, enum fl2k_dac dac, uint8_t *lut);
+
+/*!
+ * Load the DAC transfer lookup tables from a calibration file.
+ *
+ * The file is plain text, a '#' starts a comment until the end of the line.
+ * A table starts with the channel letter (R, G or B) followed by 256
+ * whitespace separated output values (0-255), in order of the input value.
+ * Channels not present in the file keep their current table.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param filename path of the calibration file
+ * \return 0 on success, FL2K_ERROR_NOT_FOUND if the file can't be opened,
+ *	   FL2K_ERROR_INVALID_PARAM on a malformed file
+ */
+FL2K_API int fl2k_load_dac_lut(fl2k_dev_t *dev, const char *filename);
+
 /* streaming functions */
 
 typedef void(*fl2k_tx_cb_t)(fl2k_data_info_t *data_info);
@@ -133,6 +188,120 @@ typedef void(*fl2k_tx_cb_t)(fl2k_data_info_t *data_info);
 FL2K_API int fl2k_start_tx(fl2k_dev_t *dev, fl2k_tx_cb_t cb,
 		     void *ctx, uint32_t buf_num);
 
+/*!
+ * Let the library choose the number of transfers. The time the callback and
+ * the conversion of each buffer take is measured against the transfer period.
+ * The number of in-flight and spare transfers grows when the margin gets
+ * small or an underflow happened, and shrinks again after a quiet period,
+ * for the lowest latency without underflows. Has to be called before the
+ * streaming is started, its buf_num is then the initial depth.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param max_buf_num upper limit of transfers in flight, there are as many
+ *		      spare transfers, every one takes FL2K_XFER_LEN bytes,
+ *		      0 for a fixed depth
+ * \return 0 on success
+ */
+FL2K_API int fl2k_set_adaptive_buffers(fl2k_dev_t *dev, uint32_t max_buf_num);
+
+/*!
+ * Get the number of transfers currently kept in flight.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \return buffer depth, 0 on error
+ */
+FL2K_API uint32_t fl2k_get_buffer_depth(fl2k_dev_t *dev);
+
+/*!
+ * Starts the tx thread in write mode. Instead of being asked for exactly
+ * FL2K_BUF_LEN samples by a callback, the application pushes blocks of any
+ * length with fl2k_write(), e.g. one video line or one audio packet. The
+ * blocks are packed into a ring that is a multiple of FL2K_BUF_LEN, and a
+ * transfer is converted straight out of the ring unless it wraps around the
+ * end of the ring or contains clock slips. fl2k_write() copies each block
+ * into the ring, fl2k_write_begin() / fl2k_write_end() let the application
+ * produce the samples in the ring without that copy.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param ring_len ring size per channel in samples, rounded up to a multiple
+ *		   of FL2K_BUF_LEN, set to 0 for the default size (4 buffers)
+ * \param buf_num optional buffer count, see fl2k_start_tx()
+ * \return 0 on success
+ */
+FL2K_API int fl2k_start_tx_write(fl2k_dev_t *dev, uint32_t ring_len,
+				 uint32_t buf_num);
+
+/*!
+ * Write samples to a device started with fl2k_start_tx_write(). The samples
+ * are copied into the ring, so the buffers can be reused on return. Blocks
+ * while the ring is full. Only one thread may write to a device.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param data_info r_buf, g_buf, b_buf, sampletype_signed_* and len (in
+ *		    samples per channel) filled in by the application, unused
+ *		    channels are NULL and must stay unused for the whole stream
+ * \return 0 on success, FL2K_ERROR_NO_DEVICE if streaming has stopped
+ */
+FL2K_API int fl2k_write(fl2k_dev_t *dev, fl2k_data_info_t *data_info);
+
+/*!
+ * Get direct access to the free part of the ring of a device started with
+ * fl2k_start_tx_write(), to produce samples in place instead of having
+ * fl2k_write() copy them. Blocks while the ring is full. The block never
+ * wraps around the end of the ring, so it may be shorter than requested.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param data_info r_buf, g_buf and b_buf are set to the block and len to
+ *		    its length in samples
+ * \param len number of samples wanted
+ * \return 0 on success, FL2K_ERROR_NO_DEVICE once streaming has stopped
+ */
+FL2K_API int fl2k_write_begin(fl2k_dev_t *dev, fl2k_data_info_t *data_info,
+			      uint32_t len);
+
+/*!
+ * Hand a block obtained with fl2k_write_begin() to the device.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param data_info len set to the number of samples written (may be less
+ *		    than granted), the sample types set, and the buffer
+ *		    pointers of unused channels set to NULL
+ * \return 0 on success
+ */
+FL2K_API int fl2k_write_end(fl2k_dev_t *dev, fl2k_data_info_t *data_info);
+
+/*!
+ * Lock the output of a device in write mode to an external reference. The
+ * PLL only approximates the requested sample rate, so the written stream is
+ * consumed slightly too fast or too slow. The error against ref_rate is
+ * accumulated and corrected by dropping or repeating single samples, spread
+ * evenly over the stream and only at positions the application allows.
+ *
+ * Slip positions are offset + n * period samples into the written stream,
+ * e.g. a spot in the horizontal blanking of every video line. The function
+ * may be called again at any time, e.g. to follow a ratio measured from
+ * timestamps of an audio clock, or with a new offset to re-base the slip
+ * positions on every video frame. The accumulated error is kept as long as
+ * the period stays the same.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param ref_rate rate in Hz the application produces samples at, measured
+ *		   against its reference clock, 0 disables the correction
+ * \param period distance of slip positions in samples, 1 for anywhere
+ * \param offset position of the first slip position in samples
+ * \return 0 on success
+ */
+FL2K_API int fl2k_set_clock_discipline(fl2k_dev_t *dev, double ref_rate,
+				       uint32_t period, uint32_t offset);
+
+/*!
+ * Get the net number of samples corrected by the clock discipline.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \return dropped minus repeated samples since fl2k_start_tx_write()
+ */
+FL2K_API int64_t fl2k_get_clock_slips(fl2k_dev_t *dev);
+
 /*!
  * Cancel all pending asynchronous operations on the device.
  *
@@ -141,6 +310,85 @@ FL2K_API int fl2k_start_tx(fl2k_dev_t *dev, fl2k_tx_cb_t cb,
  */
 FL2K_API int fl2k_stop_tx(fl2k_dev_t *dev);
 
+/* flight recorder */
+
+/** Trace tracks used by the library, applications use tracks starting at
+ * FL2K_TRACE_TRACK_APP. Spans must nest properly within one track. */
+#define FL2K_TRACE_TRACK_SAMPLE	0	/* sample worker: callback, conversion */
+#define FL2K_TRACE_TRACK_USB	1	/* USB completion: submit, underflow */
+#define FL2K_TRACE_TRACK_APP	16
+
+/*!
+ * Enable the flight recorder, a lock-free ring keeping the last events of
+ * the streaming pipeline. Call before fl2k_start_tx().
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param num_events ring size, rounded up to a power of two,
+ *		     set to 0 for the default (4096 events)
+ * \param underflow_file if not NULL, the ring is written to this file as
+ *			 Chrome trace JSON when an underflow happens
+ *			 (at most once every 10 seconds)
+ * \return 0 on success
+ */
+FL2K_API int fl2k_trace_enable(fl2k_dev_t *dev, uint32_t num_events,
+			       const char *underflow_file);
+
+/*!
+ * Record the begin or the end of an application defined span. Does nothing
+ * if the flight recorder is not enabled.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param track trace track (shown as thread), FL2K_TRACE_TRACK_APP and up
+ * \param name span name, must be a string literal or live as long as dev
+ * \param arg value shown with the event, e.g. a buffer number
+ */
+FL2K_API void fl2k_trace_begin(fl2k_dev_t *dev, uint32_t track,
+			       const char *name, uint64_t arg);
+
+FL2K_API void fl2k_trace_end(fl2k_dev_t *dev, uint32_t track,
+			     const char *name, uint64_t arg);
+
+/*!
+ * Write the content of the flight recorder as Chrome trace JSON, which can
+ * be loaded into chrome://tracing or ui.perfetto.dev. While streaming, the
+ * file is written by the thread that also writes the underflow dumps, the
+ * call waits for it. Don't call it from a signal handler.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param filename output file
+ * \return 0 on success
+ */
+FL2K_API int fl2k_trace_dump(fl2k_dev_t *dev, const char *filename);
+
+/* transfer audit log */
+
+#define FL2K_AUDIT_REPEAT	(1 << 0)	/* resubmitted after an underflow */
+
+/** One record of the audit log, written in host byte order */
+typedef struct fl2k_audit_record {
+	uint64_t seq;		/* transfer sequence number */
+	uint64_t submit_ns;	/* submit time, CLOCK_MONOTONIC in ns */
+	uint32_t hash;		/* hash of the transfer payload */
+	uint32_t flags;		/* FL2K_AUDIT_* */
+} fl2k_audit_record_t;
+
+/*!
+ * Log a hash of every transfer submitted to the device, to check two runs
+ * for bit-exact output and locate the first buffer that differs.
+ *
+ * The payload is split into four lanes (the first three are len / 4 rounded
+ * down to 8 bytes, the last takes the rest), each lane is hashed with
+ * CRC32C and the hash is the CRC32C of the four lane values in little
+ * endian order. SSE4.2 or ARMv8 CRC instructions are used when available.
+ * The records are written by a separate thread, if it can't keep up records
+ * are dropped and a warning is printed. Call before fl2k_start_tx().
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param filename binary log of fl2k_audit_record_t, NULL to disable
+ * \return 0 on success
+ */
+FL2K_API int fl2k_audit_enable(fl2k_dev_t *dev, const char *filename);
+
 /*!
  * Read 4 bytes via the FL2K I2C bus
  *
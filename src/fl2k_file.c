@@ -20,6 +20,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE//O_DIRECT
+
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
@@ -28,24 +30,45 @@
 #include <math.h>
 #include <pthread.h>
 #include <getopt.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifndef _WIN32
 	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <sys/uio.h>
+	#include <poll.h>
 	#define sleep_ms(ms)	usleep(ms*1000)
 	#else
 	#include <windows.h>
 	#include <io.h>
 	#include <fcntl.h>
+	#include <sys/stat.h>
 	#define sleep_ms(ms)	Sleep(ms)
 #endif
 
 #define _FILE_OFFSET_BITS 64
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#define HAVE_CONVERT_SSE2
+#elif defined(__GNUC__) && defined(__ARM_NEON) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#include <arm_neon.h>
+#define HAVE_CONVERT_NEON
+#endif
+
 #ifdef _WIN64
 #define FSEEK fseeko64
+#define FTELL ftello64
 #else
 #define FSEEK fseeko
+#define FTELL ftello
+#endif
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
 #endif
 
 #include "osmo-fl2k.h"
@@ -59,6 +82,67 @@ soxr_t resampler_b = NULL;
 static volatile int do_exit = 0;
 static volatile int repeat = 1;
 
+//flight recorder
+char *trace_filename = NULL;
+static volatile int trace_dump_req = 0;
+
+//transfer audit log
+char *audit_filename = NULL;
+
+//clock discipline (write mode), reference rate in Hz, 0 = nominal, -1 = off
+double clock_sync = -1;
+uint32_t clock_line = 0;//samples per line of the slip points, 0 = anywhere
+uint64_t clock_anchor = UINT64_MAX;//stream position the slip points are based on
+pthread_t thread_write;
+
+//offline render (no device), output file or '-' for stdout
+char *render_filename = NULL;
+FILE *render_file = NULL;
+unsigned char *render_buf = NULL;//one buffer of every channel, interleaved
+uint64_t render_buffers = 0;
+uint64_t render_ns = 0;//time spent rendering
+
+//adaptive buffer depth, maximum number of buffers (0 = fixed depth)
+uint32_t adaptive_buf = 0;
+
+//read ahead of the input files in seconds of media
+double read_ahead = 2;
+
+//threads sharing the processing of a buffer, per channel
+int process_threads = 1;
+
+//resampler engines, the fir is opt-in
+#define RESAMPLE_AUTO 0//fir from FIR_AUTO_RATE, soxr below
+#define RESAMPLE_SOXR 1
+#define RESAMPLE_FIR 2
+#define FIR_AUTO_RATE 20000000
+int resample_engine = RESAMPLE_SOXR;
+
+//per buffer duration of the pipeline stages, over a rolling window of buffers
+#define STAGE_READ 0//wait and copy out of the read ahead ring
+#define STAGE_PLAN 1//runs of the buffer (counters, tbc skip)
+#define STAGE_CONVERT 2//16 to 8 bit and combine, slowest share
+#define STAGE_GAIN 3//lookup tables, slowest share
+#define STAGE_RESAMPLE 4
+#define STAGE_BUFFER 5//whole callback, what the library waits for
+#define NB_STAGES 6
+#define STAGE_WINDOW 512
+
+typedef struct stage_stats {
+	pthread_mutex_t mutex;
+	uint32_t ns[STAGE_WINDOW];//last durations, every channel
+	uint64_t nb;
+} stage_stats_t;
+
+const char *stage_name[NB_STAGES] = {"read", "plan", "convert", "gain", "resample", "buffer"};
+stage_stats_t stage_stats[NB_STAGES];
+int stage_timing = 0;
+double stats_interval = 0;//seconds between two reports, 0 = only at exit
+char *stats_json_filename = NULL;
+FILE *stats_json = NULL;
+uint64_t stats_start = 0;
+uint64_t stats_late = 0;//buffers longer than the buffer period
+
 uint32_t input_sample_rate = 100000000;
 uint32_t output_sample_rate = 100000000;
 
@@ -181,360 +265,3992 @@ uint32_t field_cnt_b = 0;//used for tbc processing
 
 //unsigned char *pipe_buf = NULL;
 
+//persistent worker thread, woken once per buffer
+typedef struct worker {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	void *(*fn)(void *);
+	void *arg;
+	uint32_t posted;//work items posted
+	uint32_t done;//work items finished
+	int running;
+	int quit;
+} worker_t;
+
 //thread for processing
-pthread_t thread_r;
-pthread_t thread_g;
-pthread_t thread_b;
+worker_t worker_r;
+worker_t worker_g;
+worker_t worker_b;
 
 //thread for resampling
-pthread_t thread_r_res;
-pthread_t thread_g_res;
-pthread_t thread_b_res;
+worker_t worker_r_res;
+worker_t worker_g_res;
+worker_t worker_b_res;
+
+//read ahead thread of an input file, fills a ring of aligned blocks
+#define READER_BLOCK (1024 * 1024)
+#define READER_ALIGN 4096
+#define READER_QUEUE 4//reads in flight with io_uring
+
+//read backends
+#define READER_STDIO 0//fread into the ring
+#define READER_MMAP 1//mapped file, the thread only prefetches ahead of playback
+#define READER_DIRECT 2//O_DIRECT into the ring, with io_uring if available
+
+//input files of a channel, played one after the other
+typedef struct playlist {
+	char **items;
+	int nb;
+} playlist_t;
+
+typedef struct reader {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	FILE *file;
+	const char *name;
+	unsigned char *ring;
+	unsigned long size;//ring size, multiple of READER_BLOCK
+	unsigned long rd;//read position
+	unsigned long fill;//bytes available
+	unsigned long min_fill;//lowest level seen by the consumer
+	uint32_t stalls;//reads that had to wait for the disk
+	int eof;//end of file or error, nothing more will be added
+	int error;//errno of the failed read
+	int running;
+	int quit;
+	int backend;
+	int fd;
+	off_t offset;//file position of the next block (direct)
+	unsigned long skip;//bytes before the start position in the first block (direct)
+	unsigned char *map;//whole file (mmap), rd is then the file position
+	size_t map_len;
+	size_t behind;//start of the part still mapped (mmap)
+	int uring_ok;
+	playlist_t *list;//NULL or a single item : only the file given to reader_init
+	int item;//item being read
+	int loops;//plays of the list left, 0 = forever
+	uint64_t align;//items are cut to a multiple of this (whole frames) so the switch is on a field boundary
+	int64_t item_left;//bytes left in the item, -1 = up to the end of the file
+	FILE *own;//item opened by the reader thread
+	uint32_t switches;
+#ifdef HAVE_LIBURING
+	struct io_uring uring;
+	int *res;//result of the read of each ring block
+	char *done;
+#endif
+} reader_t;
+
+int read_backend = READER_STDIO;
+
+playlist_t playlist_r;
+playlist_t playlist_g;
+playlist_t playlist_b;
+playlist_t playlist2_r;
+playlist_t playlist2_g;
+playlist_t playlist2_b;
+playlist_t playlist_audio;
+
+reader_t reader_r;
+reader_t reader_g;
+reader_t reader_b;
+reader_t reader2_r;
+reader_t reader2_g;
+reader_t reader2_b;
+reader_t reader_audio;
+
+//audio pipe (-A) written by its own thread, the sync channel only releases one frame at each frame boundary
+#define AUDIO_RING_FRAMES 50//frames read ahead of their release (2 s PAL)
+
+//stdout of the audio and pipe threads is non-blocking, a consumer that stops reading can't hold up their stop
+#define OUT_POLL_MS 100//a writer waiting for the consumer checks its deadline this often
+#define OUT_DRAIN_MS 2000//time left to the consumer at the stop to take the rest
+
+uint64_t now_ns(void);
+
+typedef struct audio_out {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	reader_t *src;
+	unsigned char *ring;
+	unsigned long frame;//bytes per frame
+	uint64_t read;//frames read into the ring
+	uint64_t released;//frames released by the sync channel
+	uint64_t written;//frames written to stdout
+	uint64_t max_backlog;//most frames released and not written yet
+	unsigned long min_fill;//lowest number of frames ready at a release
+	uint32_t late;//releases of a frame not read yet
+	uint64_t deadline;//set by the stop, the frames left after it are dropped (0 = none)
+	int running;
+	int quit;
+} audio_out_t;
+
+audio_out_t audio_output;
+
+//channel output (-pipeMode R/G/B) written to stdout by its own thread
+#define PIPE_DROP 0//a buffer that doesn't fit is dropped
+#define PIPE_BLOCK 1//the channel waits for room (the output can underflow)
+#define PIPE_DECIMATE 2//only every 2nd, 4th, 8th buffer is kept as the ring fills, dropped when full
+#define PIPE_WRITE_MAX (1024 * 1024)//largest single write
+
+typedef struct pipe_out {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned char *ring;
+	unsigned long size;
+	uint64_t wr;//bytes added by the channel
+	uint64_t rd;//bytes handed to the consumer
+	uint64_t done;//bytes the ring can reuse, vmsplice leaves up to lag bytes referenced by the pipe
+	unsigned long lag;
+	unsigned long max_fill;
+	uint32_t buffers;
+	uint32_t dropped;
+	uint32_t waits;
+	int policy;
+	int splice;
+	int closed;//consumer gone or write error
+	uint64_t deadline;//set by the stop, the rest of the ring is dropped after it
+	int running;
+	int quit;
+} pipe_out_t;
+
+pipe_out_t pipe_output;
+int pipe_policy = PIPE_DROP;//a slow consumer never holds up the DAC, block is opt-in
+
+//two party barrier between the processing and the resampler thread of a channel
+typedef struct handshake {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	uint32_t count;
+	uint32_t generation;
+} handshake_t;
+
+handshake_t handshake_r = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+handshake_t handshake_g = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+handshake_t handshake_b = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
 
 typedef struct soxr_resample_data {//used with soxr and pthread
 	soxr_t soxr;
-	fl2k_data_info_t *data_info;
-	int *state_resample;
-	int *state_process;
+	handshake_t *handshake;
+	short *in;//input block, filled by the processing thread
+	char *out;//8 bit output block
+	short *fifo;//resampled samples not sent yet
+	unsigned long fifo_len;
+	unsigned long fifo_size;
+	unsigned long in_len;//samples of the input block
+	uint64_t irate;
+	uint64_t orate;
+	uint64_t carry;//input owed to the output, in 1/orate samples (processing thread)
+	unsigned long prime;//extra input of the first block, covers the filter delay
+	unsigned long catchup;//extra input still to send (processing thread)
+	unsigned long deficit;//output samples missing in the last block (resampler thread)
+	uint64_t in_total;
+	uint64_t out_total;
+	uint32_t short_blocks;
+	int started;//0 until the first buffer was processed
 	char color;
+	struct fir *fir;//polyphase engine instead of soxr
 } resample_data;
 
 resample_data soxr_data_r;
 resample_data soxr_data_g;
 resample_data soxr_data_b;
 
-//process synchronisation
-//0 = initialisation | 1 = ready | 2 = processing | 3 = finished
-int resample_r_state = 0;
-int resample_g_state = 0;
-int resample_b_state = 0;
+//per channel working buffers, allocated once for the worst case
+//conversion of a run of samples, the buffer is planned first and then split between the threads
+typedef struct piece {
+	unsigned long i;//position in tmp_buf
+	unsigned long y;//position in calc
+	unsigned long n;//samples
+	int video;//source of combine mode 2
+	int region;//lookup table
+} piece_t;
 
-int process_r_state = 0;
-int process_g_state = 0;
-int process_b_state = 0;
+#define MAX_CHUNKS 16
 
-//pointer to variable
-int *resample_r_state_ptr = &resample_r_state;
-int *resample_g_state_ptr = &resample_g_state;
-int *resample_b_state_ptr = &resample_b_state;
+typedef struct chunk {
+	struct arena *arena;
+	int index;
+	uint64_t ns_convert;//time spent on the share, with -stats
+	uint64_t ns_gain;
+} chunk_t;
 
-int *process_r_state_ptr = &process_r_state;
-int *process_g_state_ptr = &process_g_state;
-int *process_b_state_ptr = &process_b_state;
+void *chunk_run(void *arg);
 
-void usage(void)
+//polyphase FIR resampler for high input rates (RF captures), Q14 coefficients
+#define FIR_TAPS 32
+#define FIR_PHASES 4096//largest exact bank, other ratios use the nearest of FIR_PHASES phases
+#define FIR_SHIFT 14
+
+//coefficients of a ratio, shared by the channels
+typedef struct fir_bank {
+	uint64_t m;//input samples per l output samples (reduced rates)
+	uint64_t l;
+	uint64_t m_int;//whole input samples per output
+	uint64_t m_frac;//and the fraction, in 1/l
+	uint64_t pmul;//fraction to phase, 32 bit fixed point
+	unsigned long phases;
+	short *coef;//phases + 1 rows of FIR_TAPS
+	int refs;//channels using it
+	struct fir_bank *next;
+} fir_bank_t;
+
+typedef struct fir_job {
+	struct fir *fir;
+	int index;
+} fir_job_t;
+
+typedef struct fir {
+	fir_bank_t *bank;
+	short *buf;//input from sample base, the taps of the next output included
+	unsigned long buf_len;
+	unsigned long buf_size;
+	int64_t base;//input sample of buf[0]
+	int64_t idx;//input sample of the next output
+	uint64_t frac;//and its fraction, in 1/l
+	short *out;//outputs of the block being computed
+	unsigned long n;
+	int nb_share;
+	fir_job_t job[MAX_CHUNKS];
+	worker_t worker[MAX_CHUNKS];//share 0 is computed by the resampler thread
+} fir_t;
+
+fir_t *fir_open(uint32_t irate, uint32_t orate, unsigned long max_input);
+unsigned long fir_process(fir_t *fir, const short *in, unsigned long in_len, short *out, unsigned long out_max);
+
+typedef struct arena {
+	short *resbuffer;//input_buf_size 16 bit samples for the resampler
+	unsigned char *tmp_buf;//input_buf_size 8 bit samples
+	unsigned char *calc;//one read including the tbc skip
+	unsigned char *calc2;//same for the secondary file
+	unsigned long calc_size;
+	short *obuf;//resampler output fifo
+	unsigned char lut[4][256];//adjustment chain per region (LUT_CHROMA, LUT_IRE)
+	int lut_identity[4];//nothing to do in this region
+	double lut_key[6];//parameters the tables were built with
+	int lut_valid;
+	piece_t *piece;//plan of the buffer
+	unsigned long nb_piece;
+	unsigned long piece_max;
+	unsigned long nb_sample;//samples of the buffer
+	int is16;//format of the buffer being processed
+	int is_stereo;
+	int combine_mode;
+	int nb_chunk;
+	chunk_t chunk[MAX_CHUNKS];
+	worker_t worker[MAX_CHUNKS];//chunk 0 is processed by the channel thread
+} arena_t;
+
+arena_t arena_r;
+arena_t arena_g;
+arena_t arena_b;
+
+//wait until the other thread of the channel got here too
+void handshake_wait(handshake_t *h)
 {
-	fprintf(stderr,
-		"fl2k_file2, a sample player for FL2K VGA dongles\n\n"
-		"Usage:\n"
-		"\t[-d device_index (default: 0)]\n"
-		"\t[-s samplerate (default: 100 MS/s) you can write(ntsc) or (pal)]\n"
-		"\t[-u Set the output sample type of the fl2K to unsigned]\n"
-		"\t[-R filename (use '-' to read from stdin)\n"
-		"\t[-G filename (use '-' to read from stdin)\n"
-		"\t[-B filename (use '-' to read from stdin)\n"
-		"\t[-A audio file (use '-' to read from stdin)\n"
-		"\t[-syncA chanel used for sync the audio file \ default : G \ value = (R ,G ,B)\n"
-		"\t[-R2 secondary file to be combined with R (use '-' to read from stdin)\n"
-		"\t[-G2 secondary file to be combined with G (use '-' to read from stdin)\n"
-		"\t[-B2 secondary file to be combined with B (use '-' to read from stdin)\n"
-		"\t[-R16 (convert bits 16 to 8)\n"
-		"\t[-G16 (convert bits 16 to 8)\n"
-		"\t[-B16 (convert bits 16 to 8)\n"
-		"\t[-R8 interpret R input as 8 bit\n"
-		"\t[-G8 interpret G input as 8 bit\n"
-		"\t[-B8 interpret B input as 8 bit\n"
-		"\t[-resample active output resampling\n"
-		"\t[-signR interpret R input as (1 = signed / 0 = unsigned) or (s = signed / u = unsigned)\n"
-		"\t[-signG interpret G input as (1 = signed / 0 = unsigned) or (s = signed / u = unsigned)\n"
-		"\t[-signB interpret B input as (1 = signed / 0 = unsigned) or (s = signed / u = unsigned)\n"
-		"\t[-cmbModeR combine mode \ default : 0 \ value = (0 ,1 ,2)\n"
-		"\t[-cmbModeG combine mode \ default : 0 \ value = (0 ,1 ,2)\n"
-		"\t[-cmbModeB combine mode \ default : 0 \ value = (0 ,1 ,2)\n"
-		"\t[-tbcR interpret R as tbc file\n"
-		"\t[-tbcG interpret G as tbc file\n"
-		"\t[-tbcB interpret B as tbc file\n"
-		"\t[-not_tbcR disable tbc processing for input R file\n"
-		"\t[-not_tbcG disable tbc processing for input G file\n"
-		"\t[-not_tbcB disable tbc processing for input B file\n"
-		"\t[-CgainR chroma gain for input R (0.0 to 6.0) (using color burst)\n"
-		"\t[-CgainG chroma gain for input G (0.0 to 6.0) (using color burst)\n"
-		"\t[-CgainB chroma gain for input B (0.0 to 6.0) (using color burst)\n"
-		"\t[-SgainR signal gain for output R (0.5 to 2.0) (clipping white)\n"
-		"\t[-SgainG signal gain for output G (0.5 to 2.0) (clipping white)\n"
-		"\t[-SgainB signal gain for output B (0.5 to 2.0) (clipping white)\n"
-		"\t[-VmaxR maximum output voltage for channel R (0.003 to 0.7) (scale value) (disable Cgain and Sgain)\n"
-		"\t[-VmaxG maximum output voltage for channel G (0.003 to 0.7) (scale value) (disable Cgain and Sgain)\n"
-		"\t[-VmaxB maximum output voltage for channel B (0.003 to 0.7) (scale value) (disable Cgain and Sgain)\n"
-		"\t[-MaxValueR max value for channel R (1 to 255) (reference level) (used for Vmax)\n"
-		"\t[-MaxValueG max value for channel G (1 to 255) (reference level) (used for Vmax)\n"
-		"\t[-MaxValueB max value for channel B (1 to 255) (reference level) (used for Vmax)\n"
-		//"\t[-MinValueR min value for channel R (0 to 254) (reference level) (used for Vmax)\n"
-		//"\t[-MinValueG min value for channel G (0 to 254) (reference level) (used for Vmax)\n"
-		//"\t[-MinValueB min value for channel B (0 to 254) (reference level) (used for Vmax)\n"
-		"\t[-ireR IRE level for input R (-50.0 to +50.0)\n"
-		"\t[-ireG IRE level for input G (-50.0 to +50.0)\n"
-		"\t[-ireB IRE level for input B (-50.0 to +50.0)\n"
-		"\t[-FstartR seek to frame for input R\n"
-		"\t[-FstartG seek to frame for input G\n"
-		"\t[-FstartB seek to frame for input B\n"
-		"\t[-audioOffset offset audio from a duration of x frame\n"
-		"\t[-pipeMode (default = A) option : A = Audio file / R = output of R / G = output of G / B = output of B\n"
-		"\t[-readMode (default = 0) option : 0 = multit-threading (RGB) / 1 = hybrid (R --> GB) / 2 = hybrid (RG --> B) / 3 = sequential (R -> G -> B)\n"
-		"\n-info-version------------------------------------------------------\n\n"
-		"runtime=%s API="SOXR_THIS_VERSION_STR"\n",
-	soxr_version());
-	exit(1);
+	uint32_t generation;
+	
+	pthread_mutex_lock(&h->mutex);
+	generation = h->generation;
+	
+	if(++h->count == 2)
+	{
+		h->count = 0;
+		h->generation++;
+		pthread_cond_broadcast(&h->cond);
+	}
+	else
+	{
+		while(generation == h->generation)
+		{
+			pthread_cond_wait(&h->cond, &h->mutex);
+		}
+	}
+	pthread_mutex_unlock(&h->mutex);
 }
 
-const char *get_filename_ext(const char *filename) {
-    const char *dot = strrchr(filename, '.');
-    if(!dot || dot == filename) return "";
-    return dot + 1;
+void *worker_thread(void *arg)
+{
+	worker_t *w = arg;
+	
+	pthread_mutex_lock(&w->mutex);
+	while(1)
+	{
+		while(w->done == w->posted && !w->quit)
+		{
+			pthread_cond_wait(&w->cond, &w->mutex);
+		}
+		
+		if(w->quit)
+		{
+			break;
+		}
+		
+		pthread_mutex_unlock(&w->mutex);
+		w->fn(w->arg);
+		pthread_mutex_lock(&w->mutex);
+		
+		w->done++;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	
+	return NULL;
 }
 
-#ifdef _WIN32
-BOOL WINAPI
-sighandler(int signum)
+int worker_init(worker_t *w, void *(*fn)(void *), void *arg)
 {
-	if (CTRL_C_EVENT == signum) {
-		fprintf(stderr, "Signal caught, exiting!\n");
-		fl2k_stop_tx(dev);
-		do_exit = 1;
-		return TRUE;
+	w->fn = fn;
+	w->arg = arg;
+	w->posted = 0;
+	w->done = 0;
+	w->quit = 0;
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	
+	if(pthread_create(&w->thread, NULL, worker_thread, w) != 0)
+	{
+		fprintf(stderr, "Error spawning worker thread\n");
+		return -1;
 	}
-	return FALSE;
+	
+	w->running = 1;
+	return 0;
 }
-#else
-static void sighandler(int signum)
+
+//hand one buffer to the worker
+void worker_post(worker_t *w)
 {
-	fprintf(stderr, "Signal caught, exiting!\n");
-	fl2k_stop_tx(dev);
-	do_exit = 1;
+	pthread_mutex_lock(&w->mutex);
+	w->posted++;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
 }
-#endif
 
-static size_t soxr_input_fn(void * ibuf, soxr_cbuf_t * buf, size_t len)
+//wait until the worker is done with all posted buffers
+void worker_wait(worker_t *w)
 {
-	*buf = ibuf;
-	//memcpy(ibuf,copyinbuf);
-	return len+1;//+1 to avoid looping
+	pthread_mutex_lock(&w->mutex);
+	while(w->done != w->posted)
+	{
+		pthread_cond_wait(&w->cond, &w->mutex);
+	}
+	pthread_mutex_unlock(&w->mutex);
 }
 
-void resampler_close(soxr_t soxr)
+void worker_stop(worker_t *w)
 {
-	soxr_delete(soxr);
+	if(!w->running)
+	{
+		return;
+	}
+	
+	pthread_mutex_lock(&w->mutex);
+	w->quit = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+	
+	pthread_join(w->thread, NULL);
+	pthread_mutex_destroy(&w->mutex);
+	pthread_cond_destroy(&w->cond);
+	w->running = 0;
 }
 
-void resampler_open(fl2k_data_info_t *data_info, soxr_t *soxr, uint32_t orate0, char color)
+//account a block appended to the ring, called locked
+void reader_append(reader_t *r, unsigned long len, int err)
 {
-	double irate = 0;
-	void * ibuf = NULL;
-	size_t ilen = 0;
+	unsigned long skip = (r->skip < len) ? r->skip : len;
 	
-	if(color == 'R')
+	r->fill += len - skip;
+	r->rd += skip;
+	r->skip = 0;
+	
+	if(err)
+	{
+		r->error = err;
+	}
+	if(len < READER_BLOCK || err)
+	{
+		r->eof = 1;
+	}
+	pthread_cond_broadcast(&r->cond);
+}
+
+//open the next item of the playlist (the first one again at the end of a loop), 0 once everything was played
+int reader_next(reader_t *r)
+{
+	struct stat st;
+	FILE *file = NULL;
+	int tries = 0;
+	
+	if(r->list == NULL)
+	{
+		return 0;
+	}
+	
+	for(tries = 0; tries < r->list->nb; tries++)
+	{
+		if(r->item + 1 < r->list->nb)
+		{
+			r->item++;
+		}
+		else if(r->loops != 1)
+		{
+			r->item = 0;
+			if(r->loops > 1){r->loops--;}
+		}
+		else
+		{
+			return 0;
+		}
+		
+		file = fopen(r->list->items[r->item], "rb");
+		if(!file || stat(r->list->items[r->item], &st) != 0 || (uint64_t)st.st_size < r->align)
+		{
+			fprintf(stderr, "(%s) : can't play %s, skipped\n", r->name, r->list->items[r->item]);
+			if(file){fclose(file);}
+			continue;
+		}
+		
+		if(r->own){fclose(r->own);}
+		r->own = file;
+		r->file = file;
+		r->item_left = (st.st_size / r->align) * r->align;
+		r->switches++;
+		fprintf(stderr, "(%s) : playing %s\n", r->name, r->list->items[r->item]);
+		return 1;
+	}
+	
+	return 0;
+}
+
+//read len bytes, going on with the next item at the end of one, short only at the end of the playlist
+unsigned long reader_fill(reader_t *r, unsigned char *dst, unsigned long len, int *err)
+{
+	unsigned long n = 0;
+	unsigned long want = 0;
+	unsigned long got = 0;
+	
+	*err = 0;
+	while(n < len)
+	{
+		want = len - n;
+		if(r->item_left >= 0 && (uint64_t)r->item_left < want)
+		{
+			want = r->item_left;
+		}
+		
+		got = want ? fread(dst + n, 1, want, r->file) : 0;
+		n += got;
+		if(r->item_left >= 0)
+		{
+			r->item_left -= got;
+		}
+		
+		if(ferror(r->file))
+		{
+			*err = errno;
+			break;
+		}
+		
+		if((got < want || r->item_left == 0) && !reader_next(r))
+		{
+			break;
+		}
+	}
+	
+	return n;
+}
+
+//stdio and O_DIRECT without io_uring, one block at a time
+void reader_loop_block(reader_t *r)
+{
+	unsigned long wr = 0;
+	long len = 0;
+	int err = 0;
+	
+	pthread_mutex_lock(&r->mutex);
+	while(!r->quit && !r->eof)
+	{
+		//wait for room for a whole block
+		while((r->size - r->fill) < READER_BLOCK && !r->quit)
+		{
+			pthread_cond_wait(&r->cond, &r->mutex);
+		}
+		
+		if(r->quit)
+		{
+			break;
+		}
+		
+		//only whole blocks are written before the end, so a block never wraps
+		wr = (r->rd + r->fill) % r->size;
+		pthread_mutex_unlock(&r->mutex);
+#ifndef _WIN32
+		if(r->backend == READER_DIRECT)
+		{
+			len = pread(r->fd, r->ring + wr, READER_BLOCK, r->offset);
+			err = (len < 0) ? errno : 0;
+			len = (len < 0) ? 0 : len;
+			r->offset += len;
+		}
+		else
+#endif
+		{
+			len = reader_fill(r, r->ring + wr, READER_BLOCK, &err);
+		}
+		pthread_mutex_lock(&r->mutex);
+		
+		reader_append(r, len, err);
+	}
+	pthread_mutex_unlock(&r->mutex);
+}
+
+#ifndef _WIN32
+//mapped file, prefetch a window ahead of playback and release the pages behind
+void reader_loop_mmap(reader_t *r)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned long start = 0;
+	unsigned long len = 0;
+	unsigned long behind_len = 0;
+	unsigned long i = 0;
+	volatile unsigned char touch = 0;
+	
+	pthread_mutex_lock(&r->mutex);
+	while(!r->quit && !r->eof)
 	{
-		irate = (float)data_info->r_rate;
-		ibuf = data_info->r_buf_res;
-		ilen = data_info->r_buf_len;
+		while((r->size - r->fill) < READER_BLOCK && !r->quit)
+		{
+			pthread_cond_wait(&r->cond, &r->mutex);
+		}
+		
+		if(r->quit)
+		{
+			break;
+		}
+		
+		start = r->rd + r->fill;
+		len = ((r->map_len - start) < READER_BLOCK) ? (r->map_len - start) : READER_BLOCK;
+		behind_len = 0;
+		if(r->rd > r->behind + r->size)
+		{
+			behind_len = ((r->rd - r->size - r->behind) / page) * page;
+		}
+		pthread_mutex_unlock(&r->mutex);
+		
+		madvise(r->map + (start & ~(page - 1)), len + (start & (page - 1)), MADV_WILLNEED);
+		//take the page faults here rather than in the processing thread
+		for(i = 0; i < len; i += page)
+		{
+			touch += r->map[start + i];
+		}
+		if(behind_len)
+		{
+			madvise(r->map + r->behind, behind_len, MADV_DONTNEED);
+		}
+		
+		pthread_mutex_lock(&r->mutex);
+		r->behind += behind_len;
+		r->fill += len;
+		if(start + len >= r->map_len)
+		{
+			r->eof = 1;
+		}
+		pthread_cond_broadcast(&r->cond);
 	}
-	if(color == 'G')
+	pthread_mutex_unlock(&r->mutex);
+}
+#endif
+
+#ifdef HAVE_LIBURING
+//O_DIRECT with up to READER_QUEUE reads in flight, blocks are appended in file order
+void reader_loop_uring(reader_t *r)
+{
+	unsigned long nblocks = r->size / READER_BLOCK;
+	uint64_t submitted = 0;//blocks handed to the kernel
+	uint64_t head = 0;//blocks appended to the ring
+	struct io_uring_sqe *sqe = NULL;
+	struct io_uring_cqe *cqe = NULL;
+	unsigned long slot = 0;
+	int stop = 0;
+	int ret = 0;
+	
+	pthread_mutex_lock(&r->mutex);
+	while(1)
+	{
+		stop = r->quit || r->eof;
+		
+		//queue reads into the free part of the ring
+		while(!stop && (submitted - head) < READER_QUEUE &&
+		      (r->fill + ((submitted - head + 1) * READER_BLOCK)) <= r->size)
+		{
+			sqe = io_uring_get_sqe(&r->uring);
+			if(!sqe)
+			{
+				break;
+			}
+			slot = submitted % nblocks;
+			io_uring_prep_read(sqe, r->fd, r->ring + (slot * READER_BLOCK), READER_BLOCK,
+					   r->offset + (submitted * READER_BLOCK));
+			io_uring_sqe_set_data(sqe, (void *)(uintptr_t)submitted);
+			submitted++;
+		}
+		
+		//nothing in flight, wait for the consumer
+		if(submitted == head)
+		{
+			if(stop)
+			{
+				break;
+			}
+			pthread_cond_wait(&r->cond, &r->mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&r->mutex);
+		
+		io_uring_submit(&r->uring);
+		ret = io_uring_wait_cqe(&r->uring, &cqe);
+		if(ret == 0)
+		{
+			slot = (uintptr_t)io_uring_cqe_get_data(cqe) % nblocks;
+			r->res[slot] = cqe->res;
+			r->done[slot] = 1;
+			io_uring_cqe_seen(&r->uring, cqe);
+		}
+		
+		pthread_mutex_lock(&r->mutex);
+		while(head < submitted && r->done[head % nblocks])
+		{
+			slot = head % nblocks;
+			r->done[slot] = 0;
+			head++;
+			//reads past the end or an error are dropped
+			if(!r->eof)
+			{
+				if(r->res[slot] < 0)
+				{
+					reader_append(r, 0, -r->res[slot]);
+				}
+				else
+				{
+					reader_append(r, r->res[slot], 0);
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&r->mutex);
+}
+#endif
+
+void *reader_thread(void *arg)
+{
+	reader_t *r = arg;
+	
+#ifndef _WIN32
+	if(r->backend == READER_MMAP)
+	{
+		reader_loop_mmap(r);
+		return NULL;
+	}
+#endif
+#ifdef HAVE_LIBURING
+	if(r->backend == READER_DIRECT && r->uring_ok)
+	{
+		reader_loop_uring(r);
+		return NULL;
+	}
+#endif
+	reader_loop_block(r);
+	
+	return NULL;
+}
+
+#ifndef _WIN32
+//set up the mmap or O_DIRECT backend from the opened (and seeked) file
+int reader_open_backend(reader_t *r)
+{
+	struct stat st;
+	off_t start = 0;
+	
+	r->fd = fileno(r->file);
+	if(fstat(r->fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		return -1;
+	}
+	
+	start = ftello(r->file);
+	if(start < 0)
+	{
+		return -1;
+	}
+	
+	if(r->backend == READER_MMAP)
+	{
+		r->map_len = st.st_size;
+		if(r->map_len == 0)
+		{
+			return -1;
+		}
+		
+		r->map = mmap(NULL, r->map_len, PROT_READ, MAP_SHARED, r->fd, 0);
+		if(r->map == MAP_FAILED)
+		{
+			r->map = NULL;
+			return -1;
+		}
+		madvise(r->map, r->map_len, MADV_SEQUENTIAL);
+		
+		r->rd = ((size_t)start < r->map_len) ? (size_t)start : r->map_len;
+		r->behind = 0;
+		if(r->rd >= r->map_len)
+		{
+			r->eof = 1;
+		}
+		return 0;
+	}
+	
+#ifdef O_DIRECT
+	if(fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) | O_DIRECT) != 0)
+	{
+		return -1;
+	}
+	
+	//O_DIRECT reads start on an aligned offset, the head of the first block is skipped
+	r->offset = start & ~((off_t)READER_ALIGN - 1);
+	r->skip = start - r->offset;
+#ifdef HAVE_LIBURING
+	r->uring_ok = (io_uring_queue_init(READER_QUEUE, &r->uring, 0) == 0);
+#endif
+	return 0;
+#else
+	return -1;
+#endif
+}
+#endif
+
+//start reading ahead of file, the ring holds at least seconds of media and two reads of max_read bytes
+int reader_init(reader_t *r, FILE *file, const char *name, double bytes_per_sec, unsigned long max_read)
+{
+	unsigned long size = (unsigned long)(read_ahead * bytes_per_sec);
+	
+	if(size < (max_read * 2) + READER_BLOCK)
+	{
+		size = (max_read * 2) + READER_BLOCK;
+	}
+	size = ((size + READER_BLOCK - 1) / READER_BLOCK) * READER_BLOCK;
+	
+	r->file = file;
+	r->name = name;
+	r->size = size;
+	r->rd = 0;
+	r->fill = 0;
+	r->min_fill = size;
+	r->stalls = 0;
+	r->eof = 0;
+	r->error = 0;
+	r->quit = 0;
+	r->backend = read_backend;
+	r->skip = 0;
+	r->map = NULL;
+	r->uring_ok = 0;
+	r->item = 0;
+	r->item_left = -1;
+	r->own = NULL;
+	r->switches = 0;
+	
+	//the first item is cut to whole frames too, from the start position
+	if(r->list && (r->list->nb > 1 || r->loops != 1))
+	{
+		struct stat st;
+		int64_t start = FTELL(file);
+		
+		if(stat(r->list->items[0], &st) == 0 && start >= 0 && st.st_size >= start)
+		{
+			r->item_left = ((st.st_size - start) / r->align) * r->align;
+		}
+		if(r->backend != READER_STDIO)
+		{
+			fprintf(stderr, "(%s) : playlist and loop are read with stdio\n", name);
+			r->backend = READER_STDIO;
+		}
+	}
+	
+#ifndef _WIN32
+	if(r->backend != READER_STDIO && reader_open_backend(r) < 0)
+	{
+		fprintf(stderr, "(%s) : %s input not possible, using stdio\n", name, (r->backend == READER_MMAP) ? "mmap" : "O_DIRECT");
+		r->backend = READER_STDIO;
+	}
+#else
+	r->backend = READER_STDIO;
+#endif
+	
+	if(r->map == NULL)
+	{
+#ifdef _WIN32
+		r->ring = _aligned_malloc(size, READER_ALIGN);
+#else
+		if(posix_memalign((void **)&r->ring, READER_ALIGN, size) != 0)
+		{
+			r->ring = NULL;
+		}
+#endif
+		if(r->ring == NULL)
+		{
+			fprintf(stderr, "(%s) : malloc error (read ahead)\n", name);
+			return -1;
+		}
+	}
+	
+#ifdef HAVE_LIBURING
+	if(r->uring_ok)
+	{
+		r->res = calloc(size / READER_BLOCK, sizeof(int));
+		r->done = calloc(size / READER_BLOCK, 1);
+		if(!r->res || !r->done)
+		{
+			fprintf(stderr, "(%s) : malloc error (read ahead)\n", name);
+			return -1;
+		}
+	}
+#endif
+	
+	pthread_mutex_init(&r->mutex, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	
+	if(pthread_create(&r->thread, NULL, reader_thread, r) != 0)
+	{
+		fprintf(stderr, "Error spawning reader thread\n");
+		return -1;
+	}
+	
+	r->running = 1;
+	return 0;
+}
+
+//wait until the ring is full (or the file is shorter)
+void reader_prime(reader_t *r)
+{
+	if(!r->running)
+	{
+		return;
+	}
+	
+	pthread_mutex_lock(&r->mutex);
+	while((r->size - r->fill) >= READER_BLOCK && !r->eof)
+	{
+		pthread_cond_wait(&r->cond, &r->mutex);
+	}
+	pthread_mutex_unlock(&r->mutex);
+}
+
+//copy len bytes out of the ring, less only at the end of the file
+unsigned long reader_read(reader_t *r, void *dst, unsigned long len)
+{
+	unsigned long n = 0;
+	unsigned long rd = 0;
+	unsigned long first = 0;
+	
+	pthread_mutex_lock(&r->mutex);
+	if(r->fill < len && !r->eof)
+	{
+		r->stalls++;
+	}
+	while(r->fill < len && !r->eof && !r->quit)
+	{
+		pthread_cond_wait(&r->cond, &r->mutex);
+	}
+	n = (r->fill < len) ? r->fill : len;
+	rd = r->rd;
+	pthread_mutex_unlock(&r->mutex);
+	
+	//the reader thread only appends behind fill, the first n bytes are ours
+	first = r->size - rd;
+	if(r->map)
+	{
+		memcpy(dst, r->map + rd, n);
+	}
+	else if(first >= n)
+	{
+		memcpy(dst, r->ring + rd, n);
+	}
+	else
+	{
+		memcpy(dst, r->ring + rd, first);
+		memcpy((unsigned char *)dst + first, r->ring, n - first);
+	}
+	
+	pthread_mutex_lock(&r->mutex);
+	r->rd = r->map ? (rd + n) : ((rd + n) % r->size);
+	r->fill -= n;
+	if(r->fill < r->min_fill)
+	{
+		r->min_fill = r->fill;
+	}
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mutex);
+	
+	return n;
+}
+
+//everything was read and consumed
+int reader_done(reader_t *r)
+{
+	int done = 0;
+	
+	pthread_mutex_lock(&r->mutex);
+	done = r->eof && (r->fill == 0);
+	pthread_mutex_unlock(&r->mutex);
+	
+	return done;
+}
+
+int reader_error(reader_t *r)
+{
+	int error = 0;
+	
+	pthread_mutex_lock(&r->mutex);
+	error = r->error;
+	pthread_mutex_unlock(&r->mutex);
+	
+	return error;
+}
+
+void reader_stats(reader_t *r)
+{
+	if(!r->running)
+	{
+		return;
+	}
+	
+	pthread_mutex_lock(&r->mutex);
+	fprintf(stderr, "Read ahead (%s) : %lu MB, fill %lu %%, lowest %lu %%, %u stalls\n", r->name, r->size >> 20,
+		(r->fill * 100) / r->size, (r->min_fill * 100) / r->size, r->stalls);
+	pthread_mutex_unlock(&r->mutex);
+}
+
+//stop the thread, a consumer waiting in reader_read returns
+void reader_stop(reader_t *r)
+{
+	if(!r->running)
+	{
+		return;
+	}
+	
+	pthread_mutex_lock(&r->mutex);
+	r->quit = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mutex);
+	
+	pthread_join(r->thread, NULL);
+}
+
+//release the ring, once no consumer is left
+void reader_free(reader_t *r)
+{
+	if(!r->running)
+	{
+		return;
+	}
+	
+#ifdef _WIN32
+	_aligned_free(r->ring);
+#else
+	free(r->ring);
+	if(r->map)
+	{
+		munmap(r->map, r->map_len);
+		r->map = NULL;
+	}
+#endif
+#ifdef HAVE_LIBURING
+	if(r->uring_ok)
+	{
+		io_uring_queue_exit(&r->uring);
+		free(r->res);
+		free(r->done);
+	}
+#endif
+	if(r->own)
+	{
+		fclose(r->own);
+		r->own = NULL;
+	}
+	pthread_mutex_destroy(&r->mutex);
+	pthread_cond_destroy(&r->cond);
+	r->ring = NULL;
+	r->running = 0;
+}
+
+//stdin can only be played once, on its own
+int playlist_stdin(playlist_t *p)
+{
+	int i;
+	
+	for(i = 0; i < p->nb; i++)
+	{
+		if(!strcmp(p->items[i], "-") && (p->nb > 1 || repeat != 1))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//items of the playlist, loop count (0 = forever) and frame size, before reader_init
+void reader_set_playlist(reader_t *r, playlist_t *list, int loops, uint64_t align)
+{
+	r->list = list;
+	r->loops = loops;
+	r->align = align ? align : 1;
+}
+
+//add an input file, or every line of a list file given as @file
+int playlist_add(playlist_t *p, char *arg)
+{
+	char line[4096];
+	FILE *f = NULL;
+	size_t len = 0;
+	char **items = NULL;
+	
+	if(arg[0] != '@')
+	{
+		items = realloc(p->items, (p->nb + 1) * sizeof(char *));
+		if(!items){return -1;}
+		p->items = items;
+		if(!(p->items[p->nb] = strdup(arg))){return -1;}
+		p->nb++;
+		return 0;
+	}
+	
+	f = fopen(arg + 1, "r");
+	if(!f)
+	{
+		fprintf(stderr, "Failed to open the playlist %s\n", arg + 1);
+		return -1;
+	}
+	
+	while(fgets(line, sizeof(line), f))
+	{
+		len = strcspn(line, "\r\n");
+		line[len] = 0;
+		if(len == 0 || line[0] == '#')
+		{
+			continue;
+		}
+		
+		items = realloc(p->items, (p->nb + 1) * sizeof(char *));
+		if(!items || !(items[p->nb] = strdup(line)))
+		{
+			fclose(f);
+			return -1;
+		}
+		p->items = items;
+		p->nb++;
+	}
+	fclose(f);
+	
+	if(p->nb == 0)
+	{
+		fprintf(stderr, "The playlist %s is empty\n", arg + 1);
+		return -1;
+	}
+	return 0;
+}
+
+//the items are owned by the playlist
+void playlist_free(playlist_t *p)
+{
+	int i;
+	
+	for(i = 0; i < p->nb; i++)
+	{
+		free(p->items[i]);
+	}
+	free(p->items);
+	p->items = NULL;
+	p->nb = 0;
+}
+
+#ifndef _WIN32
+int stdout_flags = -1;
+#endif
+
+void stdout_nonblock(void)
+{
+#ifndef _WIN32
+	fflush(stdout);
+	stdout_flags = fcntl(STDOUT_FILENO, F_GETFL);
+	if(stdout_flags >= 0)
+	{
+		fcntl(STDOUT_FILENO, F_SETFL, stdout_flags | O_NONBLOCK);
+	}
+#endif
+}
+
+//the file description is shared with the shell, give it back as it was
+void stdout_restore(void)
+{
+#ifndef _WIN32
+	if(stdout_flags >= 0)
+	{
+		fcntl(STDOUT_FILENO, F_SETFL, stdout_flags);
+	}
+	stdout_flags = -1;
+#endif
+}
+
+//write all of buf to stdout (vmsplice into a pipe if splice), while the consumer doesn't read the deadline is checked every OUT_POLL_MS
+//returns 0, or -1 on a write error or once the deadline has passed (errno = ETIMEDOUT)
+int stdout_write(const unsigned char *buf, unsigned long len, int splice, pthread_mutex_t *mutex, const uint64_t *deadline)
+{
+#ifndef _WIN32
+	struct pollfd pfd;
+	uint64_t limit = 0;
+	long n = 0;
+#ifdef __linux__
+	struct iovec iov;
+#endif
+	
+	while(len > 0)
+	{
+#ifdef __linux__
+		if(splice)
+		{
+			iov.iov_base = (void *)buf;
+			iov.iov_len = len;
+			n = vmsplice(STDOUT_FILENO, &iov, 1, SPLICE_F_NONBLOCK);
+		}
+		else
+#endif
+		{
+			n = write(STDOUT_FILENO, buf, len);
+		}
+		
+		if(n > 0)
+		{
+			buf += n;
+			len -= n;
+			continue;
+		}
+		if(n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+			return -1;
+		}
+		
+		pthread_mutex_lock(mutex);
+		limit = *deadline;
+		pthread_mutex_unlock(mutex);
+		if(limit && now_ns() >= limit)
+		{
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		
+		pfd.fd = STDOUT_FILENO;
+		pfd.events = POLLOUT;
+		poll(&pfd, 1, OUT_POLL_MS);
+	}
+	return 0;
+#else
+	//no non-blocking pipes here, the stop waits for the consumer
+	(void)splice;
+	(void)mutex;
+	(void)deadline;
+	return (fwrite(buf, len, 1, stdout) == 1 && fflush(stdout) == 0) ? 0 : -1;
+#endif
+}
+
+//write the released frames, read ahead the next ones while the consumer keeps up
+void *audio_out_thread(void *arg)
+{
+	audio_out_t *a = arg;
+	unsigned char *slot = NULL;
+	unsigned long n = 0;
+	int r = 0;
+	int err = 0;
+	
+	pthread_mutex_lock(&a->mutex);
+	while(1)
+	{
+		if(a->written < a->released && a->written < a->read)
+		{
+			slot = a->ring + ((a->written % AUDIO_RING_FRAMES) * a->frame);
+			pthread_mutex_unlock(&a->mutex);
+			
+			fl2k_trace_begin(dev, FL2K_TRACE_TRACK_APP + 6, "audio", (uint32_t)a->written);
+			r = stdout_write(slot, a->frame, 0, &a->mutex, &a->deadline);
+			err = errno;
+			fl2k_trace_end(dev, FL2K_TRACE_TRACK_APP + 6, "audio", (uint32_t)a->written);
+			
+			pthread_mutex_lock(&a->mutex);
+			if(r < 0)
+			{
+				fprintf(stderr, "Audio out : %s, %llu released frames not written\n",
+					(err == ETIMEDOUT) ? "the consumer stopped reading" : strerror(err), (unsigned long long)(a->released - a->written));
+				break;
+			}
+			a->written++;
+		}
+		//once stopping, only the frames released but not read yet
+		else if(a->read - a->written < AUDIO_RING_FRAMES && (!a->quit || a->read < a->released))
+		{
+			slot = a->ring + ((a->read % AUDIO_RING_FRAMES) * a->frame);
+			pthread_mutex_unlock(&a->mutex);
+			
+			//silence after the end of the file, the pipe keeps the pace of the video
+			n = reader_read(a->src, slot, a->frame);
+			memset(slot + n, 0, a->frame - n);
+			
+			pthread_mutex_lock(&a->mutex);
+			a->read++;
+			pthread_cond_broadcast(&a->cond);
+		}
+		else if(a->quit)
+		{
+			break;
+		}
+		else
+		{
+			pthread_cond_wait(&a->cond, &a->mutex);
+		}
+	}
+	pthread_mutex_unlock(&a->mutex);
+	
+	return NULL;
+}
+
+int audio_out_init(audio_out_t *a, reader_t *src, unsigned long frame)
+{
+	a->src = src;
+	a->frame = frame;
+	a->read = 0;
+	a->released = 0;
+	a->written = 0;
+	a->max_backlog = 0;
+	a->min_fill = AUDIO_RING_FRAMES;
+	a->late = 0;
+	a->deadline = 0;
+	a->quit = 0;
+	a->ring = malloc(AUDIO_RING_FRAMES * frame);
+	if(!a->ring)
+	{
+		fprintf(stderr, "(AUDIO) : malloc error (audio ring)\n");
+		return -1;
+	}
+	
+	pthread_mutex_init(&a->mutex, NULL);
+	pthread_cond_init(&a->cond, NULL);
+	stdout_nonblock();
+	
+	if(pthread_create(&a->thread, NULL, audio_out_thread, a) != 0)
+	{
+		fprintf(stderr, "Error spawning audio thread\n");
+		stdout_restore();
+		pthread_cond_destroy(&a->cond);
+		pthread_mutex_destroy(&a->mutex);
+		free(a->ring);
+		a->ring = NULL;
+		return -1;
+	}
+	
+	a->running = 1;
+	return 0;
+}
+
+//wait until the ring is full
+void audio_out_prime(audio_out_t *a)
+{
+	if(!a->running)
+	{
+		return;
+	}
+	
+	pthread_mutex_lock(&a->mutex);
+	while(a->read < AUDIO_RING_FRAMES && !a->quit)
+	{
+		pthread_cond_wait(&a->cond, &a->mutex);
+	}
+	pthread_mutex_unlock(&a->mutex);
+}
+
+//called by the sync channel at a frame boundary, never waits for the audio consumer
+void audio_out_release(audio_out_t *a)
+{
+	unsigned long fill = 0;
+	
+	pthread_mutex_lock(&a->mutex);
+	fill = (a->read > a->released) ? (a->read - a->released) : 0;
+	if(fill < a->min_fill)
+	{
+		a->min_fill = fill;
+	}
+	if(fill == 0)
+	{
+		a->late++;
+	}
+	a->released++;
+	if(a->released - a->written > a->max_backlog)
+	{
+		a->max_backlog = a->released - a->written;
+	}
+	pthread_cond_signal(&a->cond);
+	pthread_mutex_unlock(&a->mutex);
+}
+
+void audio_out_stats(audio_out_t *a)
+{
+	if(!a->running)
+	{
+		return;
+	}
+	
+	pthread_mutex_lock(&a->mutex);
+	fprintf(stderr, "Audio out : %llu frames written, ring fill %lu / %d frames, lowest %lu, %u late, backlog %llu (max %llu)\n",
+		(unsigned long long)a->written, (unsigned long)(a->read - a->written), AUDIO_RING_FRAMES, a->min_fill, a->late,
+		(unsigned long long)(a->released - a->written), (unsigned long long)a->max_backlog);
+	pthread_mutex_unlock(&a->mutex);
+}
+
+//the frames released so far are written before the thread ends, a consumer that stops reading gets OUT_DRAIN_MS to take them
+void audio_out_stop(audio_out_t *a)
+{
+	if(!a->running)
+	{
+		return;
+	}
+	
+	pthread_mutex_lock(&a->mutex);
+	a->quit = 1;
+	a->deadline = now_ns() + (OUT_DRAIN_MS * 1000000ULL);
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->mutex);
+	
+	pthread_join(a->thread, NULL);
+	stdout_restore();
+	free(a->ring);
+	a->running = 0;
+}
+
+void *pipe_out_thread(void *arg)
+{
+	pipe_out_t *p = arg;
+	unsigned long off = 0;
+	unsigned long len = 0;
+	int r = 0;
+	int err = 0;
+	
+	pthread_mutex_lock(&p->mutex);
+	while(1)
+	{
+		while(p->rd == p->wr && !p->quit)
+		{
+			pthread_cond_wait(&p->cond, &p->mutex);
+		}
+		//the rest is only flushed when the channel was allowed to wait for it
+		if(p->rd == p->wr || (p->quit && p->policy != PIPE_BLOCK))
+		{
+			break;
+		}
+		
+		off = p->rd % p->size;
+		len = p->wr - p->rd;
+		len = (len < p->size - off) ? len : (p->size - off);
+		len = (len < PIPE_WRITE_MAX) ? len : PIPE_WRITE_MAX;
+		pthread_mutex_unlock(&p->mutex);
+		
+		fl2k_trace_begin(dev, FL2K_TRACE_TRACK_APP + 7, "pipe", (uint32_t)(p->rd >> 20));
+		r = stdout_write(p->ring + off, len, p->splice, &p->mutex, &p->deadline);
+		err = errno;
+		fl2k_trace_end(dev, FL2K_TRACE_TRACK_APP + 7, "pipe", (uint32_t)(p->rd >> 20));
+		
+		pthread_mutex_lock(&p->mutex);
+		if(r < 0)
+		{
+			if(err == ETIMEDOUT)
+			{
+				fprintf(stderr, "Pipe out : the consumer stopped reading, %llu bytes not written\n", (unsigned long long)(p->wr - p->rd));
+			}
+			else
+			{
+				fprintf(stderr, "Pipe out : write error (%s), the output is no longer piped\n", strerror(err));
+			}
+			p->closed = 1;
+			pthread_cond_broadcast(&p->cond);
+			break;
+		}
+		
+		p->rd += len;
+		p->done = (p->rd > p->lag) ? (p->rd - p->lag) : 0;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->mutex);
+	
+	return NULL;
+}
+
+int pipe_out_init(pipe_out_t *p, int policy, unsigned long size)
+{
+#ifdef __linux__
+	struct stat st;
+	long pipe_size = 0;
+	
+	//gift-less vmsplice, the ring pages are referenced by the pipe until the consumer reads them
+	if(fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode) && (pipe_size = fcntl(STDOUT_FILENO, F_GETPIPE_SZ)) > 0)
+	{
+		p->splice = 1;
+		p->lag = pipe_size;
+	}
+#endif
+	fflush(stdout);
+	
+	p->policy = policy;
+	p->size = (size > (8 * p->lag)) ? size : (8 * p->lag);
+	p->wr = 0;
+	p->rd = 0;
+	p->done = 0;
+	p->max_fill = 0;
+	p->buffers = 0;
+	p->dropped = 0;
+	p->waits = 0;
+	p->closed = 0;
+	p->deadline = 0;
+	p->quit = 0;
+#ifdef _WIN32
+	p->ring = _aligned_malloc(p->size, READER_ALIGN);
+#else
+	if(posix_memalign((void **)&p->ring, READER_ALIGN, p->size) != 0)
+	{
+		p->ring = NULL;
+	}
+#endif
+	if(!p->ring)
+	{
+		fprintf(stderr, "Pipe out : malloc error\n");
+		return -1;
+	}
+	
+	pthread_mutex_init(&p->mutex, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	stdout_nonblock();
+	
+	if(pthread_create(&p->thread, NULL, pipe_out_thread, p) != 0)
+	{
+		fprintf(stderr, "Error spawning pipe thread\n");
+		stdout_restore();
+		pthread_cond_destroy(&p->cond);
+		pthread_mutex_destroy(&p->mutex);
+#ifdef _WIN32
+		_aligned_free(p->ring);
+#else
+		free(p->ring);
+#endif
+		p->ring = NULL;
+		return -1;
+	}
+	
+	p->running = 1;
+	return 0;
+}
+
+//queue one buffer of the channel, waits only with the block policy
+void pipe_out_push(pipe_out_t *p, const unsigned char *buf, unsigned long len)
+{
+	unsigned long fill = 0;
+	unsigned long keep = 1;
+	unsigned long off = 0;
+	unsigned long first = 0;
+	
+	pthread_mutex_lock(&p->mutex);
+	p->buffers++;
+	fill = p->wr - p->done;
+	
+	if(p->policy == PIPE_DECIMATE)
+	{
+		keep = (fill < p->size / 2) ? 1 : (fill < (p->size / 4) * 3) ? 2 : (fill < (p->size / 8) * 7) ? 4 : 8;
+	}
+	else if(p->policy == PIPE_BLOCK && (p->size - fill) < len && !p->closed)
+	{
+		p->waits++;
+		while((p->size - (p->wr - p->done)) < len && !p->closed && !p->quit)
+		{
+			pthread_cond_wait(&p->cond, &p->mutex);
+		}
+		fill = p->wr - p->done;
+	}
+	
+	if(p->closed || p->quit || (p->buffers % keep) != 0 || (p->size - fill) < len)
+	{
+		p->dropped++;
+		pthread_mutex_unlock(&p->mutex);
+		return;
+	}
+	off = p->wr % p->size;
+	pthread_mutex_unlock(&p->mutex);
+	
+	//the thread only reads behind wr
+	first = p->size - off;
+	if(first >= len)
+	{
+		memcpy(p->ring + off, buf, len);
+	}
+	else
+	{
+		memcpy(p->ring + off, buf, first);
+		memcpy(p->ring, buf + first, len - first);
+	}
+	
+	pthread_mutex_lock(&p->mutex);
+	p->wr += len;
+	if(p->wr - p->done > p->max_fill)
+	{
+		p->max_fill = p->wr - p->done;
+	}
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+}
+
+void pipe_out_stats(pipe_out_t *p)
+{
+	if(!p->running)
+	{
+		return;
+	}
+	
+	pthread_mutex_lock(&p->mutex);
+	fprintf(stderr, "Pipe out : %llu MB written (%s), ring %lu MB, highest fill %lu %%, %u / %u buffers dropped, %u waits%s\n",
+		(unsigned long long)(p->rd >> 20), p->splice ? "vmsplice" : "write", p->size >> 20, (p->max_fill * 100) / p->size,
+		p->dropped, p->buffers, p->waits, p->closed ? ", closed" : "");
+	pthread_mutex_unlock(&p->mutex);
+}
+
+//with the block policy the ring is flushed first, for at most OUT_DRAIN_MS if the consumer stops reading
+//otherwise a write in progress is abandoned as soon as the consumer stalls, a channel waiting for room drops its buffer
+void pipe_out_stop(pipe_out_t *p)
+{
+	if(!p->running)
+	{
+		return;
+	}
+	
+	pthread_mutex_lock(&p->mutex);
+	p->quit = 1;
+	p->deadline = now_ns() + ((p->policy == PIPE_BLOCK) ? (OUT_DRAIN_MS * 1000000ULL) : 0);
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+	
+	pthread_join(p->thread, NULL);
+	stdout_restore();
+}
+
+//once the channels are stopped, the spliced pages are left to the pipe
+void pipe_out_free(pipe_out_t *p)
+{
+	if(!p->running)
+	{
+		return;
+	}
+	
+	p->running = 0;
+	if(p->splice)
+	{
+		return;
+	}
+#ifdef _WIN32
+	_aligned_free(p->ring);
+#else
+	free(p->ring);
+#endif
+}
+
+uint64_t now_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq;
+	LARGE_INTEGER ticks;
+	
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&ticks);
+	return ((ticks.QuadPart / freq.QuadPart) * 1000000000ULL) + (((ticks.QuadPart % freq.QuadPart) * 1000000000ULL) / freq.QuadPart);
+#else
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+#endif
+}
+
+//duration of one buffer in a stage
+void stage_record(int stage, uint64_t ns)
+{
+	stage_stats_t *s = &stage_stats[stage];
+	
+	pthread_mutex_lock(&s->mutex);
+	s->ns[s->nb % STAGE_WINDOW] = (ns < UINT32_MAX) ? ns : UINT32_MAX;
+	s->nb++;
+	pthread_mutex_unlock(&s->mutex);
+}
+
+int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	
+	return (x > y) - (x < y);
+}
+
+//min / avg / p99 / max of the window in ms, 0 if the stage didn't run
+unsigned long stage_window(int stage, double *min, double *avg, double *p99, double *max)
+{
+	stage_stats_t *s = &stage_stats[stage];
+	uint32_t sorted[STAGE_WINDOW];
+	unsigned long n = 0;
+	unsigned long k = 0;
+	double sum = 0;
+	
+	pthread_mutex_lock(&s->mutex);
+	n = (s->nb < STAGE_WINDOW) ? s->nb : STAGE_WINDOW;
+	memcpy(sorted, s->ns, n * sizeof(uint32_t));
+	pthread_mutex_unlock(&s->mutex);
+	
+	*min = *avg = *p99 = *max = 0;
+	if(n == 0)
+	{
+		return 0;
+	}
+	
+	qsort(sorted, n, sizeof(uint32_t), cmp_u32);
+	for(k = 0; k < n; k++)
+	{
+		sum += sorted[k];
+	}
+	*min = sorted[0] / 1e6;
+	*avg = (sum / n) / 1e6;
+	*p99 = sorted[((n * 99) + 99) / 100 - 1] / 1e6;
+	*max = sorted[n - 1] / 1e6;
+	return n;
+}
+
+//one line on stderr, or one json object per line in the -statsJson file
+//fill level of a read ahead ring in percent, now and lowest seen, 0 if the reader is not running
+int reader_level(reader_t *r, unsigned long *fill, unsigned long *low)
+{
+	if(!r->running)
+	{
+		return 0;
+	}
+	
+	pthread_mutex_lock(&r->mutex);
+	*fill = (r->fill * 100) / r->size;
+	*low = (r->min_fill * 100) / r->size;
+	pthread_mutex_unlock(&r->mutex);
+	return 1;
+}
+
+void stats_report(void)
+{
+	reader_t *readers[] = {&reader_r, &reader2_r, &reader_g, &reader2_g, &reader_b, &reader2_b, &reader_audio};
+	unsigned long fill = 0;
+	unsigned long low = 0;
+	int first = 1;
+	double min[NB_STAGES];
+	double avg[NB_STAGES];
+	double p99[NB_STAGES];
+	double max[NB_STAGES];
+	unsigned long n[NB_STAGES];
+	double period = (FL2K_BUF_LEN * 1e3) / output_sample_rate;
+	double worst = 0;
+	char line[1024];
+	int len = 0;
+	int i = 0;
+	
+	for(i = 0; i < NB_STAGES; i++)
+	{
+		n[i] = stage_window(i, &min[i], &avg[i], &p99[i], &max[i]);
+	}
+	worst = max[STAGE_BUFFER];
+	
+	if(stats_json)
+	{
+		len = snprintf(line, sizeof(line), "{\"t\":%.3f,\"period_ms\":%.3f", (now_ns() - stats_start) / 1e9, period);
+		for(i = 0; i < NB_STAGES; i++)
+		{
+			len += snprintf(line + len, sizeof(line) - len, ",\"%s\":{\"n\":%lu,\"min\":%.3f,\"avg\":%.3f,\"p99\":%.3f}",
+					stage_name[i], n[i], min[i], avg[i], p99[i]);
+		}
+		len += snprintf(line + len, sizeof(line) - len, ",\"fill\":{");
+		for(i = 0; i < (int)(sizeof(readers) / sizeof(readers[0])); i++)
+		{
+			if(reader_level(readers[i], &fill, &low))
+			{
+				len += snprintf(line + len, sizeof(line) - len, "%s\"%s\":{\"pct\":%lu,\"low\":%lu}",
+						first ? "" : ",", readers[i]->name, fill, low);
+				first = 0;
+			}
+		}
+		snprintf(line + len, sizeof(line) - len, "},\"margin_p99_ms\":%.3f,\"margin_min_ms\":%.3f,\"late\":%llu}\n",
+			 period - p99[STAGE_BUFFER], period - worst, (unsigned long long)stats_late);
+		fputs(line, stats_json);
+		fflush(stats_json);
+		return;
+	}
+	
+	len = snprintf(line, sizeof(line), "Stages (ms min/avg/p99) :");
+	for(i = 0; i < NB_STAGES; i++)
+	{
+		if(n[i])
+		{
+			len += snprintf(line + len, sizeof(line) - len, " %s %.2f/%.2f/%.2f", stage_name[i], min[i], avg[i], p99[i]);
+		}
+	}
+	
+	//read ahead rings, a level going down shows the disk falling behind
+	for(i = 0; i < (int)(sizeof(readers) / sizeof(readers[0])); i++)
+	{
+		if(reader_level(readers[i], &fill, &low))
+		{
+			len += snprintf(line + len, sizeof(line) - len, "%s %s %lu/%lu", first ? " | fill % (now/low)" : "", readers[i]->name, fill, low);
+			first = 0;
+		}
+	}
+	fprintf(stderr, "%s | period %.2f margin %.2f (p99) %.2f (worst) %llu late\n", line, period,
+		period - p99[STAGE_BUFFER], period - worst, (unsigned long long)stats_late);
+}
+
+//tbc field index, built from the ld-decode .tbc.json metadata and cached next to the file (.tbc.idx)
+#define TBC_FIELD_FIRST 1//first field of a frame
+#define TBC_FIELD_PAD 2//field padded by the decoder (missing in the source)
+#define TBC_FIELD_DUP 4//same seqNo as the previous field
+#define TBC_FIELD_GAP 8//seqNo jumps before this field
+
+typedef struct tbc_index_header
+{
+	char magic[8];
+	uint64_t json_size;
+	int64_t json_mtime;
+	uint32_t field_width;
+	uint32_t field_height;
+	uint32_t nb_fields;
+	uint32_t nb_frames;
+	uint32_t missing;
+	uint32_t duplicated;
+	uint32_t padded;
+	uint32_t orphan;
+} tbc_index_header_t;
+
+//the cache file is the header, the first field of every frame (uint32_t) then the flags of every field (uint8_t)
+typedef struct tbc_index
+{
+	tbc_index_header_t h;
+	FILE *file;//cache file, entries are read on demand
+	uint32_t *frame_field;//in memory when the cache could not be written
+	uint8_t *field_flags;
+} tbc_index_t;
+
+typedef struct json_level
+{
+	char type;//'{' or '['
+	char expect_key;
+	char key[24];//current key of an object
+	char parent[24];//key the container was opened under
+} json_level_t;
+
+static const char tbc_index_magic[8] = {'F','L','2','K','I','D','X','1'};
+
+//read the fields array and the field geometry from the json, everything else is skipped
+int tbc_json_parse(FILE *f, tbc_index_t *idx, int32_t **seq, int8_t **first, uint8_t **pad)
+{
+	json_level_t st[32];
+	char tok[64];
+	int d = -1;
+	int c;
+	int n;
+	int in_field = 0;
+	uint32_t alloc = 0;
+	int32_t cur_seq = -1;
+	int cur_first = -1;
+	int cur_pad = 0;
+	double value;
+	void *tmp = NULL;
+	
+	while((c = getc(f)) != EOF)
+	{
+		if(c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == ':')
+		{
+			continue;
+		}
+		
+		if(c == ',')
+		{
+			if(d >= 0 && st[d].type == '{'){st[d].expect_key = 1;}
+			continue;
+		}
+		
+		if(c == '{' || c == '[')
+		{
+			if(++d == 32){return -1;}
+			st[d].type = c;
+			st[d].expect_key = (c == '{');
+			st[d].key[0] = 0;
+			strcpy(st[d].parent, d > 0 ? st[d - 1].key : "");
+			
+			//root / "fields" array / field object
+			if(d == 2 && c == '{' && st[1].type == '[' && !strcmp(st[1].parent, "fields"))
+			{
+				in_field = 1;
+				cur_seq = -1;
+				cur_first = -1;
+				cur_pad = 0;
+			}
+			continue;
+		}
+		
+		if(c == '}' || c == ']')
+		{
+			if(d < 0){return -1;}
+			
+			if(in_field && d == 2)
+			{
+				if(idx->h.nb_fields == alloc)
+				{
+					//the arrays stay with the caller when growing fails, it frees them
+					alloc = alloc ? alloc * 2 : 65536;
+					if(!(tmp = realloc(*seq, alloc * sizeof(int32_t)))){return -1;}
+					*seq = tmp;
+					if(!(tmp = realloc(*first, alloc))){return -1;}
+					*first = tmp;
+					if(!(tmp = realloc(*pad, alloc))){return -1;}
+					*pad = tmp;
+				}
+				(*seq)[idx->h.nb_fields] = cur_seq;
+				(*first)[idx->h.nb_fields] = cur_first;
+				(*pad)[idx->h.nb_fields] = cur_pad;
+				idx->h.nb_fields++;
+				in_field = 0;
+			}
+			d--;
+			continue;
+		}
+		
+		if(c == '"')
+		{
+			n = 0;
+			while((c = getc(f)) != EOF && c != '"')
+			{
+				if(c == '\\'){c = getc(f);}
+				if(n < 23){tok[n++] = c;}
+			}
+			tok[n] = 0;
+			
+			if(d >= 0 && st[d].type == '{' && st[d].expect_key)
+			{
+				strcpy(st[d].key, tok);
+				st[d].expect_key = 0;
+			}
+			continue;
+		}
+		
+		//number, true, false or null
+		n = 0;
+		do
+		{
+			if(n < 63){tok[n++] = c;}
+			c = getc(f);
+		}
+		while(c != EOF && strchr(",}] \t\r\n", c) == NULL);
+		tok[n] = 0;
+		if(c != EOF){ungetc(c, f);}
+		
+		if(d < 0 || st[d].type != '{')
+		{
+			continue;
+		}
+		
+		value = !strcmp(tok, "true") ? 1 : strtod(tok, NULL);
+		
+		if(in_field && d == 2)
+		{
+			if(!strcmp(st[d].key, "seqNo")){cur_seq = (int32_t)value;}
+			else if(!strcmp(st[d].key, "isFirstField")){cur_first = (value != 0);}
+			else if(!strcmp(st[d].key, "pad")){cur_pad = (value != 0);}
+		}
+		else if(d == 1 && !strcmp(st[d].parent, "videoParameters"))
+		{
+			if(!strcmp(st[d].key, "fieldWidth")){idx->h.field_width = (uint32_t)value;}
+			else if(!strcmp(st[d].key, "fieldHeight")){idx->h.field_height = (uint32_t)value;}
+		}
+	}
+	
+	return d == -1 ? 0 : -1;
+}
+
+//flag the fields and pair them into frames
+int tbc_index_build(tbc_index_t *idx, int32_t *seq, int8_t *first, uint8_t *pad)
+{
+	uint32_t i;
+	int32_t prev_seq = 0;
+	int32_t cur_seq;
+	
+	idx->frame_field = malloc((idx->h.nb_fields / 2 + 1) * sizeof(uint32_t));
+	idx->field_flags = malloc(idx->h.nb_fields + 1);
+	if(!idx->frame_field || !idx->field_flags)
+	{
+		return -1;
+	}
+	
+	for(i = 0; i < idx->h.nb_fields; i++)
+	{
+		cur_seq = (seq[i] < 0) ? (int32_t)i + 1 : seq[i];
+		
+		if(first[i] == -1)//no field order in the metadata
+		{
+			idx->field_flags[i] = (i & 1) ? 0 : TBC_FIELD_FIRST;
+		}
+		else
+		{
+			idx->field_flags[i] = first[i] ? TBC_FIELD_FIRST : 0;
+		}
+		
+		if(pad[i])
+		{
+			idx->field_flags[i] |= TBC_FIELD_PAD;
+			idx->h.padded++;
+		}
+		
+		if(i > 0 && cur_seq == prev_seq)
+		{
+			idx->field_flags[i] |= TBC_FIELD_DUP;
+			idx->h.duplicated++;
+		}
+		else if(i > 0 && cur_seq > prev_seq + 1)
+		{
+			idx->field_flags[i] |= TBC_FIELD_GAP;
+			idx->h.missing += cur_seq - prev_seq - 1;
+		}
+		prev_seq = cur_seq;
+	}
+	
+	//a frame is a first field followed by a second field, unpaired fields are skipped
+	i = 0;
+	while(i < idx->h.nb_fields)
+	{
+		if((idx->field_flags[i] & TBC_FIELD_FIRST) && i + 1 < idx->h.nb_fields && !(idx->field_flags[i + 1] & TBC_FIELD_FIRST))
+		{
+			idx->frame_field[idx->h.nb_frames++] = i;
+			i += 2;
+		}
+		else
+		{
+			idx->h.orphan++;
+			i++;
+		}
+	}
+	
+	return 0;
+}
+
+//write the cache, the index stays in memory if it fails (read only media)
+void tbc_index_save(tbc_index_t *idx, const char *idx_name)
+{
+	char tmp_name[4096];
+	FILE *f;
+	int ok;
+	
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", idx_name);
+	f = fopen(tmp_name, "wb");
+	if(!f)
+	{
+		return;
+	}
+	
+	ok = fwrite(&idx->h, sizeof(idx->h), 1, f) == 1 &&
+		fwrite(idx->frame_field, sizeof(uint32_t), idx->h.nb_frames, f) == idx->h.nb_frames &&
+		fwrite(idx->field_flags, 1, idx->h.nb_fields, f) == idx->h.nb_fields;
+	
+	if(fclose(f) != 0 || !ok || rename(tmp_name, idx_name) != 0)
+	{
+		remove(tmp_name);
+		fprintf(stderr, "tbc index : can't write %s, index kept in memory\n", idx_name);
+	}
+}
+
+void tbc_index_close(tbc_index_t *idx)
+{
+	if(idx->file){fclose(idx->file);}
+	free(idx->frame_field);
+	free(idx->field_flags);
+	memset(idx, 0, sizeof(*idx));
+}
+
+//open the cached index of a tbc file, (re)build it when the json is newer
+int tbc_index_open(tbc_index_t *idx, const char *filename)
+{
+	char json_name[4096];
+	char idx_name[4096];
+	struct stat json_stat;
+	FILE *json;
+	int32_t *seq = NULL;
+	int8_t *first = NULL;
+	uint8_t *pad = NULL;
+	int r;
+	
+	memset(idx, 0, sizeof(*idx));
+	snprintf(json_name, sizeof(json_name), "%s.json", filename);
+	snprintf(idx_name, sizeof(idx_name), "%s.idx", filename);
+	
+	if(stat(json_name, &json_stat) != 0)
+	{
+		return -1;
+	}
+	
+	idx->file = fopen(idx_name, "rb");
+	if(idx->file)
+	{
+		if(fread(&idx->h, sizeof(idx->h), 1, idx->file) == 1 &&
+			!memcmp(idx->h.magic, tbc_index_magic, sizeof(tbc_index_magic)) &&
+			idx->h.json_size == (uint64_t)json_stat.st_size &&
+			idx->h.json_mtime == (int64_t)json_stat.st_mtime)
+		{
+			return 0;
+		}
+		fclose(idx->file);
+		memset(idx, 0, sizeof(*idx));
+	}
+	
+	json = fopen(json_name, "rb");
+	if(!json)
+	{
+		return -1;
+	}
+	setvbuf(json, NULL, _IOFBF, 1 << 20);
+	
+	fprintf(stderr, "tbc index : parsing %s\n", json_name);
+	memcpy(idx->h.magic, tbc_index_magic, sizeof(tbc_index_magic));
+	idx->h.json_size = json_stat.st_size;
+	idx->h.json_mtime = json_stat.st_mtime;
+	
+	r = tbc_json_parse(json, idx, &seq, &first, &pad);
+	fclose(json);
+	
+	if(r < 0 || idx->h.nb_fields == 0 || idx->h.field_width == 0 || idx->h.field_height == 0 || tbc_index_build(idx, seq, first, pad) < 0)
+	{
+		fprintf(stderr, "tbc index : can't read the fields of %s\n", json_name);
+		r = -1;
+	}
+	else
+	{
+		tbc_index_save(idx, idx_name);
+	}
+	
+	free(seq);
+	free(first);
+	free(pad);
+	if(r < 0){tbc_index_close(idx);}
+	return r;
+}
+
+//read one entry of the index, from memory or with a single pread in the cache
+int tbc_index_read(tbc_index_t *idx, uint64_t offset, void *buf, size_t len)
+{
+#ifndef _WIN32
+	return (pread(fileno(idx->file), buf, len, (off_t)offset) == (ssize_t)len) ? 0 : -1;
+#else
+	return (FSEEK(idx->file, offset, 0) == 0 && fread(buf, 1, len, idx->file) == len) ? 0 : -1;
+#endif
+}
+
+//first field of a frame
+int64_t tbc_index_frame(tbc_index_t *idx, uint64_t frame)
+{
+	uint32_t field;
+	
+	if(frame >= idx->h.nb_frames)
+	{
+		return -1;
+	}
+	
+	if(idx->frame_field)
+	{
+		return idx->frame_field[frame];
+	}
+	
+	if(tbc_index_read(idx, sizeof(idx->h) + frame * sizeof(uint32_t), &field, sizeof(field)) < 0)
+	{
+		return -1;
+	}
+	return field;
+}
+
+uint8_t tbc_index_flags(tbc_index_t *idx, uint64_t field)
+{
+	uint8_t flags = 0;
+	
+	if(idx->field_flags)
+	{
+		return idx->field_flags[field];
+	}
+	
+	tbc_index_read(idx, sizeof(idx->h) + (uint64_t)idx->h.nb_frames * sizeof(uint32_t) + field, &flags, 1);
+	return flags;
+}
+
+//parse a -Fstart value : frame number, 'f' and a field number, or a hh:mm:ss:ff timecode
+uint64_t start_parse(const char *spec, int fps, int64_t *field)
+{
+	unsigned int h, m, s, f;
+	
+	*field = -1;
+	if(spec == NULL)
+	{
+		return 0;
+	}
+	
+	if(*spec == 'f' || *spec == 'F')
+	{
+		*field = atoll(spec + 1);
+		return *field / 2;
+	}
+	
+	if(sscanf(spec, "%u:%u:%u:%u", &h, &m, &s, &f) == 4)
+	{
+		return ((uint64_t)(h * 60 + m) * 60 + s) * fps + f;
+	}
+	
+	return atoll(spec);
+}
+
+//byte offset of the first frame to play, from the field index when the tbc has its json, else from the nominal frame size
+uint64_t start_offset(const char *name, const char *filename, int is_tbc, uint64_t frame, int64_t field, uint64_t frame_bytes)
+{
+	tbc_index_t idx;
+	uint64_t field_bytes;
+	int64_t start;
+	
+	if(!is_tbc || strcmp(filename, "-") == 0 || tbc_index_open(&idx, filename) < 0)
+	{
+		if(field >= 0)
+		{
+			if(field & 1){fprintf(stderr, "(%s) : no field index, starting at field %lld\n", name, (long long)(field & ~1));}
+			return (uint64_t)(field / 2) * frame_bytes;
+		}
+		return frame * frame_bytes;
+	}
+	
+	field_bytes = (uint64_t)idx.h.field_width * idx.h.field_height * 2;
+	fprintf(stderr, "(%s) tbc index : %u fields, %u frames, %u missing, %u duplicated, %u padded, %u unpaired\n",
+		name, idx.h.nb_fields, idx.h.nb_frames, idx.h.missing, idx.h.duplicated, idx.h.padded, idx.h.orphan);
+	
+	if(field_bytes * 2 != frame_bytes)
+	{
+		fprintf(stderr, "(%s) tbc index : field size %ux%u doesn't match the input standard, index ignored\n", name, idx.h.field_width, idx.h.field_height);
+		tbc_index_close(&idx);
+		return (field >= 0 ? (uint64_t)(field / 2) : frame) * frame_bytes;
+	}
+	
+	if(field >= 0)
+	{
+		start = field;
+		//keep the field order, playback starts on a first field
+		while(start < idx.h.nb_fields && !(tbc_index_flags(&idx, start) & TBC_FIELD_FIRST))
+		{
+			start++;
+		}
+		if(start != field && start < idx.h.nb_fields)
+		{
+			fprintf(stderr, "(%s) : field %lld is a second field, starting at field %lld\n", name, (long long)field, (long long)start);
+		}
+		if(start >= idx.h.nb_fields){start = -1;}
+	}
+	else
+	{
+		start = tbc_index_frame(&idx, frame);
+	}
+	
+	if(start < 0)
+	{
+		fprintf(stderr, "(%s) : start is past the end of the file (%u frames)\n", name, idx.h.nb_frames);
+		start = idx.h.nb_fields;
+	}
+	else if(tbc_index_flags(&idx, start) & (TBC_FIELD_PAD | TBC_FIELD_DUP | TBC_FIELD_GAP))
+	{
+		fprintf(stderr, "(%s) : field %lld is padded, duplicated or follows missing fields\n", name, (long long)start);
+	}
+	
+	tbc_index_close(&idx);
+	return (uint64_t)start * field_bytes;
+}
+
+void usage(void)
+{
+	fprintf(stderr,
+		"fl2k_file2, a sample player for FL2K VGA dongles\n\n"
+		"Usage:\n"
+		"\t[-d device_index (default: 0)]\n"
+		"\t[-s samplerate (default: 100 MS/s) you can write(ntsc) or (pal)]\n"
+		"\t[-u Set the output sample type of the fl2K to unsigned]\n"
+		"\t[-R filename (use '-' to read from stdin, repeat the option or use @list_file for a playlist)\n"
+		"\t[-G filename (use '-' to read from stdin, repeat the option or use @list_file for a playlist)\n"
+		"\t[-B filename (use '-' to read from stdin, repeat the option or use @list_file for a playlist)\n"
+		"\t[-r number of plays of the inputs (default: 1, 0 = loop forever)\n"
+		"\t[-A audio file (use '-' to read from stdin)\n"
+		"\t[-syncA chanel used for sync the audio file \ default : G \ value = (R ,G ,B)\n"
+		"\t[-R2 secondary file to be combined with R (use '-' to read from stdin)\n"
+		"\t[-G2 secondary file to be combined with G (use '-' to read from stdin)\n"
+		"\t[-B2 secondary file to be combined with B (use '-' to read from stdin)\n"
+		"\t[-R16 (convert bits 16 to 8)\n"
+		"\t[-G16 (convert bits 16 to 8)\n"
+		"\t[-B16 (convert bits 16 to 8)\n"
+		"\t[-R8 interpret R input as 8 bit\n"
+		"\t[-G8 interpret G input as 8 bit\n"
+		"\t[-B8 interpret B input as 8 bit\n"
+		"\t[-resample active output resampling\n"
+		"\t[-signR interpret R input as (1 = signed / 0 = unsigned) or (s = signed / u = unsigned)\n"
+		"\t[-signG interpret G input as (1 = signed / 0 = unsigned) or (s = signed / u = unsigned)\n"
+		"\t[-signB interpret B input as (1 = signed / 0 = unsigned) or (s = signed / u = unsigned)\n"
+		"\t[-cmbModeR combine mode \ default : 0 \ value = (0 ,1 ,2)\n"
+		"\t[-cmbModeG combine mode \ default : 0 \ value = (0 ,1 ,2)\n"
+		"\t[-cmbModeB combine mode \ default : 0 \ value = (0 ,1 ,2)\n"
+		"\t[-tbcR interpret R as tbc file\n"
+		"\t[-tbcG interpret G as tbc file\n"
+		"\t[-tbcB interpret B as tbc file\n"
+		"\t[-not_tbcR disable tbc processing for input R file\n"
+		"\t[-not_tbcG disable tbc processing for input G file\n"
+		"\t[-not_tbcB disable tbc processing for input B file\n"
+		"\t[-CgainR chroma gain for input R (0.0 to 6.0) (using color burst)\n"
+		"\t[-CgainG chroma gain for input G (0.0 to 6.0) (using color burst)\n"
+		"\t[-CgainB chroma gain for input B (0.0 to 6.0) (using color burst)\n"
+		"\t[-SgainR signal gain for output R (0.5 to 2.0) (clipping white)\n"
+		"\t[-SgainG signal gain for output G (0.5 to 2.0) (clipping white)\n"
+		"\t[-SgainB signal gain for output B (0.5 to 2.0) (clipping white)\n"
+		"\t[-VmaxR maximum output voltage for channel R (0.003 to 0.7) (scale value) (disable Cgain and Sgain)\n"
+		"\t[-VmaxG maximum output voltage for channel G (0.003 to 0.7) (scale value) (disable Cgain and Sgain)\n"
+		"\t[-VmaxB maximum output voltage for channel B (0.003 to 0.7) (scale value) (disable Cgain and Sgain)\n"
+		"\t[-MaxValueR max value for channel R (1 to 255) (reference level) (used for Vmax)\n"
+		"\t[-MaxValueG max value for channel G (1 to 255) (reference level) (used for Vmax)\n"
+		"\t[-MaxValueB max value for channel B (1 to 255) (reference level) (used for Vmax)\n"
+		//"\t[-MinValueR min value for channel R (0 to 254) (reference level) (used for Vmax)\n"
+		//"\t[-MinValueG min value for channel G (0 to 254) (reference level) (used for Vmax)\n"
+		//"\t[-MinValueB min value for channel B (0 to 254) (reference level) (used for Vmax)\n"
+		"\t[-ireR IRE level for input R (-50.0 to +50.0)\n"
+		"\t[-ireG IRE level for input G (-50.0 to +50.0)\n"
+		"\t[-ireB IRE level for input B (-50.0 to +50.0)\n"
+		"\t[-FstartR seek to frame for input R (frame, f + field or hh:mm:ss:ff)\n"
+		"\t[-FstartG seek to frame for input G (frame, f + field or hh:mm:ss:ff)\n"
+		"\t[-FstartB seek to frame for input B (frame, f + field or hh:mm:ss:ff)\n"
+		"\t[-audioOffset offset audio from a duration of x frame\n"
+		"\t[-pipeMode (default = A) option : A = Audio file / R = output of R / G = output of G / B = output of B\n"
+		"\t[-render file ('-' = stdout) to write the output to as fast as possible without a device (samples of the active channels interleaved)\n"
+		"\t[-stats print the min / avg / p99 time of each processing stage and the margin to the buffer period every x seconds (0 = only at exit)\n"
+		"\t[-statsJson file to write the stage report to as one json object per line (implies -stats)\n"
+		"\t[-pipePolicy (default = drop) option : drop / decimate / block = what happens to the -pipeMode output when the consumer is too slow\n"
+		"\t[-trace file for the flight recorder (Chrome trace json) written on underflow and on SIGUSR1\n"
+		"\t[-audit file to log a hash of every transfer sent to the device\n"
+		"\t[-adaptiveBuf let the library adapt the number of buffers to the host load, value = maximum number of buffers\n"
+		"\t[-readAhead (default = 2) seconds of each input file read ahead of the output by a separate thread\n"
+		"\t[-threads number of threads processing each channel (default = 1), the buffer is split between them\n"
+		"\t[-resampleEngine (default = soxr) option : soxr / fir = polyphase filter split between the threads / auto = fir from 20 MHz input, soxr below\n"
+		"\t[-readBackend (default = stdio) option : stdio / mmap = mapped file prefetched ahead of playback / direct = O_DIRECT (with io_uring if built with liburing)\n"
+		"\t[-clockSync lock the output to a reference rate in Hz by dropping or repeating samples in the line blanking (0 = nominal rate)\n"
+		"\t[-dacCal DAC calibration file (per channel transfer table applied by the library)\n"
+		"\t[-readMode (default = 0) option : 0 = multit-threading (RGB) / 1 = hybrid (R --> GB) / 2 = hybrid (RG --> B) / 3 = sequential (R -> G -> B)\n"
+		"\n-info-version------------------------------------------------------\n\n"
+		"runtime=%s API="SOXR_THIS_VERSION_STR"\n",
+	soxr_version());
+	exit(1);
+}
+
+const char *get_filename_ext(const char *filename) {
+    const char *dot = strrchr(filename, '.');
+    if(!dot || dot == filename) return "";
+    return dot + 1;
+}
+
+#ifdef _WIN32
+BOOL WINAPI
+sighandler(int signum)
+{
+	if (CTRL_C_EVENT == signum) {
+		fprintf(stderr, "Signal caught, exiting!\n");
+		fl2k_stop_tx(dev);
+		do_exit = 1;
+		return TRUE;
+	}
+	return FALSE;
+}
+#else
+static void sighandler(int signum)
+{
+	fprintf(stderr, "Signal caught, exiting!\n");
+	fl2k_stop_tx(dev);
+	do_exit = 1;
+}
+#endif
+
+#ifndef _WIN32
+static void sighandler_trace(int signum)
+{
+	(void)signum;
+	trace_dump_req = 1;
+}
+#endif
+
+//output samples of filter delay covered by the first input block
+#define RESAMPLE_MARGIN 4096
+
+//create the stream resampler of a channel, the state is kept from one block to the next
+int resampler_open(resample_data *rs, soxr_t *soxr, uint32_t irate, uint32_t orate, char color)
+{
+	unsigned        const chans = (unsigned)1;//nb channel
+	soxr_datatype_t const itype = (soxr_datatype_t)3;
+	unsigned        const ospec = (soxr_datatype_t)11;
+	unsigned long const q_recipe= 0;//SOXR_16_BITQ;//between (0-3) SOXR_16_BITQ = 3
+	unsigned long const q_flags = 0;
+	double   const passband_end = 0;
+	double const stopband_begin = 0;
+	double const phase_response = -1;
+	int       const use_threads = 2;
+	soxr_datatype_t const otype = ospec & 3;
+	
+	soxr_quality_spec_t       q_spec = soxr_quality_spec(q_recipe, q_flags);
+	soxr_io_spec_t            io_spec = soxr_io_spec(itype, otype);
+	soxr_runtime_spec_t const runtime_spec = soxr_runtime_spec(!use_threads);
+	soxr_error_t error;
+	
+	rs->color = color;
+	rs->irate = irate;
+	rs->orate = orate;
+	rs->carry = 0;
+	rs->catchup = 0;
+	rs->deficit = 0;
+	rs->prime = ((uint64_t)RESAMPLE_MARGIN * irate + orate - 1) / orate;
+	rs->fifo_len = 0;
+	rs->in_len = 0;
+	rs->in_total = 0;
+	rs->out_total = 0;
+	rs->short_blocks = 0;
+	rs->started = 0;
+	rs->soxr = NULL;
+	rs->fir = NULL;
+	*soxr = NULL;
+	
+	if(resample_engine == RESAMPLE_FIR || (resample_engine == RESAMPLE_AUTO && irate >= FIR_AUTO_RATE))
+	{
+		rs->fir = fir_open(irate, orate, input_buf_size);
+		if(rs->fir == NULL)
+		{
+			fprintf(stderr, "(%c) resampler : malloc error\n", color);
+			return -1;
+		}
+		fprintf(stderr, "(%c) resampler engine = fir %d taps, %lu phases, %d threads%s\n", color, FIR_TAPS, rs->fir->bank->phases, rs->fir->nb_share,
+			(resample_engine == RESAMPLE_AUTO) ? " (auto : input of 20 MHz or more)" : "");
+		return 0;
+	}
+	
+	// Overrides (if given):
+	if (passband_end   > 0) q_spec.passband_end   = passband_end / 100;
+	if (stopband_begin > 0) q_spec.stopband_begin = stopband_begin / 100;
+	if (phase_response >=0) q_spec.phase_response = phase_response;
+	io_spec.flags = ospec & ~7u;
+	
+	// Create a stream resampler:
+	*soxr = soxr_create(
+	irate, orate, chans,         // Input rate, output rate, # of channels.
+	&error,                         // To report any error during creation.
+	&io_spec, &q_spec, &runtime_spec);
+	
+	if(error)
+	{
+		fprintf(stderr, "(%c) resampler : %s\n", color, error);
+		*soxr = NULL;
+		return -1;
+	}
+	
+	rs->soxr = *soxr;
+	
+	fprintf(stderr, "(%c) resampler engine = %s\n", color, soxr_engine(*soxr));
+	return 0;
+}
+
+void resampler_close(soxr_t soxr)
+{
+	soxr_delete(soxr);
+}
+
+//input samples of the largest block
+unsigned long resampler_max_input(uint32_t irate, uint32_t orate)
+{
+	unsigned long base = ((uint64_t)FL2K_BUF_LEN * irate + orate - 1) / orate;
+	unsigned long prime = ((uint64_t)RESAMPLE_MARGIN * irate + orate - 1) / orate;
+	
+	return base + (2 * prime);
+}
+
+//input samples of the next block, the fraction is carried so the input follows the output rate exactly (processing thread)
+unsigned long resampler_need(resample_data *rs)
+{
+	unsigned long need = 0;
+	unsigned long extra = 0;
+	
+	rs->carry += (uint64_t)FL2K_BUF_LEN * rs->irate;
+	need = rs->carry / rs->orate;
+	rs->carry -= (uint64_t)need * rs->orate;
+	
+	//first block, then catch up if the filter delay was longer than the margin
+	rs->catchup += rs->prime;
+	rs->prime = 0;
+	extra = (rs->catchup < (input_buf_size - need)) ? rs->catchup : (input_buf_size - need);
+	rs->catchup -= extra;
+	
+	return need + extra;
+}
+
+//hand the block to the resampler, after the handshake (processing thread)
+void resampler_push(resample_data *rs, const short *buf, unsigned long len)
+{
+	memcpy(rs->in, buf, len * sizeof(short));
+	rs->in_len = len;
+	
+	if(rs->deficit)
+	{
+		rs->catchup += ((uint64_t)rs->deficit * rs->irate + rs->orate - 1) / rs->orate;
+		rs->deficit = 0;
+	}
+}
+
+void resampler_stats(resample_data *rs)
+{
+	double error = 0;
+	double delay = 0;
+	
+	if(rs->soxr == NULL && rs->fir == NULL)
+	{
+		return;
+	}
+	
+	//output samples the filter still holds
+	if(rs->fir)
+	{
+		delay = ((double)(rs->fir->base + rs->fir->buf_len - rs->fir->idx) - ((double)rs->fir->frac / rs->fir->bank->l)) * rs->orate / rs->irate;
+	}
+	else
+	{
+		delay = soxr_delay(rs->soxr);
+	}
+	
+	//input fed that isn't in the output yet, beyond what the fifo and the filter hold
+	error = ((double)rs->in_total * rs->orate / rs->irate) - rs->out_total - rs->fifo_len - delay;
+	fprintf(stderr, "Resampler (%c) : %llu samples in, %llu out, timing error %.2f samples, %u short blocks\n", rs->color,
+		(unsigned long long)rs->in_total, (unsigned long long)rs->out_total, error, rs->short_blocks);
+}
+
+void fl2k_resample_to_freq(resample_data *rs)
+{
+	soxr_t soxr = rs->soxr;
+	char color = rs->color;
+	char *buf_out = rs->out;
+	short *fifo = rs->fifo;
+	handshake_t *handshake = rs->handshake;
+	//trace track, after the 3 processing tracks
+	uint32_t trace_track = FL2K_TRACE_TRACK_APP + 3 + ((color == 'R') ? 0 : (color == 'G') ? 1 : 2);
+	
+	unsigned long i = 0;
+	unsigned long n = 0;
+	unsigned long used = 0;
+	size_t idone = 0;
+	size_t odone = 0;
+	uint64_t t_stage = 0;
+
+	if(rs->started)//if not first call
+	{
+		fl2k_trace_begin(dev, trace_track, "resample", 0);
+		t_stage = stage_timing ? now_ns() : 0;
+		
+		//all the input of the block goes in, the output is queued
+		if(rs->fir)
+		{
+			rs->fifo_len += fir_process(rs->fir, rs->in, rs->in_len, fifo + rs->fifo_len, rs->fifo_size - rs->fifo_len);
+			used = rs->in_len;
+		}
+		while(used < rs->in_len && rs->fifo_len < rs->fifo_size)
+		{
+			soxr_process(soxr, rs->in + used, rs->in_len - used, &idone, fifo + rs->fifo_len, rs->fifo_size - rs->fifo_len, &odone);
+			used += idone;
+			rs->fifo_len += odone;
+			if(idone == 0 && odone == 0)
+			{
+				break;
+			}
+		}
+		rs->in_total += used;
+		
+		//resize to 8bit and clip value
+		n = (rs->fifo_len < FL2K_BUF_LEN) ? rs->fifo_len : FL2K_BUF_LEN;
+		for(i = 0; i < n; i++)
+		{
+			if(fifo[i] > 255)
+			{
+				buf_out[i] = 255;
+			}
+			else if(fifo[i] < 0)
+			{
+				buf_out[i] = 0;
+			}
+			else
+			{
+				buf_out[i] = fifo[i];
+			}
+		}
+		
+		//not enough output yet, hold the last sample and get more input next time
+		if(n < FL2K_BUF_LEN)
+		{
+			memset(buf_out + n, n ? buf_out[n - 1] : 0, FL2K_BUF_LEN - n);
+			rs->deficit = FL2K_BUF_LEN - n;
+			rs->short_blocks++;
+		}
+		
+		rs->fifo_len -= n;
+		memmove(fifo, fifo + n, rs->fifo_len * sizeof(short));
+		rs->out_total += n;
+		
+		if(stage_timing){stage_record(STAGE_RESAMPLE, now_ns() - t_stage);}
+		fl2k_trace_end(dev, trace_track, "resample", 0);
+	}
+	else//the first block was only read, it is resampled on the next call
+	{
+		rs->started = 1;
+	}
+	
+	//the processing thread may refill the input buffer now
+	handshake_wait(handshake);
+}
+
+//compute number of sample to skip
+unsigned long calc_nb_skip(long sample_cnt,int linelength,long frame_lengt,long bufsize,char standard)
+{
+	int nb_skip = 0;
+	
+	//on enlève ce qui reste avant le skip
+	bufsize -= (frame_lengt - sample_cnt);
+	nb_skip = 1;
+	
+	while(bufsize > 0)
+	{
+		bufsize -= frame_lengt;
+		
+		//if we can do a complet skip
+		if((bufsize - linelength) > 0)
+		{
+			nb_skip ++;
+		}
+		//if we stop in the middle of a skip
+		else if(((bufsize - linelength) < 0) && bufsize > 0)
+		{
+			nb_skip ++;
+		}
+	}
+	
+	if(standard == 'P')
+	{
+		linelength -= 8;//remove the 4 extra sample from the last line
+	}
+	
+	return (nb_skip * linelength);//multiply for giving the number of byte to skip
+}
+
+//allocate the working buffers of a channel
+int arena_alloc(arena_t *arena, int is16, int is_stereo)
+{
+	unsigned long buf_size = input_buf_size * (1 + is16);
+	unsigned long frame_lengt = 0;
+	unsigned long line_lengt = 0;
+	int i = 0;
+	
+	if(video_standard == 'P')
+	{
+		frame_lengt = 709379 * (1 + is16);
+		line_lengt = 1135 * (1 + is16);
+	}
+	else if(video_standard == 'N')
+	{
+		frame_lengt = 477750 * (1 + is16);
+		line_lengt = 910 * (1 + is16);
+	}
+	
+	//calc_nb_skip never skips more than one line per started frame plus one
+	if(frame_lengt)
+	{
+		buf_size += ((buf_size / frame_lengt) + 2) * line_lengt;
+	}
+	
+	arena->calc_size = buf_size;
+	arena->resbuffer = malloc(input_buf_size * 2);
+	arena->tmp_buf = malloc(input_buf_size);
+	arena->calc = malloc(buf_size);
+	arena->calc2 = is_stereo ? malloc(buf_size) : NULL;
+	arena->obuf = resample ? malloc((FL2K_BUF_LEN + (4 * RESAMPLE_MARGIN)) * sizeof(short)) : NULL;
+	arena->piece_max = 4096;
+	arena->piece = malloc(arena->piece_max * sizeof(piece_t));
+	
+	if(!arena->resbuffer || !arena->tmp_buf || !arena->calc ||
+	   (is_stereo && !arena->calc2) || (resample && !arena->obuf) || !arena->piece)
+	{
+		return -1;
+	}
+	
+	arena->nb_chunk = (process_threads > MAX_CHUNKS) ? MAX_CHUNKS : process_threads;
+	for(i = 0; i < arena->nb_chunk; i++)
+	{
+		arena->chunk[i].arena = arena;
+		arena->chunk[i].index = i;
+		if(i > 0 && worker_init(&arena->worker[i], chunk_run, &arena->chunk[i]) < 0)
+		{
+			return -1;
+		}
+	}
+	
+	//touch every page now so the first fields don't take the page faults
+	memset(arena->resbuffer, 0, input_buf_size * 2);
+	memset(arena->tmp_buf, 0, input_buf_size);
+	memset(arena->calc, 0, buf_size);
+	if(arena->calc2)memset(arena->calc2, 0, buf_size);
+	if(arena->obuf)memset(arena->obuf, 0, (FL2K_BUF_LEN + (4 * RESAMPLE_MARGIN)) * sizeof(short));
+	
+	return 0;
+}
+
+void arena_free(arena_t *arena)
+{
+	int i = 0;
+	
+	for(i = 1; i < arena->nb_chunk; i++)
+	{
+		worker_stop(&arena->worker[i]);
+	}
+	free(arena->piece);
+	free(arena->resbuffer);
+	free(arena->tmp_buf);
+	free(arena->calc);
+	free(arena->calc2);
+	free(arena->obuf);
+	memset(arena, 0, sizeof(*arena));
+}
+
+//gates of the chain within a line
+#define SPAN_VIDEO 1//active video (v_start .. v_end)
+#define SPAN_BURST 2//color burst (cbust_start .. cbust_end)
+#define SPAN_CHROMA 4//chroma gain (cbust_start .. cbust_end + is16)
+#define MAX_SPANS 6
+
+typedef struct line_span {
+	unsigned long start;//first line position of the span, it ends at the next one
+	int gates;
+} line_span_t;
+
+//split the line positions where a gate opens or closes, returns the number of spans
+int line_spans(line_span_t *span, unsigned long v_start, unsigned long v_end, unsigned long cbust_start, unsigned long cbust_end, int is16)
+{
+	unsigned long bound[MAX_SPANS] = {0, v_start, v_end + 1, cbust_start, cbust_end + 1, cbust_end + is16 + 1};
+	unsigned long tmp = 0;
+	int nb = 0;
+	int i = 0;
+	int j = 0;
+	
+	for(i = 1; i < MAX_SPANS; i++)
+	{
+		for(j = i; j > 0 && bound[j - 1] > bound[j]; j--)
+		{
+			tmp = bound[j];
+			bound[j] = bound[j - 1];
+			bound[j - 1] = tmp;
+		}
+	}
+	
+	for(i = 0; i < MAX_SPANS; i++)
+	{
+		if(nb > 0 && span[nb - 1].start == bound[i])
+		{
+			continue;
+		}
+		span[nb].start = bound[i];
+		span[nb].gates = 0;
+		if(bound[i] >= v_start && bound[i] <= v_end)span[nb].gates |= SPAN_VIDEO;
+		if(bound[i] >= cbust_start && bound[i] <= cbust_end)span[nb].gates |= SPAN_BURST;
+		if(bound[i] >= cbust_start && bound[i] <= cbust_end + is16)span[nb].gates |= SPAN_CHROMA;
+		nb++;
+	}
+	
+	return nb;
+}
+
+//conversion kernels, 16 bit samples are little endian byte pairs
+//the scalar versions are the reference, the 256 of round() wraps to 0 in the 8 bit output
+void narrow16_c(unsigned char *dst, const unsigned char *src, long n)
+{
+	long k = 0;
+	unsigned short value16 = 0;
+	
+	for(k = 0; k < n; k++)
+	{
+		value16 = ((src[(2 * k) + 1] * 256) + src[2 * k]);
+		dst[k] = round(value16 / 256.0);//convert to 8 bit
+	}
+}
+
+//combine mode 0 : signed sum
+void add16_c(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	unsigned short value16 = 0;
+	unsigned short value16_2 = 0;
+	short *value16_signed = (void *)&value16;
+	short *value16_2_signed = (void *)&value16_2;
+	
+	for(k = 0; k < n; k++)
+	{
+		value16 = ((src[(2 * k) + 1] * 256) + src[2 * k]);
+		value16_2 = ((src2[(2 * k) + 1] * 256) + src2[2 * k]);
+		if((round((*value16_signed + *value16_2_signed)/ 256.0) + 128) < -128)
+		{
+			dst[k] = -128;
+		}
+		else
+		{
+			dst[k] = round((*value16_signed + *value16_2_signed)/ 256.0) + 128;//convert to 8 bit
+		}
+	}
+}
+
+//combine mode 1 : average
+void avg16_c(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	unsigned short value16 = 0;
+	unsigned short value16_2 = 0;
+	
+	for(k = 0; k < n; k++)
+	{
+		value16 = ((src[(2 * k) + 1] * 256) + src[2 * k]);
+		value16_2 = ((src2[(2 * k) + 1] * 256) + src2[2 * k]);
+		dst[k] = round(((value16 + value16_2)/2)/ 256.0);//convert to 8 bit
+	}
+}
+
+//combine mode 2 : active video of the first file
+void video16_c(unsigned char *dst, const unsigned char *src, long n)
+{
+	long k = 0;
+	unsigned short value16 = 0;
+	
+	for(k = 0; k < n; k++)
+	{
+		value16 = ((src[(2 * k) + 1] * 256) + src[2 * k]);
+		dst[k] = round(round((value16)  / 256.0) / 1.34) + 64;//convert to 8 bit
+	}
+}
+
+void add8_c(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	unsigned char value8 = 0;
+	unsigned char value8_2 = 0;
+	char *value8_signed = (void *)&value8;
+	char *value8_2_signed = (void *)&value8_2;
+	
+	for(k = 0; k < n; k++)
+	{
+		value8 = src[k];
+		value8_2 = src2[k];
+		dst[k] = *value8_signed + *value8_2_signed + 128;
+	}
+}
+
+void avg8_c(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	
+	for(k = 0; k < n; k++)
+	{
+		dst[k] = round((src[k] + src2[k])/2);
+	}
+}
+
+#ifdef HAVE_CONVERT_SSE2
+//round(v / 256.0) of 8 unsigned samples, in 16 bit lanes (0 .. 256)
+static inline __m128i round256_sse2(__m128i v)
+{
+	return _mm_add_epi16(_mm_srli_epi16(v, 8), _mm_and_si128(_mm_srli_epi16(v, 7), _mm_set1_epi16(1)));
+}
+
+//round(s / 256.0) + 128 of 4 signed sums, half away from zero
+static inline __m128i round256_signed_sse2(__m128i s)
+{
+	s = _mm_add_epi32(s, _mm_add_epi32(_mm_set1_epi32(128), _mm_srai_epi32(s, 31)));
+	return _mm_and_si128(_mm_add_epi32(_mm_srai_epi32(s, 8), _mm_set1_epi32(128)), _mm_set1_epi32(0xff));
+}
+
+//16 bit lanes to bytes, keeping the low byte
+static inline __m128i pack_low_sse2(__m128i a, __m128i b)
+{
+	const __m128i mask = _mm_set1_epi16(0xff);
+	
+	return _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+}
+
+void narrow16_sse2(unsigned char *dst, const unsigned char *src, long n)
+{
+	long k = 0;
+	__m128i a;
+	__m128i b;
+	
+	for(k = 0; (k + 16) <= n; k += 16)
+	{
+		a = _mm_loadu_si128((const __m128i *)(src + (2 * k)));
+		b = _mm_loadu_si128((const __m128i *)(src + (2 * k) + 16));
+		_mm_storeu_si128((__m128i *)(dst + k), pack_low_sse2(round256_sse2(a), round256_sse2(b)));
+	}
+	narrow16_c(dst + k, src + (2 * k), n - k);
+}
+
+void add16_sse2(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	int j = 0;
+	__m128i a;
+	__m128i b;
+	__m128i w[2];
+	
+	for(k = 0; (k + 16) <= n; k += 16)
+	{
+		for(j = 0; j < 2; j++)
+		{
+			a = _mm_loadu_si128((const __m128i *)(src + (2 * k) + (16 * j)));
+			b = _mm_loadu_si128((const __m128i *)(src2 + (2 * k) + (16 * j)));
+			//sign extend to 32 bit, the sum needs 17 bits
+			w[j] = _mm_packs_epi32(
+				round256_signed_sse2(_mm_add_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(a, a), 16), _mm_srai_epi32(_mm_unpacklo_epi16(b, b), 16))),
+				round256_signed_sse2(_mm_add_epi32(_mm_srai_epi32(_mm_unpackhi_epi16(a, a), 16), _mm_srai_epi32(_mm_unpackhi_epi16(b, b), 16))));
+		}
+		_mm_storeu_si128((__m128i *)(dst + k), _mm_packus_epi16(w[0], w[1]));
+	}
+	add16_c(dst + k, src + (2 * k), src2 + (2 * k), n - k);
+}
+
+void avg16_sse2(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	int j = 0;
+	__m128i a;
+	__m128i b;
+	__m128i w[2];
+	
+	for(k = 0; (k + 16) <= n; k += 16)
+	{
+		for(j = 0; j < 2; j++)
+		{
+			a = _mm_loadu_si128((const __m128i *)(src + (2 * k) + (16 * j)));
+			b = _mm_loadu_si128((const __m128i *)(src2 + (2 * k) + (16 * j)));
+			//(a + b) / 2 rounded down without overflow
+			w[j] = round256_sse2(_mm_add_epi16(_mm_and_si128(a, b), _mm_srli_epi16(_mm_xor_si128(a, b), 1)));
+		}
+		_mm_storeu_si128((__m128i *)(dst + k), pack_low_sse2(w[0], w[1]));
+	}
+	avg16_c(dst + k, src + (2 * k), src2 + (2 * k), n - k);
+}
+
+void video16_sse2(unsigned char *dst, const unsigned char *src, long n)
+{
+	long k = 0;
+	int j = 0;
+	__m128i a;
+	__m128i w[2];
+	
+	for(k = 0; (k + 16) <= n; k += 16)
+	{
+		for(j = 0; j < 2; j++)
+		{
+			a = _mm_loadu_si128((const __m128i *)(src + (2 * k) + (16 * j)));
+			//round(r / 1.34) = (r * 100 + 67) / 134, the division as multiply high (exact up to 25667)
+			a = _mm_add_epi16(_mm_mullo_epi16(round256_sse2(a), _mm_set1_epi16(100)), _mm_set1_epi16(67));
+			w[j] = _mm_add_epi16(_mm_srli_epi16(_mm_mulhi_epu16(a, _mm_set1_epi16(31301)), 6), _mm_set1_epi16(64));
+		}
+		_mm_storeu_si128((__m128i *)(dst + k), _mm_packus_epi16(w[0], w[1]));
+	}
+	video16_c(dst + k, src + (2 * k), n - k);
+}
+
+void add8_sse2(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	__m128i a;
+	__m128i b;
+	
+	for(k = 0; (k + 16) <= n; k += 16)
+	{
+		a = _mm_loadu_si128((const __m128i *)(src + k));
+		b = _mm_loadu_si128((const __m128i *)(src2 + k));
+		_mm_storeu_si128((__m128i *)(dst + k), _mm_add_epi8(_mm_add_epi8(a, b), _mm_set1_epi8(-128)));
+	}
+	add8_c(dst + k, src + k, src2 + k, n - k);
+}
+
+void avg8_sse2(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	__m128i a;
+	__m128i b;
+	
+	for(k = 0; (k + 16) <= n; k += 16)
+	{
+		a = _mm_loadu_si128((const __m128i *)(src + k));
+		b = _mm_loadu_si128((const __m128i *)(src2 + k));
+		//avg rounds up, remove the carry of odd sums
+		_mm_storeu_si128((__m128i *)(dst + k), _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1))));
+	}
+	avg8_c(dst + k, src + k, src2 + k, n - k);
+}
+
+//the avx2 versions work on 32 samples, pack works within the 128 bit lanes so the result is reordered
+__attribute__((target("avx2")))
+static inline __m256i round256_avx2(__m256i v)
+{
+	return _mm256_add_epi16(_mm256_srli_epi16(v, 8), _mm256_and_si256(_mm256_srli_epi16(v, 7), _mm256_set1_epi16(1)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i round256_signed_avx2(__m256i s)
+{
+	s = _mm256_add_epi32(s, _mm256_add_epi32(_mm256_set1_epi32(128), _mm256_srai_epi32(s, 31)));
+	return _mm256_and_si256(_mm256_add_epi32(_mm256_srai_epi32(s, 8), _mm256_set1_epi32(128)), _mm256_set1_epi32(0xff));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i pack_avx2(__m256i a, __m256i b)
+{
+	return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+}
+
+__attribute__((target("avx2")))
+void narrow16_avx2(unsigned char *dst, const unsigned char *src, long n)
+{
+	long k = 0;
+	__m256i a;
+	__m256i b;
+	const __m256i mask = _mm256_set1_epi16(0xff);
+	
+	for(k = 0; (k + 32) <= n; k += 32)
+	{
+		a = _mm256_loadu_si256((const __m256i *)(src + (2 * k)));
+		b = _mm256_loadu_si256((const __m256i *)(src + (2 * k) + 32));
+		a = _mm256_and_si256(round256_avx2(a), mask);
+		b = _mm256_and_si256(round256_avx2(b), mask);
+		_mm256_storeu_si256((__m256i *)(dst + k), pack_avx2(a, b));
+	}
+	narrow16_sse2(dst + k, src + (2 * k), n - k);
+}
+
+__attribute__((target("avx2")))
+void add16_avx2(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	int j = 0;
+	__m256i a;
+	__m256i b;
+	__m256i w[2];
+	
+	for(k = 0; (k + 32) <= n; k += 32)
+	{
+		for(j = 0; j < 2; j++)
+		{
+			a = _mm256_loadu_si256((const __m256i *)(src + (2 * k) + (32 * j)));
+			b = _mm256_loadu_si256((const __m256i *)(src2 + (2 * k) + (32 * j)));
+			//unpack and packs are both per 128 bit lane, so they undo each other
+			w[j] = _mm256_packs_epi32(
+				round256_signed_avx2(_mm256_add_epi32(_mm256_srai_epi32(_mm256_unpacklo_epi16(a, a), 16), _mm256_srai_epi32(_mm256_unpacklo_epi16(b, b), 16))),
+				round256_signed_avx2(_mm256_add_epi32(_mm256_srai_epi32(_mm256_unpackhi_epi16(a, a), 16), _mm256_srai_epi32(_mm256_unpackhi_epi16(b, b), 16))));
+		}
+		_mm256_storeu_si256((__m256i *)(dst + k), pack_avx2(w[0], w[1]));
+	}
+	add16_sse2(dst + k, src + (2 * k), src2 + (2 * k), n - k);
+}
+
+__attribute__((target("avx2")))
+void avg16_avx2(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	int j = 0;
+	__m256i a;
+	__m256i b;
+	__m256i w[2];
+	const __m256i mask = _mm256_set1_epi16(0xff);
+	
+	for(k = 0; (k + 32) <= n; k += 32)
+	{
+		for(j = 0; j < 2; j++)
+		{
+			a = _mm256_loadu_si256((const __m256i *)(src + (2 * k) + (32 * j)));
+			b = _mm256_loadu_si256((const __m256i *)(src2 + (2 * k) + (32 * j)));
+			a = _mm256_add_epi16(_mm256_and_si256(a, b), _mm256_srli_epi16(_mm256_xor_si256(a, b), 1));
+			w[j] = _mm256_and_si256(round256_avx2(a), mask);
+		}
+		_mm256_storeu_si256((__m256i *)(dst + k), pack_avx2(w[0], w[1]));
+	}
+	avg16_sse2(dst + k, src + (2 * k), src2 + (2 * k), n - k);
+}
+
+__attribute__((target("avx2")))
+void video16_avx2(unsigned char *dst, const unsigned char *src, long n)
+{
+	long k = 0;
+	int j = 0;
+	__m256i a;
+	__m256i w[2];
+	
+	for(k = 0; (k + 32) <= n; k += 32)
+	{
+		for(j = 0; j < 2; j++)
+		{
+			a = _mm256_loadu_si256((const __m256i *)(src + (2 * k) + (32 * j)));
+			a = _mm256_add_epi16(_mm256_mullo_epi16(round256_avx2(a), _mm256_set1_epi16(100)), _mm256_set1_epi16(67));
+			w[j] = _mm256_add_epi16(_mm256_srli_epi16(_mm256_mulhi_epu16(a, _mm256_set1_epi16(31301)), 6), _mm256_set1_epi16(64));
+		}
+		_mm256_storeu_si256((__m256i *)(dst + k), pack_avx2(w[0], w[1]));
+	}
+	video16_sse2(dst + k, src + (2 * k), n - k);
+}
+
+__attribute__((target("avx2")))
+void add8_avx2(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	__m256i a;
+	__m256i b;
+	
+	for(k = 0; (k + 32) <= n; k += 32)
+	{
+		a = _mm256_loadu_si256((const __m256i *)(src + k));
+		b = _mm256_loadu_si256((const __m256i *)(src2 + k));
+		_mm256_storeu_si256((__m256i *)(dst + k), _mm256_add_epi8(_mm256_add_epi8(a, b), _mm256_set1_epi8(-128)));
+	}
+	add8_sse2(dst + k, src + k, src2 + k, n - k);
+}
+
+__attribute__((target("avx2")))
+void avg8_avx2(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	__m256i a;
+	__m256i b;
+	
+	for(k = 0; (k + 32) <= n; k += 32)
+	{
+		a = _mm256_loadu_si256((const __m256i *)(src + k));
+		b = _mm256_loadu_si256((const __m256i *)(src2 + k));
+		_mm256_storeu_si256((__m256i *)(dst + k), _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1))));
+	}
+	avg8_sse2(dst + k, src + k, src2 + k, n - k);
+}
+#endif
+
+#ifdef HAVE_CONVERT_NEON
+//round(v / 256.0) of 8 unsigned samples (0 .. 256)
+static inline uint16x8_t round256_neon(uint16x8_t v)
+{
+	return vaddq_u16(vshrq_n_u16(v, 8), vandq_u16(vshrq_n_u16(v, 7), vdupq_n_u16(1)));
+}
+
+//round(s / 256.0) + 128 of 4 signed sums, half away from zero
+static inline int32x4_t round256_signed_neon(int32x4_t s)
+{
+	s = vaddq_s32(s, vaddq_s32(vdupq_n_s32(128), vshrq_n_s32(s, 31)));
+	return vaddq_s32(vshrq_n_s32(s, 8), vdupq_n_s32(128));
+}
+
+//round(r / 1.34) + 64 = (r * 100 + 67) / 134 + 64
+static inline uint8x8_t video_neon(uint16x8_t r)
+{
+	uint16x8_t t = vmlaq_n_u16(vdupq_n_u16(67), r, 100);
+	uint16x8_t q = vcombine_u16(vshrn_n_u32(vmull_n_u16(vget_low_u16(t), 31301), 16), vshrn_n_u32(vmull_n_u16(vget_high_u16(t), 31301), 16));
+	
+	return vmovn_u16(vaddq_u16(vshrq_n_u16(q, 6), vdupq_n_u16(64)));
+}
+
+//vmovn keeps the low byte
+void narrow16_neon(unsigned char *dst, const unsigned char *src, long n)
+{
+	long k = 0;
+	
+	for(k = 0; (k + 16) <= n; k += 16)
+	{
+		vst1q_u8(dst + k, vcombine_u8(vmovn_u16(round256_neon(vld1q_u16((const uint16_t *)(src + (2 * k))))),
+					       vmovn_u16(round256_neon(vld1q_u16((const uint16_t *)(src + (2 * k) + 16))))));
+	}
+	narrow16_c(dst + k, src + (2 * k), n - k);
+}
+
+void add16_neon(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	int16x8_t a;
+	int16x8_t b;
+	int16x4_t w[4];
+	int j = 0;
+	
+	for(k = 0; (k + 16) <= n; k += 16)
+	{
+		for(j = 0; j < 2; j++)
+		{
+			a = vld1q_s16((const int16_t *)(src + (2 * k) + (16 * j)));
+			b = vld1q_s16((const int16_t *)(src2 + (2 * k) + (16 * j)));
+			w[2 * j] = vmovn_s32(round256_signed_neon(vaddl_s16(vget_low_s16(a), vget_low_s16(b))));
+			w[(2 * j) + 1] = vmovn_s32(round256_signed_neon(vaddl_s16(vget_high_s16(a), vget_high_s16(b))));
+		}
+		vst1q_u8(dst + k, vcombine_u8(vmovn_u16(vreinterpretq_u16_s16(vcombine_s16(w[0], w[1]))),
+					       vmovn_u16(vreinterpretq_u16_s16(vcombine_s16(w[2], w[3])))));
+	}
+	add16_c(dst + k, src + (2 * k), src2 + (2 * k), n - k);
+}
+
+void avg16_neon(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	uint16x8_t a;
+	uint16x8_t b;
+	uint8x8_t w[2];
+	int j = 0;
+	
+	for(k = 0; (k + 16) <= n; k += 16)
+	{
+		for(j = 0; j < 2; j++)
+		{
+			a = vld1q_u16((const uint16_t *)(src + (2 * k) + (16 * j)));
+			b = vld1q_u16((const uint16_t *)(src2 + (2 * k) + (16 * j)));
+			w[j] = vmovn_u16(round256_neon(vhaddq_u16(a, b)));
+		}
+		vst1q_u8(dst + k, vcombine_u8(w[0], w[1]));
+	}
+	avg16_c(dst + k, src + (2 * k), src2 + (2 * k), n - k);
+}
+
+void video16_neon(unsigned char *dst, const unsigned char *src, long n)
+{
+	long k = 0;
+	
+	for(k = 0; (k + 16) <= n; k += 16)
+	{
+		vst1q_u8(dst + k, vcombine_u8(video_neon(round256_neon(vld1q_u16((const uint16_t *)(src + (2 * k))))),
+					       video_neon(round256_neon(vld1q_u16((const uint16_t *)(src + (2 * k) + 16))))));
+	}
+	video16_c(dst + k, src + (2 * k), n - k);
+}
+
+void add8_neon(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	
+	for(k = 0; (k + 16) <= n; k += 16)
+	{
+		vst1q_u8(dst + k, vaddq_u8(vaddq_u8(vld1q_u8(src + k), vld1q_u8(src2 + k)), vdupq_n_u8(128)));
+	}
+	add8_c(dst + k, src + k, src2 + k, n - k);
+}
+
+void avg8_neon(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n)
+{
+	long k = 0;
+	
+	for(k = 0; (k + 16) <= n; k += 16)
+	{
+		vst1q_u8(dst + k, vhaddq_u8(vld1q_u8(src + k), vld1q_u8(src2 + k)));
+	}
+	avg8_c(dst + k, src + k, src2 + k, n - k);
+}
+#endif
+
+//table lookup of the adjustment chain
+void lut_c(unsigned char *buf, long n, const unsigned char *table)
+{
+	long k = 0;
+	
+	for(k = 0; k < n; k++)
+	{
+		buf[k] = table[buf[k]];
+	}
+}
+
+#ifdef HAVE_CONVERT_SSE2
+//16 shuffles of 16 entries, each one selected by the high nibble
+__attribute__((target("avx2")))
+void lut_avx2(unsigned char *buf, long n, const unsigned char *table)
+{
+	long k = 0;
+	int t = 0;
+	__m256i tab[16];
+	__m256i v;
+	__m256i lo;
+	__m256i hi;
+	__m256i r;
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	
+	for(t = 0; t < 16; t++)
+	{
+		tab[t] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(table + (16 * t))));
+	}
+	
+	for(k = 0; (k + 32) <= n; k += 32)
+	{
+		v = _mm256_loadu_si256((const __m256i *)(buf + k));
+		lo = _mm256_and_si256(v, nibble);
+		hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+		r = _mm256_setzero_si256();
+		for(t = 0; t < 16; t++)
+		{
+			r = _mm256_or_si256(r, _mm256_and_si256(_mm256_cmpeq_epi8(hi, _mm256_set1_epi8(t)), _mm256_shuffle_epi8(tab[t], lo)));
+		}
+		_mm256_storeu_si256((__m256i *)(buf + k), r);
+	}
+	lut_c(buf + k, n - k, table);
+}
+#endif
+
+#if defined(HAVE_CONVERT_NEON) && defined(__aarch64__)
+//four lookups of 64 entries, out of range indexes give 0
+void lut_neon(unsigned char *buf, long n, const unsigned char *table)
+{
+	long k = 0;
+	uint8x16x4_t tab[4];
+	uint8x16_t v;
+	uint8x16_t r;
+	int t = 0;
+	
+	for(t = 0; t < 4; t++)
+	{
+		tab[t] = vld1q_u8_x4(table + (64 * t));
+	}
+	
+	for(k = 0; (k + 16) <= n; k += 16)
+	{
+		v = vld1q_u8(buf + k);
+		r = vqtbl4q_u8(tab[0], v);
+		r = vorrq_u8(r, vqtbl4q_u8(tab[1], vsubq_u8(v, vdupq_n_u8(64))));
+		r = vorrq_u8(r, vqtbl4q_u8(tab[2], vsubq_u8(v, vdupq_n_u8(128))));
+		r = vorrq_u8(r, vqtbl4q_u8(tab[3], vsubq_u8(v, vdupq_n_u8(192))));
+		vst1q_u8(buf + k, r);
+	}
+	lut_c(buf + k, n - k, table);
+}
+#else
+#define lut_neon lut_c
+#endif
+
+//row of the bank for the fraction of the output position
+static inline const short *fir_row(const fir_bank_t *bank, uint64_t frac)
+{
+	return bank->coef + (((frac * bank->pmul) + (1ULL << 31)) >> 32) * FIR_TAPS;
+}
+
+//n outputs of the polyphase filter, x points to the first tap of the first output
+void fir_c(short *out, long n, const short *x, uint64_t frac, const fir_bank_t *bank)
+{
+	long k = 0;
+	int j = 0;
+	int32_t sum = 0;
+	const short *c = NULL;
+	
+	for(k = 0; k < n; k++)
+	{
+		c = fir_row(bank, frac);
+		sum = 0;
+		for(j = 0; j < FIR_TAPS; j++)
+		{
+			sum += x[j] * c[j];
+		}
+		out[k] = (sum + (1 << (FIR_SHIFT - 1))) >> FIR_SHIFT;
+		
+		x += bank->m_int;
+		frac += bank->m_frac;
+		if(frac >= bank->l)
+		{
+			frac -= bank->l;
+			x++;
+		}
+	}
+}
+
+#ifdef HAVE_CONVERT_SSE2
+static inline int32_t hsum_sse2(__m128i s)
+{
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+	return _mm_cvtsi128_si32(s);
+}
+
+void fir_sse2(short *out, long n, const short *x, uint64_t frac, const fir_bank_t *bank)
+{
+	long k = 0;
+	int j = 0;
+	__m128i s;
+	const short *c = NULL;
+	
+	for(k = 0; k < n; k++)
+	{
+		c = fir_row(bank, frac);
+		s = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)x), _mm_loadu_si128((const __m128i *)c));
+		for(j = 8; j < FIR_TAPS; j += 8)
+		{
+			s = _mm_add_epi32(s, _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(x + j)), _mm_loadu_si128((const __m128i *)(c + j))));
+		}
+		out[k] = (hsum_sse2(s) + (1 << (FIR_SHIFT - 1))) >> FIR_SHIFT;
+		
+		x += bank->m_int;
+		frac += bank->m_frac;
+		if(frac >= bank->l)
+		{
+			frac -= bank->l;
+			x++;
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+void fir_avx2(short *out, long n, const short *x, uint64_t frac, const fir_bank_t *bank)
+{
+	long k = 0;
+	int j = 0;
+	__m256i s;
+	const short *c = NULL;
+	
+	for(k = 0; k < n; k++)
+	{
+		c = fir_row(bank, frac);
+		s = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)x), _mm256_loadu_si256((const __m256i *)c));
+		for(j = 16; j < FIR_TAPS; j += 16)
+		{
+			s = _mm256_add_epi32(s, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)(x + j)), _mm256_loadu_si256((const __m256i *)(c + j))));
+		}
+		out[k] = (hsum_sse2(_mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1))) + (1 << (FIR_SHIFT - 1))) >> FIR_SHIFT;
+		
+		x += bank->m_int;
+		frac += bank->m_frac;
+		if(frac >= bank->l)
+		{
+			frac -= bank->l;
+			x++;
+		}
+	}
+}
+#endif
+
+#ifdef HAVE_CONVERT_NEON
+void fir_neon(short *out, long n, const short *x, uint64_t frac, const fir_bank_t *bank)
+{
+	long k = 0;
+	int j = 0;
+	int32x4_t s;
+	int32x2_t t;
+	const short *c = NULL;
+	
+	for(k = 0; k < n; k++)
+	{
+		c = fir_row(bank, frac);
+		s = vmull_s16(vld1_s16(x), vld1_s16(c));
+		for(j = 4; j < FIR_TAPS; j += 4)
+		{
+			s = vmlal_s16(s, vld1_s16(x + j), vld1_s16(c + j));
+		}
+		t = vadd_s32(vget_low_s32(s), vget_high_s32(s));
+		out[k] = (vget_lane_s32(vpadd_s32(t, t), 0) + (1 << (FIR_SHIFT - 1))) >> FIR_SHIFT;
+		
+		x += bank->m_int;
+		frac += bank->m_frac;
+		if(frac >= bank->l)
+		{
+			frac -= bank->l;
+			x++;
+		}
+	}
+}
+#endif
+
+typedef struct convert_ops {
+	const char *name;
+	void (*narrow16)(unsigned char *dst, const unsigned char *src, long n);
+	void (*add16)(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n);
+	void (*avg16)(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n);
+	void (*video16)(unsigned char *dst, const unsigned char *src, long n);
+	void (*add8)(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n);
+	void (*avg8)(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n);
+	void (*lut)(unsigned char *buf, long n, const unsigned char *table);
+	void (*fir)(short *out, long n, const short *x, uint64_t frac, const fir_bank_t *bank);
+} convert_ops_t;
+
+convert_ops_t convert = { "c", narrow16_c, add16_c, avg16_c, video16_c, add8_c, avg8_c, lut_c, fir_c };
+
+//pick the widest kernels the cpu supports
+void convert_init(void)
+{
+#if defined(HAVE_CONVERT_SSE2)
+	static const convert_ops_t sse2 = { "sse2", narrow16_sse2, add16_sse2, avg16_sse2, video16_sse2, add8_sse2, avg8_sse2, lut_c, fir_sse2 };
+	static const convert_ops_t avx2 = { "avx2", narrow16_avx2, add16_avx2, avg16_avx2, video16_avx2, add8_avx2, avg8_avx2, lut_avx2, fir_avx2 };
+	
+	convert = sse2;
+	if(__builtin_cpu_supports("avx2"))
+	{
+		convert = avx2;
+	}
+#elif defined(HAVE_CONVERT_NEON)
+	static const convert_ops_t neon = { "neon", narrow16_neon, add16_neon, avg16_neon, video16_neon, add8_neon, avg8_neon, lut_neon, fir_neon };
+	
+	convert = neon;
+#endif
+}
+
+//coefficient banks, one per ratio, built before the start
+fir_bank_t *fir_banks = NULL;
+
+uint64_t gcd64(uint64_t a, uint64_t b)
+{
+	uint64_t t = 0;
+	
+	while(b)
+	{
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+//blackman windowed sinc, one row per phase, each row sums to 1 << FIR_SHIFT
+fir_bank_t *fir_bank_get(uint32_t irate, uint32_t orate)
+{
+	uint64_t g = gcd64(irate, orate);
+	fir_bank_t *bank = NULL;
+	double h[FIR_TAPS];
+	double fc = 0;
+	double f = 0;
+	double d = 0;
+	double u = 0;
+	double sum = 0;
+	short *row = NULL;
+	int32_t total = 0;
+	int peak = 0;
+	unsigned long p = 0;
+	int j = 0;
+	
+	for(bank = fir_banks; bank; bank = bank->next)
+	{
+		if(bank->m == irate / g && bank->l == orate / g)
+		{
+			bank->refs++;
+			return bank;
+		}
+	}
+	
+	bank = calloc(1, sizeof(fir_bank_t));
+	if(!bank)
+	{
+		return NULL;
+	}
+	
+	bank->m = irate / g;
+	bank->l = orate / g;
+	bank->m_int = bank->m / bank->l;
+	bank->m_frac = bank->m % bank->l;
+	bank->phases = (bank->l <= FIR_PHASES) ? bank->l : FIR_PHASES;
+	bank->pmul = ((uint64_t)bank->phases << 32) / bank->l;
+	bank->coef = malloc((bank->phases + 1) * FIR_TAPS * sizeof(short));
+	if(!bank->coef)
+	{
+		free(bank);
+		return NULL;
+	}
+	
+	//cutoff in cycles per input sample, 90 % of the lower nyquist
+	fc = 0.45 * ((bank->l < bank->m) ? ((double)bank->l / bank->m) : 1.0);
+	
+	for(p = 0; p <= bank->phases; p++)
+	{
+		f = (double)p / bank->phases;
+		sum = 0;
+		for(j = 0; j < FIR_TAPS; j++)
+		{
+			d = j - ((FIR_TAPS / 2) - 1) - f;
+			u = d / (FIR_TAPS / 2);
+			h[j] = (d == 0) ? (2 * fc) : (sin(2 * M_PI * fc * d) / (M_PI * d));
+			h[j] *= (fabs(u) < 1) ? (0.42 + (0.5 * cos(M_PI * u)) + (0.08 * cos(2 * M_PI * u))) : 0;
+			sum += h[j];
+		}
+		
+		row = bank->coef + (p * FIR_TAPS);
+		total = 0;
+		peak = 0;
+		for(j = 0; j < FIR_TAPS; j++)
+		{
+			row[j] = lround((h[j] / sum) * (1 << FIR_SHIFT));
+			total += row[j];
+			if(row[j] > row[peak]){peak = j;}
+		}
+		row[peak] += (1 << FIR_SHIFT) - total;
+	}
+	
+	bank->refs = 1;
+	bank->next = fir_banks;
+	fir_banks = bank;
+	return bank;
+}
+
+//the last channel using a bank frees it
+void fir_bank_put(fir_bank_t *bank)
+{
+	fir_bank_t **link = &fir_banks;
+	
+	if(!bank || --bank->refs > 0)
+	{
+		return;
+	}
+	
+	while(*link && *link != bank)
+	{
+		link = &(*link)->next;
+	}
+	if(*link)
+	{
+		*link = bank->next;
+	}
+	free(bank->coef);
+	free(bank);
+}
+
+//outputs of one share of the block
+void *fir_run(void *arg)
+{
+	fir_job_t *job = arg;
+	fir_t *fir = job->fir;
+	fir_bank_t *bank = fir->bank;
+	unsigned long first = (fir->n * job->index) / fir->nb_share;
+	unsigned long last = (fir->n * (job->index + 1)) / fir->nb_share;
+	uint64_t pos = fir->frac + (first * bank->m);
+	int64_t idx = fir->idx + (pos / bank->l);
+	
+	//the shares read overlapping parts of the input
+	convert.fir(fir->out + first, last - first, fir->buf + (idx - fir->base - ((FIR_TAPS / 2) - 1)), pos % bank->l, bank);
+	return NULL;
+}
+
+fir_t *fir_open(uint32_t irate, uint32_t orate, unsigned long max_input)
+{
+	fir_t *fir = calloc(1, sizeof(fir_t));
+	int i = 0;
+	
+	if(!fir)
+	{
+		return NULL;
+	}
+	
+	fir->bank = fir_bank_get(irate, orate);
+	fir->buf_size = max_input + (2 * FIR_TAPS);
+	fir->buf = calloc(fir->buf_size, sizeof(short));
+	if(!fir->bank || !fir->buf)
+	{
+		fir_bank_put(fir->bank);
+		free(fir->buf);
+		free(fir);
+		return NULL;
+	}
+	
+	//silence before the first sample
+	fir->buf_len = (FIR_TAPS / 2) - 1;
+	fir->base = -(int64_t)fir->buf_len;
+	
+	fir->nb_share = (process_threads > MAX_CHUNKS) ? MAX_CHUNKS : process_threads;
+	for(i = 0; i < fir->nb_share; i++)
+	{
+		fir->job[i].fir = fir;
+		fir->job[i].index = i;
+		if(i > 0 && worker_init(&fir->worker[i], fir_run, &fir->job[i]) < 0)
+		{
+			fir->nb_share = i;
+			break;
+		}
+	}
+	
+	return fir;
+}
+
+//take all the input, return the outputs it completes
+unsigned long fir_process(fir_t *fir, const short *in, unsigned long in_len, short *out, unsigned long out_max)
+{
+	fir_bank_t *bank = fir->bank;
+	short *buf = NULL;
+	int64_t lim = 0;
+	int64_t drop = 0;
+	uint64_t pos = 0;
+	unsigned long n = 0;
+	int i = 0;
+	
+	if(fir->buf_len + in_len > fir->buf_size)
+	{
+		buf = realloc(fir->buf, (fir->buf_len + in_len) * sizeof(short));
+		if(!buf)
+		{
+			return 0;
+		}
+		fir->buf = buf;
+		fir->buf_size = fir->buf_len + in_len;
+	}
+	memcpy(fir->buf + fir->buf_len, in, in_len * sizeof(short));
+	fir->buf_len += in_len;
+	
+	//outputs with all their taps in the buffer
+	lim = fir->base + (int64_t)fir->buf_len - 1 - (FIR_TAPS / 2);
+	if(fir->idx <= lim)
+	{
+		n = ((((uint64_t)(lim - fir->idx + 1)) * bank->l) - fir->frac + bank->m - 1) / bank->m;
+	}
+	n = (n < out_max) ? n : out_max;
+	
+	fir->out = out;
+	fir->n = n;
+	for(i = 1; i < fir->nb_share; i++)
 	{
-		irate = (float)data_info->g_rate;
-		ibuf = data_info->g_buf_res;
-		ilen = data_info->g_buf_len;
+		worker_post(&fir->worker[i]);
 	}
-	if(color == 'B')
+	fir_run(&fir->job[0]);
+	for(i = 1; i < fir->nb_share; i++)
 	{
-		irate = (float)data_info->b_rate;
-		ibuf = data_info->b_buf_res;
-		ilen = data_info->b_buf_len;
+		worker_wait(&fir->worker[i]);
 	}
 	
-	unsigned int i = 0;
-	char const *     const arg0 = "", * engine = "";
+	pos = fir->frac + (n * bank->m);
+	fir->idx += pos / bank->l;
+	fir->frac = pos % bank->l;
 	
-	double          const orate = (float)orate0;
-	unsigned        const chans = (unsigned)1;//nb channel
-	soxr_datatype_t const itype = (soxr_datatype_t)3;
-	unsigned        const ospec = (soxr_datatype_t)11;
-	unsigned long const q_recipe= 0;//SOXR_16_BITQ;//between (0-3) SOXR_16_BITQ = 3
-	unsigned long const q_flags = 0;
-	double   const passband_end = 0;
-	double const stopband_begin = 0;
-	double const phase_response = -1;
-	int       const use_threads = 2;
-	soxr_datatype_t const otype = ospec & 3;
-	
-	soxr_quality_spec_t       q_spec = soxr_quality_spec(q_recipe, q_flags);
-	soxr_io_spec_t            io_spec = soxr_io_spec(itype, otype);
-	soxr_runtime_spec_t const runtime_spec = soxr_runtime_spec(!use_threads);
-	
-	// Allocate resampling input and output buffers in proportion to the input
-	// and output rates:
-	size_t const osize = soxr_datatype_size(otype) * chans;
-	size_t const isize = soxr_datatype_size(itype) * chans;
-	size_t const olen = FL2K_BUF_LEN;
-	size_t odone, clips = 0;
-	soxr_error_t error;
+	//keep the input from the first tap of the next output
+	drop = fir->idx - ((FIR_TAPS / 2) - 1) - fir->base;
+	if(drop > 0)
+	{
+		memmove(fir->buf, fir->buf + drop, (fir->buf_len - drop) * sizeof(short));
+		fir->buf_len -= drop;
+		fir->base += drop;
+	}
 	
-	// Overrides (if given):
-	if (passband_end   > 0) q_spec.passband_end   = passband_end / 100;
-	if (stopband_begin > 0) q_spec.stopband_begin = stopband_begin / 100;
-	if (phase_response >=0) q_spec.phase_response = phase_response;
-	io_spec.flags = ospec & ~7u;
+	return n;
+}
+
+void fir_close(fir_t *fir)
+{
+	int i = 0;
 	
-	// Create a stream resampler:
-	*soxr = soxr_create(
-	irate, orate, chans,         // Input rate, output rate, # of channels.
-	&error,                         // To report any error during creation.
-	&io_spec, &q_spec, &runtime_spec);
+	if(!fir)
+	{
+		return;
+	}
 	
-	if (!error)                      // Register input_fn with the resampler:
+	for(i = 1; i < fir->nb_share; i++)
 	{
-		//set input buffer
-		error = soxr_set_input_fn(*soxr, (soxr_input_fn_t)soxr_input_fn, ibuf, ilen);
+		worker_stop(&fir->worker[i]);
 	}
-
-	fprintf(stderr,"engine inside = %s\n",soxr_engine(*soxr));
+	fir_bank_put(fir->bank);
+	free(fir->buf);
+	free(fir);
 }
 
-void fl2k_resample_to_freq(resample_data *soxr_data)
+//convert n samples to 8 bit and combine the two files, video selects the source of combine mode 2
+void span_convert(unsigned char *dst, const unsigned char *src, const unsigned char *src2, long n, int is16, int is_stereo, int combine_mode, int video)
 {
-	soxr_t soxr = soxr_data->soxr;
-	fl2k_data_info_t *data_info = soxr_data->data_info;
-	char color = soxr_data->color;
-	
-	int resampled = 0;
-	char *buf_out;
-	short *buf_res;
-	int *process_state = soxr_data->state_process;
-	int *resample_state = soxr_data->state_resample;
-	
-	if(color == 'R')
+	if(is16 == 1 && is_stereo && combine_mode == 0)//default
+	{
+		convert.add16(dst, src, src2, n);
+	}
+	else if(is16 == 1 && is_stereo && combine_mode == 2)
+	{
+		if(video)
+		{
+			convert.video16(dst, src, n);
+		}
+		else
+		{
+			convert.narrow16(dst, src2, n);
+		}
+	}
+	else if(is16 == 1 && is_stereo)//mode 1
+	{
+		convert.avg16(dst, src, src2, n);
+	}
+	else if(is16 == 1)
+	{
+		convert.narrow16(dst, src, n);
+	}
+	else if(is_stereo && combine_mode == 0)//combine 2 file
 	{
-		resampled = data_info->r_sample_resampled;
-		buf_out = data_info->r_buf;
-		buf_res = data_info->r_buf_res;
+		convert.add8(dst, src, src2, n);
 	}
-	if(color == 'G')
+	else if(is_stereo)//mode 1
 	{
-		resampled = data_info->g_sample_resampled;
-		buf_out = data_info->g_buf;
-		buf_res = data_info->g_buf_res;
+		convert.avg8(dst, src, src2, n);
 	}
-	if(color == 'B')
+	else//no processing
 	{
-		resampled = data_info->b_sample_resampled;
-		buf_out = data_info->b_buf;
-		buf_res = data_info->b_buf_res;
+		memcpy(dst, src, n);
 	}
+}
+
+void span_chroma_gain(unsigned char *buf, long n, double chroma_gain)
+{
+	long k = 0;
 	
-	unsigned int i = 0;
-	size_t const olen = FL2K_BUF_LEN;
-	void * const obuf = malloc(2 * olen);
-	short *obuf16 = (void *)obuf;
+	for(k = 0; k < n; k++)
+	{
+		buf[k] = round(buf[k] / chroma_gain);
+	}
+}
 
-	if(*resample_state != 0)//if not first call
+//ire 7.5 to ire 0
+void span_ire(unsigned char *buf, long n, const float ire_min, const float ire_gain, const float ire_add)
+{
+	long k = 0;
+	double ire_tmp = 0;
+	
+	for(k = 0; k < n; k++)
 	{
-		//set status to ready
-		*resample_state = 1;
-			
-		//wait fl2K_callback to be ready
-		while(*process_state != 1){usleep(1);}
+		ire_tmp = (buf[k] - ire_min);
 		
-		//set status to processing
-		//*resample_state = 2;
-		//process data
-		soxr_output(soxr, obuf, olen);
-		//resize to 8bit and clip value
-		//fprintf(stderr,"r\n");
-		i = 0;
-		while(i < FL2K_BUF_LEN)
+		if(ire_tmp < 0)//clipping value
+		{
+			ire_tmp = 0;
+		}
+		ire_tmp = ire_tmp * ire_gain;
+		buf[k] =  round(ire_tmp + ire_add + ire_min);
+	}
+}
+
+//the position independent end of the chain, applied to the whole buffer
+void buffer_finish(unsigned char *buf, short *res, long n, double signal_gain, double v_max, int max_value, int is_signed)
+{
+	long k = 0;
+	
+	//signal gain
+	if(signal_gain != 1)
+	{
+		for(k = 0; k < n; k++)
 		{
-			if(obuf16[i] > 255)
+			if(buf[k] > 5)
 			{
-				buf_out[i] = 255;
+				if((buf[k] * signal_gain) > 255)
+				{
+					buf[k] = 255;
+				}
+				else
+				{
+					buf[k] = round(buf[k] * signal_gain);
+				}
 			}
-			else if(obuf16[i] < 0)
+		}
+	}
+	
+	//scale to max voltage
+	if(v_max > 0.0)
+	{
+		for(k = 0; k < n; k++)
+		{
+			if(round(buf[k]*(255/max_value)) > 255)
 			{
-				buf_out[i] = 0;
+				buf[k] = 255;
 			}
 			else
 			{
-				buf_out[i] = obuf16[i];
+				buf[k] = round((buf[k]*(255/max_value))/(0.7/v_max));
 			}
-			
-			i++;
 		}
 	}
-	else//initialisation
+	
+	//fix sign and cast to 16 bit
+	if(!is_signed)
 	{
-		//set status to ready
-		*resample_state = 1;
-			
-		//wait fl2K_callback to be ready
-		while(*process_state != 1){usleep(1);}
-		//set status to processing
-		//*resample_state = 2;
-		//set empty buffer while first data are processed
-		i = 0;
-		while(i < FL2K_BUF_LEN)
-		{
-			buf_out[i] = 0;
-			i++;
+		for(k = 0; k < n; k++)
+		{
+			buf[k] = buf[k] - 128;
+			res[k] = buf[k];
 		}
 	}
+	else
+	{
+		for(k = 0; k < n; k++)
+		{
+			res[k] = buf[k];
+		}
+	}
+}
+
+//regions of the adjustment chain, index of the tables
+#define LUT_CHROMA 1//chroma gain window of the active lines
+#define LUT_IRE 2//active video of the active lines
+
+//compose chroma gain, ire, signal gain, voltage scaling and sign into one table per region
+void lut_build(arena_t *arena, double chroma_gain, double ire_level, double signal_gain, double v_max, int max_value, int is_signed)
+{
+	//IRE
+	const float ire_conv = 1.59375;// (255/160)
+	const float ire_min = 63.75;//40 * (255/160)
+	const float ire_new_max = 159.375;// (140 * (255/160)) - (40 * (255/160))
+	const float ire_add = (ire_level * ire_conv);
+	const float ire_gain = (ire_new_max / (ire_new_max + ire_add));
+	const double key[6] = {chroma_gain, ire_level, signal_gain, v_max, max_value, is_signed};
+	short res[256];
+	int region = 0;
+	int v = 0;
+	
+	if(arena->lut_valid && memcmp(arena->lut_key, key, sizeof(key)) == 0)
+	{
+		return;
+	}
 	
-	//set status to finished
-	*resample_state = 3;
-	//wait fl2K_callback to finish
-	while(*process_state != 3){usleep(1);}
+	for(region = 0; region < 4; region++)
+	{
+		for(v = 0; v < 256; v++)
+		{
+			arena->lut[region][v] = v;
+		}
+		
+		if((region & LUT_CHROMA) && chroma_gain != 1)
+		{
+			span_chroma_gain(arena->lut[region], 256, chroma_gain);
+		}
+		if((region & LUT_IRE) && ire_level != 0)
+		{
+			span_ire(arena->lut[region], 256, ire_min, ire_gain, ire_add);
+		}
+		buffer_finish(arena->lut[region], res, 256, signal_gain, v_max, max_value, is_signed);
+		
+		arena->lut_identity[region] = 1;
+		for(v = 0; v < 256; v++)
+		{
+			arena->lut_identity[region] &= (arena->lut[region][v] == v);
+		}
+	}
 	
-	free(obuf);
+	memcpy(arena->lut_key, key, sizeof(key));
+	arena->lut_valid = 1;
 }
 
-//compute number of sample to skip
-unsigned long calc_nb_skip(long sample_cnt,int linelength,long frame_lengt,long bufsize,char standard)
+//add a run to the plan, merged with the previous one when it follows it with the same processing
+int piece_add(arena_t *arena, unsigned long i, unsigned long y, unsigned long n, unsigned long step, int video, int region)
 {
-	int nb_skip = 0;
+	piece_t *last = arena->nb_piece ? &arena->piece[arena->nb_piece - 1] : NULL;
+	piece_t *piece = NULL;
 	
-	//on enlève ce qui reste avant le skip
-	bufsize -= (frame_lengt - sample_cnt);
-	nb_skip = 1;
+	if(last && last->video == video && last->region == region && (last->i + last->n) == i && (last->y + (last->n * step)) == y)
+	{
+		last->n += n;
+		return 0;
+	}
 	
-	while(bufsize > 0)
+	if(arena->nb_piece == arena->piece_max)
 	{
-		bufsize -= frame_lengt;
-		
-		//if we can do a complet skip
-		if((bufsize - linelength) > 0)
+		piece = realloc(arena->piece, arena->piece_max * 2 * sizeof(piece_t));
+		if(!piece)
 		{
-			nb_skip ++;
+			return -1;
 		}
-		//if we stop in the middle of a skip
-		else if(((bufsize - linelength) < 0) && bufsize > 0)
+		arena->piece = piece;
+		arena->piece_max *= 2;
+	}
+	
+	piece = &arena->piece[arena->nb_piece++];
+	piece->i = i;
+	piece->y = y;
+	piece->n = n;
+	piece->video = video;
+	piece->region = region;
+	return 0;
+}
+
+//convert one share of the planned buffer and cast it to 16 bit, every sample only depends on its piece
+void *chunk_run(void *arg)
+{
+	chunk_t *chunk = arg;
+	arena_t *arena = chunk->arena;
+	piece_t *piece = NULL;
+	unsigned long step = 1 + arena->is16;
+	unsigned long first = (arena->nb_sample * chunk->index) / arena->nb_chunk;
+	unsigned long last = (arena->nb_sample * (chunk->index + 1)) / arena->nb_chunk;
+	unsigned long lo = 0;
+	unsigned long hi = arena->nb_piece;
+	unsigned long mid = 0;
+	unsigned long start = 0;
+	unsigned long end = 0;
+	unsigned long k = 0;
+	uint64_t t0 = 0;
+	uint64_t t1 = 0;
+	
+	chunk->ns_convert = 0;
+	chunk->ns_gain = 0;
+	
+	//cache line aligned shares
+	first = (chunk->index == 0) ? 0 : (first & ~63UL);
+	last = (chunk->index == arena->nb_chunk - 1) ? arena->nb_sample : (last & ~63UL);
+	
+	//first piece ending after the start of the share
+	while(lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if(arena->piece[mid].i + arena->piece[mid].n <= first)
 		{
-			nb_skip ++;
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
 		}
 	}
 	
-	if(standard == 'P')
+	for(; lo < arena->nb_piece && arena->piece[lo].i < last; lo++)
 	{
-		linelength -= 8;//remove the 4 extra sample from the last line
+		piece = &arena->piece[lo];
+		start = (piece->i > first) ? piece->i : first;
+		end = ((piece->i + piece->n) < last) ? (piece->i + piece->n) : last;
+		
+		if(stage_timing){t0 = now_ns();}
+		span_convert(arena->tmp_buf + start, arena->calc + piece->y + ((start - piece->i) * step),
+			     arena->is_stereo ? arena->calc2 + piece->y + ((start - piece->i) * step) : NULL,
+			     end - start, arena->is16, arena->is_stereo, arena->combine_mode, piece->video);
+		if(stage_timing){t1 = now_ns(); chunk->ns_convert += t1 - t0;}
+		
+		//chroma gain, ire, signal gain, voltage and sign in one lookup
+		if(!arena->lut_identity[piece->region])
+		{
+			convert.lut(arena->tmp_buf + start, end - start, arena->lut[piece->region]);
+			if(stage_timing){chunk->ns_gain += now_ns() - t1;}
+		}
 	}
 	
-	return (nb_skip * linelength);//multiply for giving the number of byte to skip
+	//cast to 16 bit for the resampler
+	if(stage_timing){t0 = now_ns();}
+	for(k = first; k < last; k++)
+	{
+		arena->resbuffer[k] = arena->tmp_buf[k];
+	}
+	if(stage_timing){chunk->ns_convert += now_ns() - t0;}
+	
+	return NULL;
 }
 
 int read_sample_file(void *inpt_color)
 {
 	//parametter
 	char *buffer = NULL;
-	short *resbuffer = malloc(input_buf_size*2);//used for cast 8 bit to 16 bit
-	FILE *stream = NULL;
-	FILE *stream2 = NULL;
-	FILE *streamA = NULL;
+	arena_t *arena = NULL;
+	reader_t *stream = NULL;
+	reader_t *stream2 = NULL;
 	int istbc = 0;
 	char color = (char *) inpt_color;
 	//uint32_t sample_rate = input_sample_rate;
@@ -552,7 +4268,7 @@ int read_sample_file(void *inpt_color)
 	int use_pipe = 0;
 	
 	long i = 0;//counter for tmp_buf
-	long y = 0;//counter for calc
+	unsigned long y = 0;//counter for calc, same type as buf_size
 	
 	//(NTSC line = 910 frame = 477750) (PAL line = 1135 frame = 709375)
 	unsigned long frame_lengt = 0;
@@ -561,13 +4277,8 @@ int read_sample_file(void *inpt_color)
 	unsigned int v_end =0;
 	unsigned long line_lengt = 0;
 	unsigned long sample_skip = 0;
-	unsigned int audio_frame = 0;
 	
 	//COLOR BURST
-	unsigned int cbust_sample = 0;
-	unsigned int cbust_middle = 0;
-	double cbust_count = 0;
-	double cbust_offset = 0;
 	unsigned int cbust_start = 0;
 	unsigned int cbust_end = 0;
 	
@@ -577,16 +4288,20 @@ int read_sample_file(void *inpt_color)
 	uint32_t *line_sample_cnt = NULL;
 	uint32_t *field_cnt = NULL;
 	
-	int *process_state = NULL;
-	int *resample_state = NULL;
+	handshake_t *handshake = NULL;
+	resample_data *rs = NULL;
+	
+	//trace track
+	uint32_t trace_track = FL2K_TRACE_TRACK_APP + ((color == 'R') ? 0 : (color == 'G') ? 1 : 2);
 
 	if(color == 'R')
 	{
-		process_state = process_r_state_ptr;
-		resample_state = resample_r_state_ptr;
+		handshake = &handshake_r;
+		rs = &soxr_data_r;
+		arena = &arena_r;
 		buffer = inbuf_r;
-		stream = file_r;
-		stream2 = file2_r;
+		stream = &reader_r;
+		stream2 = &reader2_r;
 		istbc = tbcR;
 		sample_cnt = &sample_cnt_r;
 		line_cnt = &line_cnt_r;
@@ -604,7 +4319,6 @@ int read_sample_file(void *inpt_color)
 		if(sync_a == 'R' && pipe_mode == 'A')
 		{
 			is_sync_a = 1;
-			streamA = file_audio;
 		}
 		else if(pipe_mode == 'R')
 		{
@@ -613,11 +4327,12 @@ int read_sample_file(void *inpt_color)
 	}
 	else if(color == 'G')
 	{
-		process_state = process_g_state_ptr;
-		resample_state = resample_g_state_ptr;
+		handshake = &handshake_g;
+		rs = &soxr_data_g;
+		arena = &arena_g;
 		buffer = inbuf_g;
-		stream = file_g;
-		stream2 = file2_g;
+		stream = &reader_g;
+		stream2 = &reader2_g;
 		istbc = tbcG;
 		sample_cnt = &sample_cnt_g;
 		line_cnt = &line_cnt_g;
@@ -635,7 +4350,6 @@ int read_sample_file(void *inpt_color)
 		if(sync_a == 'G' && pipe_mode == 'A')
 		{
 			is_sync_a = 1;
-			streamA = file_audio;
 		}
 		else if(pipe_mode == 'G')
 		{
@@ -644,11 +4358,12 @@ int read_sample_file(void *inpt_color)
 	}
 	else if(color == 'B')
 	{
-		process_state = process_b_state_ptr;
-		resample_state = resample_b_state_ptr;
+		handshake = &handshake_b;
+		rs = &soxr_data_b;
+		arena = &arena_b;
 		buffer = inbuf_b;
-		stream = file_b;
-		stream2 = file2_b;
+		stream = &reader_b;
+		stream2 = &reader2_b;
 		istbc = tbcB;
 		sample_cnt = &sample_cnt_b;
 		line_cnt = &line_cnt_b;
@@ -666,7 +4381,6 @@ int read_sample_file(void *inpt_color)
 		if(sync_a == 'B' && pipe_mode == 'A')
 		{
 			is_sync_a = 1;
-			streamA = file_audio;
 		}
 		else if(pipe_mode == 'B')
 		{
@@ -674,13 +4388,6 @@ int read_sample_file(void *inpt_color)
 		}
 	}
 	
-	//IRE
-	const float ire_conv = 1.59375;// (255/160)
-	const float ire_min = 63.75;//40 * (255/160)
-	const float ire_new_max = 159.375;// (140 * (255/160)) - (40 * (255/160))
-	const float ire_add = (*ire_level * ire_conv);
-	const float ire_gain = (ire_new_max / (ire_new_max + ire_add));
-	double ire_tmp = 0;
 	
 	if(video_standard == 'P')//PAL value multiplied by 2 if input is 16bit
 	{
@@ -691,7 +4398,6 @@ int read_sample_file(void *inpt_color)
 		v_end = 1107 * (1 + is16);
 		cbust_start = 98 * (1 + is16);//not set
 		cbust_end = 138 * (1 + is16);//not set
-		audio_frame = ((88200/25) *2);
 		//sample_skip = 4 * (1 + is16);//remove 4 extra sample in pal
 	}
 	else if(video_standard == 'N')//NTSC value multiplied by 2 if input is 16bit
@@ -703,10 +4409,11 @@ int read_sample_file(void *inpt_color)
 		v_end = 894 * (1 + is16);
 		cbust_start = 78 * (1 + is16);
 		cbust_end = 110 * (1 + is16);
-		audio_frame = ((88200/30) * 2);
 	}
 	
-	unsigned long buf_size = (input_buf_size + (is16 * input_buf_size));
+	//samples of this buffer, with the resampler it follows the output rate
+	unsigned long nb_sample = resample ? resampler_need(rs) : input_buf_size;
+	unsigned long buf_size = (nb_sample + (is16 * nb_sample));
 	
 	if(istbc == 1)//compute buf size
 	{
@@ -715,33 +4422,37 @@ int read_sample_file(void *inpt_color)
 	
 	buf_size += sample_skip;
 	
-	unsigned char *tmp_buf = malloc(input_buf_size);//8bit data so we can use input_buf_size
-	unsigned char *audio_buf = malloc(audio_frame);
-	char *audio_buf_signed = (void *)audio_buf;
-	unsigned char *calc = malloc(buf_size);
-	unsigned char *calc2 = malloc(buf_size);
-	unsigned short value16 = 0;
-	unsigned short value16_2 = 0;
-	unsigned char value8 = 0;
-	unsigned char value8_2 = 0;
-	
-	short *value16_signed = (void *)&value16;
-	short *value16_2_signed = (void *)&value16_2;
-	char *value8_signed = (void *)&value8;
-	char *value8_2_signed = (void *)&value8_2;
+	short *resbuffer = arena->resbuffer;//used for cast 8 bit to 16 bit
+	unsigned char *tmp_buf = arena->tmp_buf;//8bit data so we can use input_buf_size
+	unsigned char *calc = arena->calc;
+	unsigned char *calc2 = arena->calc2;
 	
-	//set status to ready
-	*process_state = 1;
-	//wait resampler
-	if(resample)while(*resample_state != 1){usleep(1);}
-	//set status to processing
-	//*process_state = 2;
+	//line spans and runs
+	line_span_t span[MAX_SPANS];
+	int nb_span = 0;
+	int s_idx = 0;
+	int gates = 0;
+	int active_line = 0;
+	int audio_out = 0;
+	uint64_t t_stage = 0;
+	uint64_t ns_convert = 0;
+	uint64_t ns_gain = 0;
+	unsigned long step = 1 + is16;
+	unsigned long pos = 0;
+	unsigned long run = 0;
+	unsigned long run_max = 0;
+	unsigned long done = 0;
+	unsigned long n = 0;
+	unsigned long field_end = 0;
+	int region = 0;
+	int c = 0;
+	int err = 0;
 	
-	if (tmp_buf == NULL || calc == NULL)
+	if (buf_size > arena->calc_size)
 	{
-		free(tmp_buf);   // Free both in case only one was allocated
-		free(calc);
-		fprintf(stderr, "(%c) malloc error (tmp_buf , calc)\n",color);
+		fprintf(stderr, "(%c) read of %lu bytes exceeds the buffer\n",color,buf_size);
+		//don't leave the resampler waiting
+		if(resample)handshake_wait(handshake);
 		return -1;
 	}
 	
@@ -750,31 +4461,48 @@ int read_sample_file(void *inpt_color)
 		sample_skip = calc_nb_skip(*sample_cnt,line_lengt,frame_lengt,buf_size,video_standard);
 	}
 	
+	fl2k_trace_begin(dev, trace_track, "read", *field_cnt);
+	t_stage = stage_timing ? now_ns() : 0;
 	if(is_stereo)
 	{
-		if(fread(calc,buf_size,1,stream) != 1 || fread(calc2,buf_size,1,stream2) != 1)
+		if(reader_read(stream,calc,buf_size) != buf_size || reader_read(stream2,calc2,buf_size) != buf_size)
 		{
-			free(tmp_buf);   // Free both in case only one was allocated
-			free(calc);
-			free(calc2);
-			fprintf(stderr, "(%c) fread error %d : ",color,errno);
-			perror(NULL);
+			//a clean end of the last item is the end of the playlist
+			err = reader_error(stream) ? reader_error(stream) : reader_error(stream2);
+			if(err)fprintf(stderr, "(%c) read error %d : %s\n",color,err,strerror(err));
+			if(resample)handshake_wait(handshake);
 			return -1;
 		}
 	}
 	else
 	{
-		if(fread(calc,buf_size,1,stream) != 1)
+		if(reader_read(stream,calc,buf_size) != buf_size)
 		{
-			free(tmp_buf);   // Free both in case only one was allocated
-			free(calc);
-			free(calc2);
-			fprintf(stderr, "(%c) fread error %d : ",color,errno);
-			perror(NULL);
+			//a clean end of the last item is the end of the playlist
+			err = reader_error(stream);
+			if(err)fprintf(stderr, "(%c) read error %d : %s\n",color,err,strerror(err));
+			if(resample)handshake_wait(handshake);
 			return -1;
 		}
 	}
 
+	fl2k_trace_end(dev, trace_track, "read", *field_cnt);
+	if(stage_timing)
+	{
+		stage_record(STAGE_READ, now_ns() - t_stage);
+		t_stage = now_ns();
+	}
+	
+	fl2k_trace_begin(dev, trace_track, "process", *field_cnt);
+	lut_build(arena, *chroma_gain, *ire_level, signal_gain, v_max, max_value, is_signed);
+	nb_span = line_spans(span, v_start, v_end, cbust_start, cbust_end, is16);
+	audio_out = (audio_output.running && is_sync_a);
+	arena->nb_piece = 0;
+	arena->is16 = is16;
+	arena->is_stereo = is_stereo;
+	arena->combine_mode = combine_mode;
+	
+	//the buffer is planned in runs of samples up to the next frame, line or field boundary
 	while((y < buf_size) && !do_exit)
 	{	
 		//if we are at then end of the frame skip one line
@@ -795,210 +4523,120 @@ int read_sample_file(void *inpt_color)
 				*sample_cnt = 0;
 			}
 			
-			//write audio file to stdout only if its not a terminal
-			if(isatty(STDOUT_FILENO) == 0 && is_sync_a)
-			{
-				//write(stdout, tmp_buf, input_buf_size);
-				fread(audio_buf_signed,audio_frame,1,streamA);
-				//write(stdout, audio_buf_signed, audio_frame);
-				fwrite(audio_buf, audio_frame,1,stdout);
-				fflush(stdout);
-			}
-		}
-		
-		if(is16 == 1)
-		{
-			value16 = ((calc[y+1] * 256) + calc[y]);
-			if(is_stereo)
+			//the audio thread writes the frame
+			if(audio_out)
 			{
-				value16_2 = ((calc2[y+1] * 256) + calc2[y]);
+				audio_out_release(&audio_output);
 			}
-			y += 2;
-		}
-		else
-		{
-			value8 = calc[y];
-			if(is_stereo)
-			{
-				value8_2 = calc2[y];
-			}
-			y += 1;
 		}
 		
-		//convert 16bit to 8bit and combine
-		if(is16 == 1)
+		//length of the run
+		run = (y < buf_size) ? ((buf_size - y + step - 1) / step) : 1;
+		if(*sample_cnt < frame_lengt)
 		{
-			if(is_stereo)
-			{
-				if(combine_mode == 0)//default
-				{
-					if((round((*value16_signed + *value16_2_signed)/ 256.0) + 128) < -128)
-					{
-						tmp_buf[i] = -128;
-					}
-					/*else if((round((*value16_signed + *value16_2_signed)/ 256.0) + 128) > 0)
-					{
-						tmp_buf[i] = 0;
-					}*/
-					else
-					{
-						tmp_buf[i] = round((*value16_signed + *value16_2_signed)/ 256.0) + 128;//convert to 8 bit
-					}
-				}
-				else if(combine_mode == 2)
-				{
-					if(((*line_sample_cnt >= v_start) && (*line_sample_cnt <= v_end))&& *line_cnt > (22 + ((unsigned long)*field_cnt % 2)) )
-					{
-						tmp_buf[i] = round(round((value16)  / 256.0) / 1.34) + 64;//convert to 8 bit
-					}
-					else
-					{
-						tmp_buf[i] = round(value16_2 / 256.0);//convert to 8 bit
-					}
-					
-				}
-				else//mode 1
-				{
-					tmp_buf[i] = round(((value16 + value16_2)/2)/ 256.0);//convert to 8 bit
-				}
-				
-			}
-			else
-			{
-				tmp_buf[i] = round(value16 / 256.0);//convert to 8 bit
-			}
+			run_max = (frame_lengt - *sample_cnt + step - 1) / step;
+			run = (run_max < run) ? run_max : run;
 		}
-		else if(is_stereo)//combine 2 file
+		else if(audio_out)
 		{
-			if(combine_mode == 0)//default
-			{
-				tmp_buf[i] = *value8_signed + *value8_2_signed + 128;
-			}
-			else//mode 1
-			{
-				tmp_buf[i] = round((value8 + value8_2)/2);
-			}
+			run = 1;
 		}
-		else//no processing
+		if(*line_sample_cnt <= line_lengt)
 		{
-			tmp_buf[i] = value8;
+			run_max = ((line_lengt - *line_sample_cnt) / step) + 1;
+			run = (run_max < run) ? run_max : run;
 		}
-		
-		if(*chroma_gain != 1)
+		field_end = ((frame_nb_line / 2) + ((unsigned long)*field_cnt % 2));//field 1 = (max - 0.5)   field 2 = (max + 0.5)
+		if(*line_cnt == field_end)
 		{
-			//color burst reading
-			if(((*line_sample_cnt >= cbust_start) && (*line_sample_cnt <= cbust_end)) && (*line_cnt == (21 + ((unsigned long)*field_cnt % 2))))
-			{
-				cbust_sample = tmp_buf[i];
-				cbust_count += 1;
-				cbust_middle = cbust_sample / cbust_count;
-				cbust_offset = (cbust_middle - (cbust_middle / *chroma_gain));
-			}
-			
-			//chroma gain
-			
-			if(((*line_sample_cnt >= cbust_start) && (*line_sample_cnt <= cbust_end * 1 + is16))&& (*line_cnt > (22 + ((unsigned long)*field_cnt % 2))))
-			{
-				tmp_buf[i] = round(tmp_buf[i] / *chroma_gain);// + cbust_offset;
-			}
+			run = 1;
 		}
 		
-		//ire 7.5 to ire 0
-		if (*ire_level != 0)
-		{
-			if(((*line_sample_cnt >= v_start) && (*line_sample_cnt <= v_end))&& *line_cnt > (22 + ((unsigned long)*field_cnt % 2)) )
-			{
-				ire_tmp = (tmp_buf[i] - ire_min);
-				
-				if(ire_tmp < 0)//clipping value
-				{
-					ire_tmp = 0;
-				}
-				ire_tmp = ire_tmp * ire_gain;
-				tmp_buf[i] =  round(ire_tmp + ire_add + ire_min);
-			}
-		}
+		active_line = (*line_cnt > (22 + ((unsigned long)*field_cnt % 2)));
 		
-		//signal gain
-		if(signal_gain != 1)
+		//walk the spans of the line
+		pos = *line_sample_cnt;
+		s_idx = 0;
+		done = 0;
+		while(done < run)
 		{
-			if(tmp_buf[i] > 5)
+			while((s_idx + 1) < nb_span && span[s_idx + 1].start <= pos)
 			{
-				if((tmp_buf[i] * signal_gain) > 255)
-				{
-					tmp_buf[i] = 255;
-				}
-				else
-				{
-					tmp_buf[i] = round(tmp_buf[i] * signal_gain);
-				}
+				s_idx++;
 			}
-		}
-		
-		//scale to max voltage
-		if(v_max > 0.0)
-		{
-			if(round(tmp_buf[i]*(255/max_value)) > 255)
+			
+			n = run - done;
+			if((s_idx + 1) < nb_span)
 			{
-				tmp_buf[i] = 255;
+				run_max = (span[s_idx + 1].start - pos + step - 1) / step;
+				n = (run_max < n) ? run_max : n;
 			}
-			else
+			gates = span[s_idx].gates;
+			
+			region = 0;
+			if(active_line && (gates & SPAN_CHROMA))region |= LUT_CHROMA;
+			if(active_line && (gates & SPAN_VIDEO))region |= LUT_IRE;
+			if(piece_add(arena, i, y, n, step, active_line && (gates & SPAN_VIDEO), region) < 0)
 			{
-				tmp_buf[i] = round((tmp_buf[i]*(255/max_value))/(0.7/v_max));
+				fprintf(stderr, "(%c) malloc error (plan)\n",color);
+				do_exit = 1;
+				break;
 			}
+			
+			i += n;
+			y += n * step;
+			pos += n * step;
+			done += n;
 		}
 		
-		//fix sign and cast to 16 bit
-		if(!is_signed)
-		{
-			tmp_buf[i] = tmp_buf[i] - 128;
-			resbuffer[i] = tmp_buf[i];
-		}
-		else
-		{
-			resbuffer[i] = tmp_buf[i];
-		}
-		
-		i += 1;//on avance tmp_buff de 1
-		
-		if(*line_cnt == ((frame_nb_line / 2) + ((unsigned long)*field_cnt % 2)))//field 1 = (max - 0.5)   field 2 = (max + 0.5)
+		//counters of the last sample of the run
+		if(*line_cnt == field_end)
 		{
 			*line_cnt = 0;
 			*field_cnt += 1;
-			cbust_sample = 0;
-			cbust_middle = 0;
-			cbust_count = 0;
 		}
 		
-		if(*line_sample_cnt == line_lengt)
+		*line_sample_cnt = pos;
+		if((pos - step) == line_lengt)
 		{
-			*line_sample_cnt = 0;
+			*line_sample_cnt = step;
 			*line_cnt += 1;
 		}
 		
-		*sample_cnt += (1 + is16);
-		*line_sample_cnt += (1 + is16);
+		*sample_cnt += run * step;
 	}
 	
-	//set status to finished
-	*process_state = 3;
-	//wait resampler to finish
-	if(resample)while(*resample_state != 3){usleep(1);}
-	
-	if(resample)
+	//run the plan, shared between the threads of the channel
+	if(stage_timing){stage_record(STAGE_PLAN, now_ns() - t_stage);}
+	arena->nb_sample = i;
+	for(c = 1; c < arena->nb_chunk; c++)
 	{
-		if(color == 'R')
-		{
-			memcpy(resbuf_r, resbuffer, input_buf_size*2);
-		}
-		if(color == 'G')
-		{
-			memcpy(resbuf_g, resbuffer, input_buf_size*2);
-		}
-		if(color == 'B')
+		worker_post(&arena->worker[c]);
+	}
+	chunk_run(&arena->chunk[0]);
+	for(c = 1; c < arena->nb_chunk; c++)
+	{
+		worker_wait(&arena->worker[c]);
+	}
+	if(stage_timing)
+	{
+		for(c = 0; c < arena->nb_chunk; c++)
 		{
-			memcpy(resbuf_b, resbuffer, input_buf_size*2);
+			ns_convert = (arena->chunk[c].ns_convert > ns_convert) ? arena->chunk[c].ns_convert : ns_convert;
+			ns_gain = (arena->chunk[c].ns_gain > ns_gain) ? arena->chunk[c].ns_gain : ns_gain;
 		}
+		stage_record(STAGE_CONVERT, ns_convert);
+		stage_record(STAGE_GAIN, ns_gain);
+	}
+	
+	fl2k_trace_end(dev, trace_track, "process", *field_cnt);
+	
+	//wait for the resampler to be done with the previous buffer
+	if(resample)handshake_wait(handshake);
+	
+	if(resample)
+	{
+		resampler_push(rs, resbuffer, nb_sample);
 	}
 	else
 	{
@@ -1016,23 +4654,31 @@ int read_sample_file(void *inpt_color)
 		}
 	}
 	
-	if(isatty(STDOUT_FILENO) == 0 && use_pipe)
+	if(use_pipe && pipe_output.running)
 	{
-		fwrite(tmp_buf, input_buf_size,1,stdout);
-		fflush(stdout);
+		pipe_out_push(&pipe_output, tmp_buf, nb_sample);
 	}
 	
-	free(resbuffer);
-	free(tmp_buf);
-	free(audio_buf);
-	free(calc);
-	free(calc2);
 	return 0;
 }
 
+//entry points of the channel workers, with the signature worker_init expects
+static void *read_sample_job(void *arg)
+{
+	read_sample_file(arg);
+	return NULL;
+}
+
+static void *resample_job(void *arg)
+{
+	fl2k_resample_to_freq((resample_data *)arg);
+	return NULL;
+}
+
 void fl2k_callback(fl2k_data_info_t *data_info)
 {	
 	static uint32_t repeat_cnt = 0;
+	uint64_t t_stage = stage_timing ? now_ns() : 0;
 	
 	//store the number of block readed
 	int r;
@@ -1076,55 +4722,21 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 		data_info->b_sample_resampled = resample;
 	}
 	
-	//initialisation
-	//start resampler if not initialisaed
-	if(soxr_data_r.state_process == 0 && red == 1)
-	{
-		resampler_open(data_info, &resampler_r,fl2k_get_sample_rate(dev), 'R');
-		//resampling data
-		soxr_data_r.soxr = resampler_r;
-		soxr_data_r.state_process = &process_r_state;
-		soxr_data_r.state_resample = &resample_r_state;
-		soxr_data_r.data_info = data_info;
-		soxr_data_r.color = 'R';
-	}
-	if(soxr_data_g.state_process == 0 && green == 1)
-	{
-		resampler_open(data_info, &resampler_g, fl2k_get_sample_rate(dev), 'G');
-		fprintf(stderr,"engine outside = %s\n",soxr_engine(resampler_g));
-		//resampling data
-		soxr_data_g.soxr = resampler_g;
-		soxr_data_g.state_process = &process_g_state;
-		soxr_data_g.state_resample = &resample_g_state;
-		soxr_data_g.data_info = data_info;
-		soxr_data_g.color = 'G';
-	}
-	if(soxr_data_b.state_process == 0 && blue == 1)
-	{
-		resampler_open(data_info, &resampler_b, fl2k_get_sample_rate(dev), 'B');
-		//resampling data
-		soxr_data_b.soxr = resampler_b;
-		soxr_data_b.state_process = &process_b_state;
-		soxr_data_b.state_resample = &resample_b_state;
-		soxr_data_b.data_info = data_info;
-		soxr_data_b.color = 'B';
-	}
-	
 	//read until buffer is full
 	//RED
-	if(red == 1 && !feof(file_r))
+	if(red == 1 && !reader_done(&reader_r))
 	{
 		//process file
-		pthread_create(&thread_r,NULL,read_sample_file,'R');
+		worker_post(&worker_r);
 		//resample
-		if(resample)pthread_create(&thread_r_res,NULL,fl2k_resample_to_freq,&soxr_data_r);
+		if(resample)worker_post(&worker_r_res);
 
-		if (ferror(file_r))
+		if (reader_error(&reader_r))
 		{
 			fprintf(stderr, "(RED) : File Error\n");
 		}
 	}
-	else if(red == 1 && feof(file_r))
+	else if(red == 1 && reader_done(&reader_r))
 	{
 		fprintf(stderr, "(RED) : Nothing more to read\n");
 	}
@@ -1134,24 +4746,24 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 	{
 		if(red == 1)
 		{
-			pthread_join(thread_r,NULL);
-			if(resample)pthread_join(thread_r_res,NULL);
+			worker_wait(&worker_r);
+			if(resample)worker_wait(&worker_r_res);
 		}
 	}
 	
 	//GREEN
-	if(green == 1 && !feof(file_g))
+	if(green == 1 && !reader_done(&reader_g))
 	{
-		pthread_create(&thread_g,NULL,read_sample_file,'G');
+		worker_post(&worker_g);
 		//resample
-		if(resample)pthread_create(&thread_g_res,NULL,fl2k_resample_to_freq,&soxr_data_g);
+		if(resample)worker_post(&worker_g_res);
 		
-		if (ferror(file_g))
+		if (reader_error(&reader_g))
 		{
 			fprintf(stderr, "(GREEN) : File Error\n");
 		}
 	}
-	else if(green == 1 && feof(file_g))
+	else if(green == 1 && reader_done(&reader_g))
 	{
 		fprintf(stderr, "(GREEN) : Nothing more to read\n");
 	}
@@ -1161,37 +4773,37 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 	{
 		if(green == 1)
 		{
-			pthread_join(thread_g,NULL);
-			if(resample)pthread_join(thread_g_res,NULL);
+			worker_wait(&worker_g);
+			if(resample)worker_wait(&worker_g_res);
 		}
 	}
 	else if(read_mode == 2)
 	{
 		if(red == 1)
 		{
-			pthread_join(thread_r,NULL);
-			if(resample)pthread_join(thread_r_res,NULL);
+			worker_wait(&worker_r);
+			if(resample)worker_wait(&worker_r_res);
 		}
 		if(green == 1)
 		{
-			pthread_join(thread_g,NULL);
-			if(resample)pthread_join(thread_g_res,NULL);
+			worker_wait(&worker_g);
+			if(resample)worker_wait(&worker_g_res);
 		}
 	}
 	
 	//BLUE
-	if(blue == 1 && !feof(file_b))
+	if(blue == 1 && !reader_done(&reader_b))
 	{
-		pthread_create(&thread_b,NULL,read_sample_file,'B');
+		worker_post(&worker_b);
 		//resample
-		if(resample)pthread_create(&thread_b_res,NULL,fl2k_resample_to_freq,&soxr_data_b);
+		if(resample)worker_post(&worker_b_res);
 		
-		if(ferror(file_b))
+		if(reader_error(&reader_b))
 		{
 			fprintf(stderr, "(BLUE) : File Error\n");
 		}
 	}
-	else if(blue == 1 && feof(file_b))
+	else if(blue == 1 && reader_done(&reader_b))
 	{
 		fprintf(stderr, "(BLUE) : Nothing more to read\n");
 	}
@@ -1201,39 +4813,39 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 	{
 		if(red == 1)
 		{
-			pthread_join(thread_r,NULL);
-			if(resample)pthread_join(thread_r_res,NULL);
+			worker_wait(&worker_r);
+			if(resample)worker_wait(&worker_r_res);
 		}
 		if(green == 1)
 		{
-			pthread_join(thread_g,NULL);
-			if(resample)pthread_join(thread_g_res,NULL);
+			worker_wait(&worker_g);
+			if(resample)worker_wait(&worker_g_res);
 		}
 		if(blue == 1)
 		{
-			pthread_join(thread_b,NULL);
-			if(resample)pthread_join(thread_b_res,NULL);
+			worker_wait(&worker_b);
+			if(resample)worker_wait(&worker_b_res);
 		}
 	}
 	else if(read_mode == 3 || read_mode == 2)
 	{
 		if(blue == 1)
 		{
-			pthread_join(thread_b,NULL);
-			if(resample)pthread_join(thread_b_res,NULL);
+			worker_wait(&worker_b);
+			if(resample)worker_wait(&worker_b_res);
 		}
 	}
 	else if(read_mode == 1)
 	{
 		if(green == 1)
 		{
-			pthread_join(thread_g,NULL);
-			if(resample)pthread_join(thread_g_res,NULL);
+			worker_wait(&worker_g);
+			if(resample)worker_wait(&worker_g_res);
 		}
 		if(blue == 1)
 		{
-			pthread_join(thread_b,NULL);
-			if(resample)pthread_join(thread_b_res,NULL);
+			worker_wait(&worker_b);
+			if(resample)worker_wait(&worker_b_res);
 		}
 	}
 	
@@ -1254,7 +4866,18 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 		pthread_exit(thread_b_res);
 	}*/
 	
-	if((red == 0 || feof(file_r)) && (green == 0 || feof(file_g)) && (blue == 0 || feof(file_b)))
+	//time of the whole buffer against its period
+	if(stage_timing)
+	{
+		t_stage = now_ns() - t_stage;
+		stage_record(STAGE_BUFFER, t_stage);
+		if(t_stage > ((uint64_t)FL2K_BUF_LEN * 1000000000ULL) / output_sample_rate)
+		{
+			stats_late++;
+		}
+	}
+	
+	if((red == 0 || reader_done(&reader_r)) && (green == 0 || reader_done(&reader_g)) && (blue == 0 || reader_done(&reader_b)))
 	{
 		fprintf(stderr, "End of the process\n");
 		fl2k_stop_tx(dev);
@@ -1272,6 +4895,134 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 	}*/
 }
 
+//slip in the front porch at the end of each line : the slip points follow the
+//counters of the first channel, written is the stream position they are at
+//tbc : from the start of the frame, the 4 extra samples of a PAL frame end it
+//other : from the start of the line, re-based once per frame
+void clock_sync_rebase(uint64_t written)
+{
+	uint32_t *sample_cnt = (red == 1) ? &sample_cnt_r : (green == 1) ? &sample_cnt_g : &sample_cnt_b;
+	uint32_t *line_sample_cnt = (red == 1) ? &line_sample_cnt_r : (green == 1) ? &line_sample_cnt_g : &line_sample_cnt_b;
+	uint32_t *field_cnt = (red == 1) ? &field_cnt_r : (green == 1) ? &field_cnt_g : &field_cnt_b;
+	int istbc = (red == 1) ? tbcR : (green == 1) ? tbcG : tbcB;
+	uint32_t step = 1 + ((red == 1) ? r16 : (green == 1) ? g16 : b16);
+	uint32_t frame_lengt = (video_standard == 'P') ? 709379 : 477750;
+	static uint32_t frame = UINT32_MAX;
+	uint64_t anchor = 0;
+	uint64_t k = 0;
+	
+	if(!clock_line)
+	{
+		return;
+	}
+	
+	if(istbc == 1)
+	{
+		//samples of the current frame, a finished frame is reset with the next run
+		k = (*sample_cnt / step < frame_lengt) ? *sample_cnt / step : 0;
+		anchor = written - ((k < written) ? k : written);
+		if(anchor == clock_anchor)
+		{
+			return;
+		}
+	}
+	else
+	{
+		//line_sample_cnt is 1 based
+		if(*field_cnt / 2 == frame)
+		{
+			return;
+		}
+		frame = *field_cnt / 2;
+		k = (*line_sample_cnt >= step) ? (*line_sample_cnt / step) - 1 : 0;
+		anchor = written - ((k < written) ? k : written);
+	}
+	
+	clock_anchor = anchor;
+	fl2k_set_clock_discipline(dev, clock_sync, clock_line, anchor + clock_line - 16);
+}
+
+//write mode : the buffers are produced in our own thread and pushed with fl2k_write
+void *fl2k_write_worker(void *arg)
+{
+	static fl2k_data_info_t data_info;
+	uint64_t written = 0;
+	
+	(void)arg;
+	
+	while(!do_exit)
+	{
+		fl2k_callback(&data_info);
+		if(do_exit)
+		{
+			break;
+		}
+		
+		//the counters are at the end of this buffer
+		written += FL2K_BUF_LEN;
+		clock_sync_rebase(written);
+		
+		data_info.len = FL2K_BUF_LEN;
+		if(fl2k_write(dev, &data_info) < 0)
+		{
+			do_exit = 1;
+		}
+	}
+	
+	return NULL;
+}
+
+//offline render : the same buffers, produced as fast as possible and written to a file instead of a device
+void *fl2k_render_worker(void *arg)
+{
+	static fl2k_data_info_t data_info;
+	char *buf[3];
+	int offset[3];
+	int nb = 0;
+	int c = 0;
+	unsigned long k = 0;
+	unsigned char *out = NULL;
+	uint64_t start = now_ns();
+	
+	(void)arg;
+	
+	while(!do_exit)
+	{
+		fl2k_callback(&data_info);
+		if(do_exit)
+		{
+			break;
+		}
+		
+		//the samples of the active channels interleaved, unsigned as the DACs get them
+		nb = 0;
+		if(red == 1){buf[nb] = data_info.r_buf; offset[nb++] = data_info.sampletype_signed_r ? 128 : 0;}
+		if(green == 1){buf[nb] = data_info.g_buf; offset[nb++] = data_info.sampletype_signed_g ? 128 : 0;}
+		if(blue == 1){buf[nb] = data_info.b_buf; offset[nb++] = data_info.sampletype_signed_b ? 128 : 0;}
+		
+		out = render_buf;
+		for(k = 0; k < FL2K_BUF_LEN; k++)
+		{
+			for(c = 0; c < nb; c++)
+			{
+				*out++ = buf[c][k] + offset[c];
+			}
+		}
+		
+		if(fwrite(render_buf, FL2K_BUF_LEN * nb, 1, render_file) != 1)
+		{
+			fprintf(stderr, "Render : write error (%s)\n", strerror(errno));
+			do_exit = 1;
+			break;
+		}
+		render_buffers++;
+	}
+	
+	fflush(render_file);
+	render_ns = now_ns() - start;
+	return NULL;
+}
+
 int main(int argc, char **argv)
 {
 #ifndef _WIN32
@@ -1287,6 +5038,7 @@ int main(int argc, char **argv)
 	uint32_t buf_num = 0;
 	int dev_index = 0;
 	void *status;
+	uint64_t stats_next = 0;
 	
 	int override_r16 = -1;
 	int override_g16 = -1;
@@ -1302,6 +5054,19 @@ int main(int argc, char **argv)
 	uint64_t start_g = 0;
 	uint64_t start_b = 0;
 	uint64_t start_audio = 0;
+	char *start_spec_r = NULL;
+	char *start_spec_g = NULL;
+	char *start_spec_b = NULL;
+	int64_t start_field_r = -1;
+	int64_t start_field_g = -1;
+	int64_t start_field_b = -1;
+	int start_fps = 25;
+	
+	//frame size, the items of a playlist are cut to whole frames
+	uint64_t frame_bytes_r = 1;
+	uint64_t frame_bytes_g = 1;
+	uint64_t frame_bytes_b = 1;
+	uint64_t frame_bytes_audio = 1;
 	
 	long audio_offset = 0;
 
@@ -1314,6 +5079,7 @@ int main(int argc, char **argv)
 	char *filename2_g = NULL;
 	char *filename2_b = NULL;
 	char *filename_audio = NULL;
+	char *filename_dac_cal = NULL;
 	
 	//pipe_buf = malloc(input_buf_size);
 	
@@ -1373,6 +5139,19 @@ int main(int argc, char **argv)
 		{"MaxValueG", 1, 0, 42},
 		{"MaxValueB", 1, 0, 43},
 		{"resample", 0, 0, 44},
+		{"dacCal", 1, 0, 45},
+		{"trace", 1, 0, 46},
+		{"audit", 1, 0, 47},
+		{"clockSync", 1, 0, 48},
+		{"adaptiveBuf", 1, 0, 49},
+		{"readAhead", 1, 0, 50},
+		{"readBackend", 1, 0, 51},
+		{"threads", 1, 0, 52},
+		{"resampleEngine", 1, 0, 53},
+		{"pipePolicy", 1, 0, 54},
+		{"stats", 1, 0, 55},
+		{"statsJson", 1, 0, 56},
+		{"render", 1, 0, 57},
 		{0, 0, 0, 0}//reminder : letter value are from 65 to 122
 	};
 
@@ -1405,19 +5184,23 @@ int main(int argc, char **argv)
 			break;
 		case 'R':
 			red = 1;
-			filename_r = optarg;
+			if(playlist_add(&playlist_r, optarg) < 0){usage();}
+			filename_r = playlist_r.items[0];
 			break;
 		case 'G':
 			green = 1;
-			filename_g = optarg;
+			if(playlist_add(&playlist_g, optarg) < 0){usage();}
+			filename_g = playlist_g.items[0];
 			break;
 		case 'B':
 			blue = 1;
-			filename_b = optarg;
+			if(playlist_add(&playlist_b, optarg) < 0){usage();}
+			filename_b = playlist_b.items[0];
 			break;
 		case 'A':
 			audio = 1;
-			filename_audio = optarg;
+			if(playlist_add(&playlist_audio, optarg) < 0){usage();}
+			filename_audio = playlist_audio.items[0];
 			break;
 		case 1:
 			override_r16 = 1;
@@ -1459,25 +5242,28 @@ int main(int argc, char **argv)
 			ire_b = atof(optarg);
 			break;
 		case 14:
-			start_r = atoi(optarg);
+			start_spec_r = optarg;
 			break;
 		case 15:
-			start_g = atoi(optarg);
+			start_spec_g = optarg;
 			break;
 		case 16:
-			start_b = atoi(optarg);
+			start_spec_b = optarg;
 			break;
 		case 17:
 			red2 = 1;
-			filename2_r = optarg;
+			if(playlist_add(&playlist2_r, optarg) < 0){usage();}
+			filename2_r = playlist2_r.items[0];
 			break;
 		case 18:
 			green2 = 1;
-			filename2_g = optarg;
+			if(playlist_add(&playlist2_g, optarg) < 0){usage();}
+			filename2_g = playlist2_g.items[0];
 			break;
 		case 19:
 			blue2 = 1;
-			filename2_b = optarg;
+			if(playlist_add(&playlist2_b, optarg) < 0){usage();}
+			filename2_b = playlist2_b.items[0];
 			break;
 		case 20:
 			if(*optarg == 'r'){sync_a = 'R';}
@@ -1567,6 +5353,68 @@ int main(int argc, char **argv)
 		case 44:
 			resample = 1;
 			break;
+		case 45:
+			filename_dac_cal = optarg;
+			break;
+		case 46:
+			trace_filename = optarg;
+			break;
+		case 47:
+			audit_filename = optarg;
+			break;
+		case 48:
+			clock_sync = atof(optarg);
+			break;
+		case 49:
+			adaptive_buf = (uint32_t)atoi(optarg);
+			break;
+		case 50:
+			read_ahead = atof(optarg);
+			break;
+		case 51:
+			if(strcmp(optarg, "stdio") == 0){read_backend = READER_STDIO;}
+			else if(strcmp(optarg, "mmap") == 0){read_backend = READER_MMAP;}
+			else if(strcmp(optarg, "direct") == 0){read_backend = READER_DIRECT;}
+			else
+			{
+				fprintf(stderr, "\nUnknow parametter '%s' for option -readBackend / value : (stdio, mmap, direct)\n\n", optarg);
+				usage();
+			}
+			break;
+		case 52:
+			process_threads = atoi(optarg);
+			break;
+		case 53:
+			if(strcmp(optarg, "auto") == 0){resample_engine = RESAMPLE_AUTO;}
+			else if(strcmp(optarg, "soxr") == 0){resample_engine = RESAMPLE_SOXR;}
+			else if(strcmp(optarg, "fir") == 0){resample_engine = RESAMPLE_FIR;}
+			else
+			{
+				fprintf(stderr, "\nUnknow parametter '%s' for option -resampleEngine / value : (auto, soxr, fir)\n\n", optarg);
+				usage();
+			}
+			break;
+		case 54:
+			if(strcmp(optarg, "block") == 0){pipe_policy = PIPE_BLOCK;}
+			else if(strcmp(optarg, "drop") == 0){pipe_policy = PIPE_DROP;}
+			else if(strcmp(optarg, "decimate") == 0){pipe_policy = PIPE_DECIMATE;}
+			else
+			{
+				fprintf(stderr, "\nUnknow parametter '%s' for option -pipePolicy / value : (block, drop, decimate)\n\n", optarg);
+				usage();
+			}
+			break;
+		case 55:
+			stage_timing = 1;
+			stats_interval = atof(optarg);
+			break;
+		case 56:
+			stage_timing = 1;
+			stats_json_filename = optarg;
+			break;
+		case 57:
+			render_filename = optarg;
+			break;
 		default:
 			usage();
 			break;
@@ -1584,6 +5432,30 @@ int main(int argc, char **argv)
 		fprintf(stderr, "\nRead mode unknown\n\n");
 		usage();
 	}
+	
+	if(read_ahead < 0)
+	{
+		fprintf(stderr, "\nRead ahead invalid / value : (>= 0)\n\n");
+		usage();
+	}
+	
+	if(render_filename && strcmp(render_filename, "-") == 0 && (pipe_mode != 'A' || audio == 1))
+	{
+		fprintf(stderr, "\nstdout is used by -render, no -pipeMode or -A\n\n");
+		usage();
+	}
+	
+	if(stats_interval < 0)
+	{
+		fprintf(stderr, "\nStats interval invalid / value : (>= 0)\n\n");
+		usage();
+	}
+	
+	if(process_threads < 1 || process_threads > MAX_CHUNKS)
+	{
+		fprintf(stderr, "\nThreads invalid / value : (1 to %d)\n\n", MAX_CHUNKS);
+		usage();
+	}
 
 	if(red == 0 && green == 0 && blue == 0)
 	{
@@ -1591,6 +5463,13 @@ int main(int argc, char **argv)
 		usage();
 	}
 	
+	if(repeat < 0 || playlist_stdin(&playlist_r) || playlist_stdin(&playlist_g) || playlist_stdin(&playlist_b) || playlist_stdin(&playlist_audio) ||
+	   playlist_stdin(&playlist2_r) || playlist_stdin(&playlist2_g) || playlist_stdin(&playlist2_b))
+	{
+		fprintf(stderr, "\nstdin can't be looped (-r) or be part of a playlist\n\n");
+		usage();
+	}
+	
 	if((red == 0 && red2 == 1) || (green == 0 && green2 == 1) || (blue == 0 && blue2 == 1))
 	{
 		fprintf(stderr, "\nNo main file provided using (-R,-G,-B)\n\n");
@@ -1603,6 +5482,12 @@ int main(int argc, char **argv)
 		usage();
 	}
 	
+	//frame number of the start, the byte offset is set once the file format is known
+	start_fps = (input_sample_rate == 17734475 || input_sample_rate == 17735845) ? 25 : 30;
+	start_r = start_parse(start_spec_r, start_fps, &start_field_r);
+	start_g = start_parse(start_spec_g, start_fps, &start_field_g);
+	start_b = start_parse(start_spec_b, start_fps, &start_field_b);
+	
 	if((sync_a != 'R') && (sync_a != 'G') && (sync_a != 'B'))
 	{
 		fprintf(stderr, "\nUnknow parametter '%c' for option -syncA / value : (R,r,G,g,B,b)\n\n",sync_a);
@@ -1745,21 +5630,56 @@ int main(int argc, char **argv)
 	
 	if(input_sample_rate == 17734475 || input_sample_rate == 17735845)//PAL
 	{
-		start_r = start_r * ((709375 + (1135 * tbcR)) * (1 + r16));// set first frame
-		start_g = start_g * ((709375 + (1135 * tbcB)) * (1 + g16));
-		start_b = start_b * ((709375 + (1135 * tbcG)) * (1 + b16));
+		start_r = start_offset("RED", filename_r, tbcR, start_r, start_field_r, (709375 + (1135 * tbcR)) * (1 + r16));// set first frame
+		start_g = start_offset("GREEN", filename_g, tbcG, start_g, start_field_g, (709375 + (1135 * tbcG)) * (1 + g16));
+		start_b = start_offset("BLUE", filename_b, tbcB, start_b, start_field_b, (709375 + (1135 * tbcB)) * (1 + b16));
 		start_audio = (start_audio + audio_offset) * ((88200/25) * 2);
+		frame_bytes_r = (709375 + (1135 * tbcR)) * (1 + r16);
+		frame_bytes_g = (709375 + (1135 * tbcG)) * (1 + g16);
+		frame_bytes_b = (709375 + (1135 * tbcB)) * (1 + b16);
+		frame_bytes_audio = (88200/25) * 2;
 		video_standard = 'P';
 	}
 	else if(input_sample_rate == 14318181 || input_sample_rate == 14318170)//NTSC
 	{
-		start_r = start_r * ((477750 + (910 * tbcR)) * (1 + r16));//set first frame
-		start_g = start_g * ((477750 + (910 * tbcG)) * (1 + g16));
-		start_b = start_b * ((477750 + (910 * tbcB)) * (1 + b16));
+		start_r = start_offset("RED", filename_r, tbcR, start_r, start_field_r, (477750 + (910 * tbcR)) * (1 + r16));//set first frame
+		start_g = start_offset("GREEN", filename_g, tbcG, start_g, start_field_g, (477750 + (910 * tbcG)) * (1 + g16));
+		start_b = start_offset("BLUE", filename_b, tbcB, start_b, start_field_b, (477750 + (910 * tbcB)) * (1 + b16));
 		start_audio = (start_audio + audio_offset) * ((88200/30) * 2);
+		frame_bytes_r = (477750 + (910 * tbcR)) * (1 + r16);
+		frame_bytes_g = (477750 + (910 * tbcG)) * (1 + g16);
+		frame_bytes_b = (477750 + (910 * tbcB)) * (1 + b16);
+		frame_bytes_audio = (88200/30) * 2;
 		video_standard = 'N';
 	}
 
+//offline render, at the rate the device would use
+if(render_filename)
+{
+	if(strcmp(render_filename, "-") == 0)
+	{
+		render_file = stdout;
+	}
+	else if(!(render_file = fopen(render_filename, "wb")))
+	{
+		fprintf(stderr, "Failed to open %s\n", render_filename);
+		goto out;
+	}
+	render_buf = malloc(FL2K_BUF_LEN * 3);
+	if(!render_buf)
+	{
+		fprintf(stderr, "malloc error (render)\n");
+		goto out;
+	}
+	if(filename_dac_cal || trace_filename || audit_filename || adaptive_buf || clock_sync >= 0)
+	{
+		fprintf(stderr, "Render : -dacCal, -trace, -audit, -adaptiveBuf and -clockSync need a device, ignored\n");
+		clock_sync = -1;
+	}
+	output_sample_rate = fl2k_get_nearest_sample_rate(input_sample_rate);
+}
+else
+{
 //FL2K initialisation
 	fl2k_open(&dev, (uint32_t)dev_index);
 	if (NULL == dev) {
@@ -1772,13 +5692,38 @@ int main(int argc, char **argv)
 	if (r < 0)
 		fprintf(stderr, "WARNING: Failed to set sample rate.\n");
 
-//file and buffer initialisation
+	/* DAC calibration */
+	if(filename_dac_cal)
+	{
+		if(fl2k_load_dac_lut(dev, filename_dac_cal) < 0)
+		{
+			fprintf(stderr, "Failed to load DAC calibration %s\n", filename_dac_cal);
+			goto out;
+		}
+	}
+
+	/* flight recorder */
+	if(trace_filename)
+	{
+		fl2k_trace_enable(dev, 0, trace_filename);
+	}
+	
+	/* transfer audit log */
+	if(audit_filename && fl2k_audit_enable(dev, audit_filename) < 0)
+	{
+		goto out;
+	}
+	
 	output_sample_rate = fl2k_get_sample_rate(dev);
+}
+
+//file and buffer initialisation
 	fprintf(stderr, "output sample rate = %d\n",output_sample_rate);
 
 	if(resample)
 	{
-		input_buf_size = round((FL2K_BUF_LEN / ((double)output_sample_rate / (double)input_sample_rate))+ 0.5);
+		//largest block, the size of each one is set by the resampler
+		input_buf_size = resampler_max_input(input_sample_rate, output_sample_rate);
 		
 		//change to signed for resampling
 		//and reverse output sign
@@ -1794,6 +5739,9 @@ int main(int argc, char **argv)
 		input_buf_size = FL2K_BUF_LEN;
 	}
 	fprintf(stderr, "set input_buf_size to : %d\n",input_buf_size);
+	
+	convert_init();
+	fprintf(stderr, "conversion kernels : %s\n",convert.name);
 
 //RED file
 if(red == 1)
@@ -1818,7 +5766,7 @@ if(red == 1)
 	inbuf_r = malloc(input_buf_size);
 	resbuf_r = malloc(input_buf_size*2);
 	outbuf_r = malloc(FL2K_BUF_LEN);
-	if (!inbuf_r || !resbuf_r || !outbuf_r) {
+	if (!inbuf_r || !resbuf_r || !outbuf_r || arena_alloc(&arena_r, r16, red2) < 0) {
 		fprintf(stderr, "(RED) : malloc error!\n");
 		goto out;
 	}
@@ -1868,7 +5816,7 @@ if(green == 1)
 	inbuf_g = malloc(input_buf_size);
 	resbuf_g = malloc(input_buf_size*2);
 	outbuf_g = malloc(FL2K_BUF_LEN);
-	if (!inbuf_g || !resbuf_g || !outbuf_g) {
+	if (!inbuf_g || !resbuf_g || !outbuf_g || arena_alloc(&arena_g, g16, green2) < 0) {
 		fprintf(stderr, "(GREEN) : malloc error!\n");
 		goto out;
 	}
@@ -1917,7 +5865,7 @@ if(blue == 1)
 	inbuf_b = malloc(input_buf_size);
 	resbuf_b = malloc(input_buf_size*2);
 	outbuf_b = malloc(FL2K_BUF_LEN);
-	if (!inbuf_b || !resbuf_b || !outbuf_b) {
+	if (!inbuf_b || !resbuf_b || !outbuf_b || arena_alloc(&arena_b, b16, blue2) < 0) {
 		fprintf(stderr, "(BLUE) : malloc error!\n");
 		goto out;
 	}
@@ -1963,8 +5911,174 @@ if(audio == 1)
 	}
 }
 
+//playlists and loops, the next item is opened and read ahead by the reader thread while the current one plays
+reader_set_playlist(&reader_r, &playlist_r, repeat, frame_bytes_r);
+reader_set_playlist(&reader2_r, &playlist2_r, repeat, frame_bytes_r);
+reader_set_playlist(&reader_g, &playlist_g, repeat, frame_bytes_g);
+reader_set_playlist(&reader2_g, &playlist2_g, repeat, frame_bytes_g);
+reader_set_playlist(&reader_b, &playlist_b, repeat, frame_bytes_b);
+reader_set_playlist(&reader2_b, &playlist2_b, repeat, frame_bytes_b);
+reader_set_playlist(&reader_audio, &playlist_audio, repeat, frame_bytes_audio);
+
+//start reading ahead
+if((red == 1 && reader_init(&reader_r, file_r, "RED", (double)input_sample_rate * (1 + r16), arena_r.calc_size) < 0) ||
+   (red2 == 1 && reader_init(&reader2_r, file2_r, "RED2", (double)input_sample_rate * (1 + r16), arena_r.calc_size) < 0) ||
+   (green == 1 && reader_init(&reader_g, file_g, "GREEN", (double)input_sample_rate * (1 + g16), arena_g.calc_size) < 0) ||
+   (green2 == 1 && reader_init(&reader2_g, file2_g, "GREEN2", (double)input_sample_rate * (1 + g16), arena_g.calc_size) < 0) ||
+   (blue == 1 && reader_init(&reader_b, file_b, "BLUE", (double)input_sample_rate * (1 + b16), arena_b.calc_size) < 0) ||
+   (blue2 == 1 && reader_init(&reader2_b, file2_b, "BLUE2", (double)input_sample_rate * (1 + b16), arena_b.calc_size) < 0) ||
+   (audio == 1 && reader_init(&reader_audio, file_audio, "AUDIO", 88200 * 2, (88200/25) * 2) < 0))
+{
+	goto out;
+}
+
+//fill the rings before the first transfer
+reader_prime(&reader_r);
+reader_prime(&reader2_r);
+reader_prime(&reader_g);
+reader_prime(&reader2_g);
+reader_prime(&reader_b);
+reader_prime(&reader2_b);
+reader_prime(&reader_audio);
+
+//audio pipe, only if stdout is not a terminal
+if(audio == 1 && pipe_mode == 'A' && frame_bytes_audio > 1 && isatty(STDOUT_FILENO) == 0)
+{
+	if(audio_out_init(&audio_output, &reader_audio, frame_bytes_audio) < 0)
+	{
+		goto out;
+	}
+	audio_out_prime(&audio_output);
+}
+
+//stage timing
+if(stage_timing)
+{
+	for(i = 0; i < NB_STAGES; i++)
+	{
+		pthread_mutex_init(&stage_stats[i].mutex, NULL);
+	}
+	if(stats_json_filename && !(stats_json = fopen(stats_json_filename, "w")))
+	{
+		fprintf(stderr, "Failed to open %s\n", stats_json_filename);
+		goto out;
+	}
+	stats_start = now_ns();
+	stats_next = stats_start + (uint64_t)(stats_interval * 1e9);
+}
+
+//channel output pipe, half a second of samples
+if(pipe_mode != 'A' && isatty(STDOUT_FILENO) == 0)
+{
+	if(pipe_out_init(&pipe_output, pipe_policy, (input_sample_rate / 2 > 8 * input_buf_size) ? (input_sample_rate / 2) : (8 * input_buf_size)) < 0)
+	{
+		goto out;
+	}
+}
+
+//stream resamplers
+if(resample)
+{
+	if((red == 1 && resampler_open(&soxr_data_r, &resampler_r, input_sample_rate, output_sample_rate, 'R') < 0) ||
+	   (green == 1 && resampler_open(&soxr_data_g, &resampler_g, input_sample_rate, output_sample_rate, 'G') < 0) ||
+	   (blue == 1 && resampler_open(&soxr_data_b, &resampler_b, input_sample_rate, output_sample_rate, 'B') < 0))
+	{
+		goto out;
+	}
+	
+	soxr_data_r.handshake = &handshake_r;
+	soxr_data_r.in = resbuf_r;
+	soxr_data_r.out = outbuf_r;
+	soxr_data_r.fifo = arena_r.obuf;
+	soxr_data_r.fifo_size = FL2K_BUF_LEN + (4 * RESAMPLE_MARGIN);
+	soxr_data_g.handshake = &handshake_g;
+	soxr_data_g.in = resbuf_g;
+	soxr_data_g.out = outbuf_g;
+	soxr_data_g.fifo = arena_g.obuf;
+	soxr_data_g.fifo_size = FL2K_BUF_LEN + (4 * RESAMPLE_MARGIN);
+	soxr_data_b.handshake = &handshake_b;
+	soxr_data_b.in = resbuf_b;
+	soxr_data_b.out = outbuf_b;
+	soxr_data_b.fifo = arena_b.obuf;
+	soxr_data_b.fifo_size = FL2K_BUF_LEN + (4 * RESAMPLE_MARGIN);
+}
+
+//start the processing threads
+if(red == 1)
+{
+	if(worker_init(&worker_r, read_sample_job, (void *)'R') < 0 ||
+	   (resample && worker_init(&worker_r_res, resample_job, &soxr_data_r) < 0))
+	{
+		goto out;
+	}
+}
+if(green == 1)
+{
+	if(worker_init(&worker_g, read_sample_job, (void *)'G') < 0 ||
+	   (resample && worker_init(&worker_g_res, resample_job, &soxr_data_g) < 0))
+	{
+		goto out;
+	}
+}
+if(blue == 1)
+{
+	if(worker_init(&worker_b, read_sample_job, (void *)'B') < 0 ||
+	   (resample && worker_init(&worker_b_res, resample_job, &soxr_data_b) < 0))
+	{
+		goto out;
+	}
+}
+
+//the first blocks are read before the start, the first transfer has resampled data
+if(resample)
+{
+	if(red == 1){worker_post(&worker_r); worker_post(&worker_r_res);}
+	if(green == 1){worker_post(&worker_g); worker_post(&worker_g_res);}
+	if(blue == 1){worker_post(&worker_b); worker_post(&worker_b_res);}
+	if(red == 1){worker_wait(&worker_r); worker_wait(&worker_r_res);}
+	if(green == 1){worker_wait(&worker_g); worker_wait(&worker_g_res);}
+	if(blue == 1){worker_wait(&worker_b); worker_wait(&worker_b_res);}
+}
+
 //start fl2K
-r = fl2k_start_tx(dev, fl2k_callback, NULL, 0);
+if(adaptive_buf && !render_filename)
+{
+	fl2k_set_adaptive_buffers(dev, adaptive_buf);
+}
+
+if(render_filename)
+{
+	r = (pthread_create(&thread_write, NULL, fl2k_render_worker, NULL) == 0) ? 0 : -1;
+}
+else if(clock_sync >= 0)
+{
+	if(clock_sync == 0)
+	{
+		clock_sync = resample ? output_sample_rate : input_sample_rate;
+	}
+	
+	//line based slip points, placed by clock_sync_rebase with the first buffer
+	if(!resample && video_standard == 'P')
+	{
+		clock_line = 1135;
+	}
+	else if(!resample && video_standard == 'N')
+	{
+		clock_line = 910;
+	}
+	
+	r = fl2k_start_tx_write(dev, 0, 0);
+	if(r == 0)
+	{
+		//set the period now, so the accumulated error is kept on every rebase
+		fl2k_set_clock_discipline(dev, clock_sync, clock_line ? clock_line : 1, 0);
+		pthread_create(&thread_write, NULL, fl2k_write_worker, NULL);
+	}
+}
+else
+{
+	r = fl2k_start_tx(dev, fl2k_callback, NULL, 0);
+}
 
 
 #ifndef _WIN32
@@ -1976,17 +6090,119 @@ r = fl2k_start_tx(dev, fl2k_callback, NULL, 0);
 	sigaction(SIGTERM, &sigact, NULL);
 	sigaction(SIGQUIT, &sigact, NULL);
 	sigaction(SIGPIPE, &sigign, NULL);
+	if(trace_filename)
+	{
+		sigact.sa_handler = sighandler_trace;
+		sigaction(SIGUSR1, &sigact, NULL);
+	}
 #else
 	SetConsoleCtrlHandler( (PHANDLER_ROUTINE) sighandler, TRUE );
 #endif
 
 	while (!do_exit)
+	{
 		sleep_ms(500);
+		
+		//periodic stage report
+		if(stage_timing && stats_interval > 0 && now_ns() >= stats_next)
+		{
+			stats_report();
+			stats_next += (uint64_t)(stats_interval * 1e9);
+		}
+		
+		//dump the flight recorder on request
+		if(trace_dump_req)
+		{
+			trace_dump_req = 0;
+			if(fl2k_trace_dump(dev, trace_filename) == 0)
+			{
+				fprintf(stderr, "Flight recorder written to %s\n", trace_filename);
+			}
+		}
+	}
+
+	if(clock_sync >= 0 && r == 0)
+	{
+		fl2k_stop_tx(dev);
+		pthread_join(thread_write, NULL);
+		fprintf(stderr, "Clock discipline : %lld samples corrected\n", (long long)fl2k_get_clock_slips(dev));
+	}
+	
+	if(render_filename && r == 0)
+	{
+		pthread_join(thread_write, NULL);
+		fprintf(stderr, "Render : %llu buffers, %.2f s of output in %.2f s, %.2fx real time\n", (unsigned long long)render_buffers,
+			((double)render_buffers * FL2K_BUF_LEN) / output_sample_rate, render_ns / 1e9,
+			(((double)render_buffers * FL2K_BUF_LEN) / output_sample_rate) / (render_ns / 1e9));
+	}
+
+	reader_stats(&reader_r);
+	reader_stats(&reader2_r);
+	reader_stats(&reader_g);
+	reader_stats(&reader2_g);
+	reader_stats(&reader_b);
+	reader_stats(&reader2_b);
+	reader_stats(&reader_audio);
+	audio_out_stats(&audio_output);
+	pipe_out_stats(&pipe_output);
+	if(stage_timing)
+	{
+		stats_report();
+	}
+	
+	resampler_stats(&soxr_data_r);
+	resampler_stats(&soxr_data_g);
+	resampler_stats(&soxr_data_b);
 
 	fl2k_close(dev);
 
 out:
 
+//stop the readers first, a processing thread may be waiting for data
+	reader_stop(&reader_r);
+	reader_stop(&reader2_r);
+	reader_stop(&reader_g);
+	reader_stop(&reader2_g);
+	reader_stop(&reader_b);
+	reader_stop(&reader2_b);
+	//the audio thread writes the released frames first, out of its reader
+	audio_out_stop(&audio_output);
+	reader_stop(&reader_audio);
+	pipe_out_stop(&pipe_output);
+
+//stop the processing threads
+	worker_stop(&worker_r);
+	worker_stop(&worker_g);
+	worker_stop(&worker_b);
+	worker_stop(&worker_r_res);
+	worker_stop(&worker_g_res);
+	worker_stop(&worker_b_res);
+
+	reader_free(&reader_r);
+	reader_free(&reader2_r);
+	reader_free(&reader_g);
+	reader_free(&reader2_g);
+	reader_free(&reader_b);
+	reader_free(&reader2_b);
+	reader_free(&reader_audio);
+	playlist_free(&playlist_r);
+	playlist_free(&playlist2_r);
+	playlist_free(&playlist_g);
+	playlist_free(&playlist2_g);
+	playlist_free(&playlist_b);
+	playlist_free(&playlist2_b);
+	playlist_free(&playlist_audio);
+	pipe_out_free(&pipe_output);
+	if(stats_json)
+	{
+		fclose(stats_json);
+	}
+	if(render_file && render_file != stdout)
+	{
+		fclose(render_file);
+	}
+	free(render_buf);
+
 //close resampler
 	if(resampler_r && red == 1)
 	{
@@ -1995,13 +6211,17 @@ out:
 	
 	if(resampler_g && green == 1)
 	{
-		resampler_close(resampler_r);
+		resampler_close(resampler_g);
 	}
 	
 	if(resampler_b && blue == 1)
 	{
-		resampler_close(resampler_r);
+		resampler_close(resampler_b);
 	}
+	
+	fir_close(soxr_data_r.fir);
+	fir_close(soxr_data_g.fir);
+	fir_close(soxr_data_b.fir);
 
 //RED
 	if(red == 1)
@@ -2020,6 +6240,8 @@ out:
 		{
 			free(outbuf_r);
 		}
+		
+		arena_free(&arena_r);
 
 		if (file_r && (file_r != stdin))
 		{
@@ -2051,6 +6273,8 @@ out:
 		{
 			free(outbuf_g);
 		}
+		
+		arena_free(&arena_g);
 
 		if (file_g && (file_g != stdin))
 		{
@@ -2083,6 +6307,8 @@ out:
 		{
 			free(outbuf_b);
 		}
+		
+		arena_free(&arena_b);
 
 		if (file_b && (file_b != stdin))
 		{
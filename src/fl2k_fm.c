@@ -56,16 +56,11 @@ fl2k_dev_t *dev = NULL;
 int do_exit = 0;
 
 pthread_t fm_thread;
-pthread_mutex_t cb_mutex;
 pthread_mutex_t fm_mutex;
-pthread_cond_t cb_cond;
 pthread_cond_t fm_cond;
 
 FILE *file;
-int8_t *txbuf = NULL;
 int8_t *fmbuf = NULL;
-int8_t *buf1 = NULL;
-int8_t *buf2 = NULL;
 
 uint32_t samp_rate = 100000000;
 
@@ -219,51 +214,43 @@ static inline void dds_real_buf(dds_t *dds, int8_t *buf, int count)
 /* Signal generation and some helpers */
 
 /* Generate the radio signal using the pre-calculated frequency information
- * in the freq buffer */
+ * in the freq buffer, the library packs the blocks into transfers */
 static void *fm_worker(void *arg)
 {
-	register double freq;
-	register double tmp;
 	dds_t carrier;
-	int8_t *tmp_ptr;
+	fl2k_data_info_t data_info;
 	uint32_t len = 0;
-	uint32_t readlen, remaining;
-	int buf_prefilled = 0;
 
 	/* Prepare the oscillators */
 	carrier = dds_init(samp_rate, carrier_freq, 0);
 
+	memset(&data_info, 0, sizeof(fl2k_data_info_t));
+	data_info.sampletype_signed_r = 1;
+	data_info.r_buf = (char *)fmbuf;
+
 	while (!do_exit) {
+		/* hand over what we have before the buffer overflows */
+		if ((len + carrier_per_signal) > FL2K_BUF_LEN) {
+			data_info.len = len;
+			if (fl2k_write(dev, &data_info) < 0) {
+				fprintf(stderr, "Device error, exiting.\n");
+				do_exit = 1;
+				break;
+			}
+			len = 0;
+		}
+
 		dds_set_freq(&carrier, freqbuf[readpos], slopebuf[readpos]);
 		readpos++;
 		readpos &= BUFFER_SAMPLES_MASK;
 
-		/* check if we reach the end of the buffer */
-		if ((len + carrier_per_signal) > FL2K_BUF_LEN) {
-			readlen = FL2K_BUF_LEN - len;
-			remaining = carrier_per_signal - readlen;
-			dds_real_buf(&carrier, &fmbuf[len], readlen);
-
-			if (buf_prefilled) {
-				/* swap buffers */
-				tmp_ptr = fmbuf;
-				fmbuf = txbuf;
-				txbuf = tmp_ptr;
-				pthread_cond_wait(&cb_cond, &cb_mutex);
-			}
-
-			dds_real_buf(&carrier, fmbuf, remaining);
-			len = remaining;
-
-			buf_prefilled = 1;
-		} else {
-			dds_real_buf(&carrier, &fmbuf[len], carrier_per_signal);
-			len += carrier_per_signal;
-		}
+		dds_real_buf(&carrier, &fmbuf[len], carrier_per_signal);
+		len += carrier_per_signal;
 
 		pthread_cond_signal(&fm_cond);
 	}
 
+	pthread_cond_signal(&fm_cond);
 	pthread_exit(NULL);
 }
 
@@ -416,22 +403,6 @@ void fm_modulator_stereo(int use_rds)
 	}
 }
 
-void fl2k_callback(fl2k_data_info_t *data_info)
-{
-	if (data_info->device_error) {
-		fprintf(stderr, "Device error, exiting.\n");
-		do_exit = 1;
-		pthread_cond_signal(&fm_cond);
-	}
-
-	pthread_cond_signal(&cb_cond);
-
-	data_info->sampletype_signed_r = 1;
-	data_info->sampletype_signed_g = 1;
-	data_info->sampletype_signed_b = 1;
-	data_info->r_buf = (char *)txbuf;
-}
-
 int main(int argc, char **argv)
 {
 	int r, opt;
@@ -526,16 +497,12 @@ int main(int argc, char **argv)
 	}
 
 	/* allocate buffer */
-	buf1 = malloc(FL2K_BUF_LEN);
-	buf2 = malloc(FL2K_BUF_LEN);
-	if (!buf1 || !buf2) {
+	fmbuf = malloc(FL2K_BUF_LEN);
+	if (!fmbuf) {
 		fprintf(stderr, "malloc error!\n");
 		exit(1);
 	}
 
-	fmbuf = buf1;
-	txbuf = buf2;
-
 	/* Decoded audio */
 	freqbuf = malloc(BUFFER_SAMPLES * sizeof(double));
 	slopebuf = malloc(BUFFER_SAMPLES * sizeof(double));
@@ -548,9 +515,7 @@ int main(int argc, char **argv)
 					(double)((samp_rate - carrier_freq) / 1000000.0),
 					(double)((samp_rate + carrier_freq) / 1000000.0));
 
-	pthread_mutex_init(&cb_mutex, NULL);
 	pthread_mutex_init(&fm_mutex, NULL);
-	pthread_cond_init(&cb_cond, NULL);
 	pthread_cond_init(&fm_cond, NULL);
 	pthread_attr_init(&attr);
 
@@ -560,14 +525,7 @@ int main(int argc, char **argv)
 		goto out;
 	}
 
-	r = pthread_create(&fm_thread, &attr, fm_worker, NULL);
-	if (r < 0) {
-		fprintf(stderr, "Error spawning FM worker thread!\n");
-		goto out;
-	}
-
-	pthread_attr_destroy(&attr);
-	r = fl2k_start_tx(dev, fl2k_callback, NULL, 0);
+	r = fl2k_start_tx_write(dev, 0, 0);
 
 	/* Set the sample rate */
 	r = fl2k_set_sample_rate(dev, samp_rate);
@@ -580,6 +538,14 @@ int main(int argc, char **argv)
 	/* Calculate needed constants */
 	carrier_per_signal = samp_rate / input_freq;
 
+	r = pthread_create(&fm_thread, &attr, fm_worker, NULL);
+	if (r < 0) {
+		fprintf(stderr, "Error spawning FM worker thread!\n");
+		goto out;
+	}
+
+	pthread_attr_destroy(&attr);
+
 	/* Set RDS parameters */
 	set_rds_pi(0x0dac);
 	set_rds_ps("fl2k_fm");
@@ -616,8 +582,7 @@ out:
 
 	free(freqbuf);
 	free(slopebuf);
-	free(buf1);
-	free(buf2);
+	free(fmbuf);
 
 	return 0;
 }
@@ -119,6 +119,7 @@ void usage(void)
 		"\t[-MaxValueR max value for channel R (1 to 255) (reference level) (used for Vmax)\n"
 		"\t[-MaxValueG max value for channel G (1 to 255) (reference level) (used for Vmax)\n"
 		"\t[-MaxValueB max value for channel B (1 to 255) (reference level) (used for Vmax)\n"
+		"\t[-dacCal DAC calibration file (per channel transfer table applied by the library)\n"
 		//"\t[-MinValueR min value for channel R (0 to 254) (reference level) (used for Vmax)\n"
 		//"\t[-MinValueG min value for channel G (0 to 254) (reference level) (used for Vmax)\n"
 		//"\t[-MinValueB min value for channel B (0 to 254) (reference level) (used for Vmax)\n"
@@ -234,6 +235,28 @@ void vbi_generator(long *sample_count,int *line_count,int is_60hz,long number_sa
 	}
 }
 
+//scale to max voltage through the DAC table of the library, then through the calibration already loaded
+void set_vmax_lut(enum fl2k_dac dac, double v_max, int max_value)
+{
+	uint8_t cal[256];
+	uint8_t lut[256];
+	double value;
+	int i;
+	
+	if(v_max <= 0.0 || fl2k_get_dac_lut(dev, dac, cal) < 0)
+	{
+		return;
+	}
+	
+	for(i = 0; i < 256; i++)
+	{
+		value = round((i * (255.0 / max_value)) / (0.7 / v_max));
+		lut[i] = cal[(value > 255) ? 255 : (int)value];
+	}
+	
+	fl2k_set_dac_lut(dev, dac, lut);
+}
+
 int read_sample_file(void *inpt_color)
 {
 	//parametter
@@ -439,6 +462,7 @@ int main(int argc, char **argv)
 	uint32_t buf_num = 0;
 	int dev_index = 0;
 	void *status;
+	char *filename_dac_cal = NULL;
 	
 	int option_index = 0;
 	static struct option long_options[] = {
@@ -453,6 +477,7 @@ int main(int argc, char **argv)
 		{"MaxValueR", 1, 0, 41},
 		{"MaxValueG", 1, 0, 42},
 		{"MaxValueB", 1, 0, 43},
+		{"dacCal", 1, 0, 44},
 		{0, 0, 0, 0}//reminder : letter value are from 65 to 122
 	};
 
@@ -514,6 +539,9 @@ int main(int argc, char **argv)
 		case 43:
 			max_value_b = atoi(optarg);
 			break;
+		case 44:
+			filename_dac_cal = optarg;
+			break;
 		default:
 			usage();
 			break;
@@ -588,6 +616,16 @@ if(blue == 1)
 		goto out;
 	}
 
+	/* DAC calibration, the Vmax scaling is composed with it into one DAC table */
+	if(filename_dac_cal && fl2k_load_dac_lut(dev, filename_dac_cal) < 0)
+	{
+		fprintf(stderr, "Failed to load DAC calibration %s\n", filename_dac_cal);
+		goto out;
+	}
+	set_vmax_lut(FL2K_DAC_R, v_max_r, max_value_r);
+	set_vmax_lut(FL2K_DAC_G, v_max_g, max_value_g);
+	set_vmax_lut(FL2K_DAC_B, v_max_b, max_value_b);
+
 	r = fl2k_start_tx(dev, fl2k_callback, NULL, 0);
 
 	/* Set the sample rate */
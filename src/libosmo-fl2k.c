@@ -26,9 +26,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <time.h>
 #include "libusb.h"
 #include <pthread.h>
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_CRC32C_ARM
+#endif
+
 #ifndef _WIN32
 #include <unistd.h>
 #define sleep_ms(ms)	usleep(ms*1000)
@@ -54,6 +63,7 @@
 #endif
 
 #include "osmo-fl2k.h"
+#include "fl2k_probes.h"
 
 enum fl2k_async_status {
 	FL2K_INACTIVE = 0,
@@ -67,10 +77,20 @@ typedef enum fl2k_buf_state {
 	BUF_FILLED,
 } fl2k_buf_state_t;
 
+typedef struct fl2k_trace_event {
+	uint64_t ts;		/* ns, CLOCK_MONOTONIC */
+	uint64_t arg;
+	const char *name;
+	uint32_t track;
+	char phase;		/* 'B'egin, 'E'nd or 'i'nstant */
+	volatile uint64_t seq;	/* ring index + 1 once the event is complete */
+} fl2k_trace_event_t;
+
 typedef struct fl2k_xfer_info {
 	fl2k_dev_t *dev;
 	uint64_t seq;
 	fl2k_buf_state_t state;
+	uint32_t hash;		/* payload hash for the audit log */
 } fl2k_xfer_info_t;
 
 struct fl2k_dev {
@@ -78,6 +98,15 @@ struct fl2k_dev {
 	struct libusb_device_handle *devh;
 	uint32_t xfer_num;
 	uint32_t xfer_buf_num;
+
+	/* adaptive buffer depth, xfer_max is 0 for a fixed depth */
+	uint32_t xfer_max;
+	volatile uint32_t xfer_depth;	/* transfers to keep in flight */
+	volatile uint32_t xfer_active;	/* transfers in use incl. spares */
+	uint32_t xfer_inflight;		/* only touched by the USB side */
+	double adapt_backlog;		/* ns behind the transfer periods */
+	uint64_t adapt_quiet_since;
+	uint32_t adapt_hold;
 	uint32_t xfer_buf_len;
 	struct libusb_transfer **xfer;
 	unsigned char **xfer_buf;
@@ -95,11 +124,63 @@ struct fl2k_dev {
 	/* thread related */
 	pthread_t usb_worker_thread;
 	pthread_t sample_worker_thread;
+	pthread_t log_worker_thread;	/* file output off the streaming path */
+	pthread_mutex_t log_mutex;
+	pthread_cond_t log_cond;
+	int log_running;
+	int log_quit;
 	pthread_mutex_t buf_mutex;
 	pthread_cond_t buf_cond;
 
 	double rate; /* Hz */
 
+	/* DAC calibration tables, indexed by [dac][signed samples][sample],
+	 * the sign offset is already folded into the second table */
+	uint8_t dac_lut[3][2][256];
+	int dac_lut_enabled[3];
+
+	/* write mode reblocking ring, the block handed to the sample worker
+	 * starts at ring_rd and is followed by ring_fill written samples */
+	char *ring_buf[3];
+	char *ring_stage[3];	/* blocks that wrap or contain slips */
+	uint32_t ring_len;	/* samples per channel, multiple of FL2K_BUF_LEN */
+	uint32_t ring_rd;
+	uint32_t ring_fill;
+	uint32_t ring_busy;	/* samples handed out for conversion */
+	uint64_t ring_pos;	/* stream position of ring_rd */
+	int ring_signed[3];
+	int ring_active[3];
+	pthread_mutex_t ring_mutex;
+	pthread_cond_t ring_cond;
+
+	/* clock discipline, protected by ring_mutex */
+	double clock_ref_rate;	/* Hz, 0 if disabled */
+	double clock_err;	/* samples to drop, negative to repeat */
+	uint32_t clock_period;
+	uint32_t clock_offset;
+	uint64_t clock_next;	/* stream position of the next slip point */
+	int64_t clock_slips;
+
+	/* flight recorder */
+	fl2k_trace_event_t *trace;
+	uint32_t trace_mask;
+	volatile uint64_t trace_head;
+	char *trace_file;	/* dump on underflow */
+	uint64_t trace_last_dump;
+	volatile uint64_t trace_dump_head;	/* pending dump, 0 if none */
+	const char *trace_req;	/* fl2k_trace_dump() for the log worker */
+	uint32_t trace_req_seq;
+	uint32_t trace_done_seq;
+	int trace_req_result;
+
+	/* transfer audit log, the records are queued by the USB side and
+	 * written by the log worker */
+	FILE *audit_file;
+	fl2k_audit_record_t *audit_ring;
+	volatile uint64_t audit_head;
+	volatile uint64_t audit_tail;
+	uint32_t audit_dropped;
+
 	/* status */
 	int dev_lost;
 	int driver_active;
@@ -117,6 +198,38 @@ static fl2k_dongle_t known_devices[] = {
 };
 
 #define DEFAULT_BUF_NUMBER	4
+#define ADAPT_MIN_BUF_NUMBER	2
+#define ADAPT_GROW_MARGIN	0.5	/* backlog share of the queue */
+#define ADAPT_SHRINK_MARGIN	0.25
+#define ADAPT_QUIET_TIME	30000000000ULL	/* ns */
+#define FL2K_MAX_SLIPS		1024	/* clock slips per transfer */
+#define DEFAULT_TRACE_EVENTS	4096
+#define MAX_TRACE_EVENTS	(1 << 24)
+#define TRACE_DUMP_INTERVAL	10000000000ULL	/* ns */
+#define LOG_POLL_INTERVAL	50	/* ms */
+#define AUDIT_RING_RECORDS	1024	/* power of two */
+
+#ifdef _MSC_VER
+#define fl2k_fetch_inc(p)	((uint64_t)InterlockedIncrement64((volatile LONG64 *)(p)) - 1)
+#define fl2k_fetch_inc32(p)	((uint32_t)InterlockedIncrement((volatile LONG *)(p)) - 1)
+#define fl2k_take32(p)		((uint32_t)InterlockedExchange((volatile LONG *)(p), 0))
+#define fl2k_barrier()		MemoryBarrier()
+#else
+#define fl2k_fetch_inc(p)	__atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+#define fl2k_fetch_inc32(p)	__atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+#define fl2k_take32(p)		__atomic_exchange_n((p), 0, __ATOMIC_RELAXED)
+#define fl2k_barrier()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+FL2K_PROBE_DEFINE(cb_enter);
+FL2K_PROBE_DEFINE(cb_exit);
+FL2K_PROBE_DEFINE(convert_start);
+FL2K_PROBE_DEFINE(convert_end);
+FL2K_PROBE_DEFINE(xfer_fill);
+FL2K_PROBE_DEFINE(xfer_complete);
+FL2K_PROBE_DEFINE(xfer_submit);
+FL2K_PROBE_DEFINE(underflow);
+FL2K_PROBE_DEFINE(get_next_xfer);
 
 #define CTRL_IN		(LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN)
 #define CTRL_OUT	(LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT)
@@ -361,15 +474,13 @@ static double fl2k_reg_to_freq(uint32_t reg)
 	return sample_clock;
 }
 
-int fl2k_set_sample_rate(fl2k_dev_t *dev, uint32_t target_freq)
+/* closest PLL setting to the requested rate */
+static uint32_t fl2k_rate_to_reg(uint32_t target_freq)
 {
 	double sample_clock, error, last_error = 1e20f;
 	uint32_t reg = 0, result_reg = 0;
 	uint8_t div, mult, frac, out_div;
 
-	if (!dev)
-		return FL2K_ERROR_INVALID_PARAM;
-
 	/* Output divider (accepts value 1-15)
 	 * works, but adds lots of phase noise, so do not use it */
 	out_div = 1;
@@ -394,6 +505,18 @@ int fl2k_set_sample_rate(fl2k_dev_t *dev, uint32_t target_freq)
 		}
 	}
 
+	return result_reg;
+}
+
+int fl2k_set_sample_rate(fl2k_dev_t *dev, uint32_t target_freq)
+{
+	double sample_clock, error;
+	uint32_t result_reg;
+
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	result_reg = fl2k_rate_to_reg(target_freq);
 	sample_clock = fl2k_reg_to_freq(result_reg);
 	error = sample_clock - (double)target_freq;
 	dev->rate = sample_clock;
@@ -410,6 +533,11 @@ int fl2k_set_sample_rate(fl2k_dev_t *dev, uint32_t target_freq)
 	return fl2k_write_reg(dev, 0x802c, result_reg);
 }
 
+uint32_t fl2k_get_nearest_sample_rate(uint32_t target_freq)
+{
+	return (uint32_t)fl2k_reg_to_freq(fl2k_rate_to_reg(target_freq));
+}
+
 uint32_t fl2k_get_sample_rate(fl2k_dev_t *dev)
 {
 	if (!dev)
@@ -418,6 +546,492 @@ uint32_t fl2k_get_sample_rate(fl2k_dev_t *dev)
 	return (uint32_t)dev->rate;
 }
 
+int fl2k_set_dac_lut(fl2k_dev_t *dev, enum fl2k_dac dac, const uint8_t *lut)
+{
+	unsigned int i;
+
+	if (!dev || dac > FL2K_DAC_B)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (!lut) {
+		dev->dac_lut_enabled[dac] = 0;
+		return 0;
+	}
+
+	for (i = 0; i < 256; i++) {
+		dev->dac_lut[dac][0][i] = lut[i];
+		dev->dac_lut[dac][1][i] = lut[(uint8_t)(i + 128)];
+	}
+
+	dev->dac_lut_enabled[dac] = 1;
+
+	return 0;
+}
+
+int fl2k_get_dac_lut(fl2k_dev_t *dev, enum fl2k_dac dac, uint8_t *lut)
+{
+	unsigned int i;
+
+	if (!dev || dac > FL2K_DAC_B || !lut)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	for (i = 0; i < 256; i++)
+		lut[i] = dev->dac_lut_enabled[dac] ? dev->dac_lut[dac][0][i] : i;
+
+	return 0;
+}
+
+int fl2k_load_dac_lut(fl2k_dev_t *dev, const char *filename)
+{
+	FILE *f;
+	char tok[16];
+	uint8_t lut[256];
+	enum fl2k_dac dac;
+	unsigned int i, val;
+	int c, r = 0;
+
+	if (!dev || !filename)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		fprintf(stderr, "Failed to open DAC calibration file %s\n",
+				filename);
+		return FL2K_ERROR_NOT_FOUND;
+	}
+
+	while (fscanf(f, "%15s", tok) == 1) {
+		if (tok[0] == '#') {
+			/* skip comment */
+			while ((c = fgetc(f)) != EOF && c != '\n');
+			continue;
+		}
+
+		/* channel names are a single letter */
+		switch (tok[1] ? 0 : tok[0]) {
+		case 'R': case 'r': dac = FL2K_DAC_R; break;
+		case 'G': case 'g': dac = FL2K_DAC_G; break;
+		case 'B': case 'b': dac = FL2K_DAC_B; break;
+		default:
+			fprintf(stderr, "DAC calibration: unknown channel "
+					"'%s'\n", tok);
+			r = FL2K_ERROR_INVALID_PARAM;
+			goto out;
+		}
+
+		for (i = 0; i < 256; i++) {
+			if (fscanf(f, "%u", &val) != 1 || val > 255) {
+				fprintf(stderr, "DAC calibration: invalid "
+						"value at index %u for channel %c\n",
+						i, tok[0]);
+				r = FL2K_ERROR_INVALID_PARAM;
+				goto out;
+			}
+			lut[i] = val;
+		}
+
+		fl2k_set_dac_lut(dev, dac, lut);
+	}
+
+out:
+	fclose(f);
+	return r;
+}
+
+static uint64_t fl2k_trace_ts(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* lock-free: writers claim a slot, readers skip slots that are being
+ * rewritten by checking the sequence number before and after the copy */
+static inline void fl2k_trace_event(fl2k_dev_t *dev, uint32_t track,
+				    char phase, const char *name, uint64_t arg)
+{
+	fl2k_trace_event_t *ev;
+	uint64_t idx;
+
+	if (!dev->trace)
+		return;
+
+	idx = fl2k_fetch_inc(&dev->trace_head);
+	ev = &dev->trace[idx & dev->trace_mask];
+
+	ev->seq = 0;
+	fl2k_barrier();
+
+	ev->ts = fl2k_trace_ts();
+	ev->arg = arg;
+	ev->name = name;
+	ev->track = track;
+	ev->phase = phase;
+
+	fl2k_barrier();
+	ev->seq = idx + 1;
+}
+
+int fl2k_trace_enable(fl2k_dev_t *dev, uint32_t num_events,
+		      const char *underflow_file)
+{
+	uint32_t size = 1;
+
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (!num_events)
+		num_events = DEFAULT_TRACE_EVENTS;
+
+	if (num_events > MAX_TRACE_EVENTS)
+		num_events = MAX_TRACE_EVENTS;
+
+	while (size < num_events)
+		size <<= 1;
+
+	free(dev->trace);
+	free(dev->trace_file);
+	dev->trace_file = NULL;
+
+	dev->trace = calloc(size, sizeof(fl2k_trace_event_t));
+	if (!dev->trace)
+		return FL2K_ERROR_NO_MEM;
+
+	dev->trace_mask = size - 1;
+	dev->trace_head = 0;
+	dev->trace_last_dump = 0;
+	dev->trace_dump_head = 0;
+
+	if (underflow_file) {
+		dev->trace_file = malloc(strlen(underflow_file) + 1);
+		if (!dev->trace_file)
+			return FL2K_ERROR_NO_MEM;
+
+		strcpy(dev->trace_file, underflow_file);
+	}
+
+	return 0;
+}
+
+void fl2k_trace_begin(fl2k_dev_t *dev, uint32_t track, const char *name,
+		      uint64_t arg)
+{
+	if (dev)
+		fl2k_trace_event(dev, track, 'B', name, arg);
+}
+
+void fl2k_trace_end(fl2k_dev_t *dev, uint32_t track, const char *name,
+		    uint64_t arg)
+{
+	if (dev)
+		fl2k_trace_event(dev, track, 'E', name, arg);
+}
+
+/* write the events before head, as far as they were not overwritten yet */
+static int fl2k_trace_write(fl2k_dev_t *dev, const char *filename,
+			    uint64_t head)
+{
+	FILE *f;
+	fl2k_trace_event_t *slot, ev;
+	uint64_t idx, seq;
+
+	f = fopen(filename, "w");
+	if (!f) {
+		fprintf(stderr, "Failed to open trace file %s\n", filename);
+		return FL2K_ERROR_NOT_FOUND;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+		"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"tid\":%d,\"args\":{\"name\":\"sample worker\"}},\n"
+		"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"tid\":%d,\"args\":{\"name\":\"usb\"}}",
+		FL2K_TRACE_TRACK_SAMPLE, FL2K_TRACE_TRACK_USB);
+
+	idx = (head > dev->trace_mask) ? head - dev->trace_mask - 1 : 0;
+
+	for (; idx < head; idx++) {
+		slot = &dev->trace[idx & dev->trace_mask];
+
+		seq = slot->seq;
+		fl2k_barrier();
+		ev = *slot;
+		fl2k_barrier();
+
+		/* skip events that are incomplete or already overwritten */
+		if ((seq != idx + 1) || (slot->seq != seq) || !ev.name)
+			continue;
+
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+			"\"pid\":1,\"tid\":%u,%s\"args\":{\"arg\":%llu}}",
+			ev.name, ev.phase, ev.ts / 1000.0, ev.track,
+			(ev.phase == 'i') ? "\"s\":\"t\"," : "",
+			(unsigned long long)ev.arg);
+	}
+
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	return 0;
+}
+
+int fl2k_trace_dump(fl2k_dev_t *dev, const char *filename)
+{
+	uint32_t seq;
+	int r;
+
+	if (!dev || !filename || !dev->trace)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	/* while streaming, the log worker is the only one writing trace
+	 * files, so this can't interleave with an underflow dump */
+	pthread_mutex_lock(&dev->log_mutex);
+	while (dev->trace_req && dev->log_running)
+		pthread_cond_wait(&dev->log_cond, &dev->log_mutex);
+
+	seq = 0;
+	if (dev->log_running) {
+		seq = ++dev->trace_req_seq;
+		dev->trace_req = filename;
+		pthread_cond_broadcast(&dev->log_cond);
+
+		while ((int32_t)(dev->trace_done_seq - seq) < 0 &&
+		       dev->log_running)
+			pthread_cond_wait(&dev->log_cond, &dev->log_mutex);
+	}
+
+	if (seq && (int32_t)(dev->trace_done_seq - seq) >= 0) {
+		r = dev->trace_req_result;
+		pthread_mutex_unlock(&dev->log_mutex);
+		return r;
+	}
+
+	/* no log worker (any more), nobody else writes */
+	if (dev->trace_req == filename)
+		dev->trace_req = NULL;
+	pthread_mutex_unlock(&dev->log_mutex);
+
+	fl2k_barrier();
+	return fl2k_trace_write(dev, filename, dev->trace_head);
+}
+
+#define AUDIT_LANES	4
+
+static uint32_t crc32c_table[256];
+
+static uint32_t fl2k_crc32c_sw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	while (len--)
+		crc = crc32c_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+static uint32_t fl2k_audit_finish(const uint32_t *lane_crc)
+{
+	uint8_t b[4 * AUDIT_LANES];
+	unsigned int i;
+
+	for (i = 0; i < AUDIT_LANES; i++) {
+		b[i*4 + 0] = lane_crc[i] & 0xff;
+		b[i*4 + 1] = (lane_crc[i] >> 8) & 0xff;
+		b[i*4 + 2] = (lane_crc[i] >> 16) & 0xff;
+		b[i*4 + 3] = (lane_crc[i] >> 24) & 0xff;
+	}
+
+	return ~fl2k_crc32c_sw(~0U, b, sizeof(b));
+}
+
+static uint32_t fl2k_audit_hash_sw(const uint8_t *buf, size_t len)
+{
+	uint32_t c[AUDIT_LANES];
+	size_t lane = (len / AUDIT_LANES) & ~(size_t)7;
+	unsigned int i;
+
+	for (i = 0; i < AUDIT_LANES; i++)
+		c[i] = ~fl2k_crc32c_sw(~0U, buf + i * lane,
+				       (i == AUDIT_LANES - 1) ?
+				       len - i * lane : lane);
+
+	return fl2k_audit_finish(c);
+}
+
+/* The hardware variants run the four lanes interleaved, so the latency of
+ * the CRC instruction is hidden */
+#ifdef HAVE_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t fl2k_audit_hash_sse42(const uint8_t *buf, size_t len)
+{
+	uint64_t c0 = ~0U, c1 = ~0U, c2 = ~0U, c3 = ~0U, v;
+	uint32_t c[AUDIT_LANES];
+	size_t lane = (len / AUDIT_LANES) & ~(size_t)7;
+	size_t i;
+
+	for (i = 0; i < lane; i += 8) {
+		memcpy(&v, buf + i, 8);
+		c0 = _mm_crc32_u64(c0, v);
+		memcpy(&v, buf + lane + i, 8);
+		c1 = _mm_crc32_u64(c1, v);
+		memcpy(&v, buf + 2 * lane + i, 8);
+		c2 = _mm_crc32_u64(c2, v);
+		memcpy(&v, buf + 3 * lane + i, 8);
+		c3 = _mm_crc32_u64(c3, v);
+	}
+
+	/* rest of the last lane */
+	for (i = 4 * lane; i < len; i++)
+		c3 = _mm_crc32_u8((uint32_t)c3, buf[i]);
+
+	c[0] = ~(uint32_t)c0;
+	c[1] = ~(uint32_t)c1;
+	c[2] = ~(uint32_t)c2;
+	c[3] = ~(uint32_t)c3;
+
+	return fl2k_audit_finish(c);
+}
+#endif
+
+#ifdef HAVE_CRC32C_ARM
+static uint32_t fl2k_audit_hash_arm(const uint8_t *buf, size_t len)
+{
+	uint32_t c0 = ~0U, c1 = ~0U, c2 = ~0U, c3 = ~0U;
+	uint32_t c[AUDIT_LANES];
+	size_t lane = (len / AUDIT_LANES) & ~(size_t)7;
+	uint64_t v;
+	size_t i;
+
+	for (i = 0; i < lane; i += 8) {
+		memcpy(&v, buf + i, 8);
+		c0 = __crc32cd(c0, v);
+		memcpy(&v, buf + lane + i, 8);
+		c1 = __crc32cd(c1, v);
+		memcpy(&v, buf + 2 * lane + i, 8);
+		c2 = __crc32cd(c2, v);
+		memcpy(&v, buf + 3 * lane + i, 8);
+		c3 = __crc32cd(c3, v);
+	}
+
+	/* rest of the last lane */
+	for (i = 4 * lane; i < len; i++)
+		c3 = __crc32cb(c3, buf[i]);
+
+	c[0] = ~c0;
+	c[1] = ~c1;
+	c[2] = ~c2;
+	c[3] = ~c3;
+
+	return fl2k_audit_finish(c);
+}
+#endif
+
+static uint32_t (*fl2k_audit_hash)(const uint8_t *buf, size_t len) =
+	fl2k_audit_hash_sw;
+
+int fl2k_audit_enable(fl2k_dev_t *dev, const char *filename)
+{
+	uint32_t i, j, c;
+
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (dev->audit_file) {
+		fclose(dev->audit_file);
+		dev->audit_file = NULL;
+	}
+
+	if (!filename)
+		return 0;
+
+	if (!dev->audit_ring) {
+		dev->audit_ring = malloc(AUDIT_RING_RECORDS *
+					 sizeof(fl2k_audit_record_t));
+		if (!dev->audit_ring)
+			return FL2K_ERROR_NO_MEM;
+	}
+
+	dev->audit_head = 0;
+	dev->audit_tail = 0;
+	dev->audit_dropped = 0;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c >> 1) ^ ((c & 1) ? 0x82f63b78 : 0);
+		crc32c_table[i] = c;
+	}
+
+#if defined(HAVE_CRC32C_SSE42)
+	if (__builtin_cpu_supports("sse4.2"))
+		fl2k_audit_hash = fl2k_audit_hash_sse42;
+#elif defined(HAVE_CRC32C_ARM)
+	fl2k_audit_hash = fl2k_audit_hash_arm;
+#endif
+
+	dev->audit_file = fopen(filename, "wb");
+	if (!dev->audit_file) {
+		fprintf(stderr, "Failed to open audit log %s\n", filename);
+		return FL2K_ERROR_NOT_FOUND;
+	}
+
+	return 0;
+}
+
+static void fl2k_audit_log(fl2k_dev_t *dev, fl2k_xfer_info_t *xfer_info,
+			   uint32_t flags)
+{
+	fl2k_audit_record_t *rec;
+	uint64_t head = dev->audit_head;
+
+	if (!dev->audit_file)
+		return;
+
+	if (head - dev->audit_tail >= AUDIT_RING_RECORDS) {
+		fl2k_fetch_inc32(&dev->audit_dropped);
+		return;
+	}
+
+	rec = &dev->audit_ring[head & (AUDIT_RING_RECORDS - 1)];
+	rec->seq = xfer_info->seq;
+	rec->submit_ns = fl2k_trace_ts();
+	rec->hash = xfer_info->hash;
+	rec->flags = flags;
+
+	fl2k_barrier();
+	dev->audit_head = head + 1;
+}
+
+static void fl2k_audit_flush(fl2k_dev_t *dev)
+{
+	uint64_t head, tail = dev->audit_tail;
+	uint32_t n, dropped;
+
+	if (!dev->audit_file)
+		return;
+
+	head = dev->audit_head;
+	fl2k_barrier();
+
+	/* at most two chunks, before and after the wrap */
+	while (tail < head) {
+		n = AUDIT_RING_RECORDS - (tail & (AUDIT_RING_RECORDS - 1));
+		if (n > head - tail)
+			n = head - tail;
+
+		fwrite(&dev->audit_ring[tail & (AUDIT_RING_RECORDS - 1)],
+		       sizeof(fl2k_audit_record_t), n, dev->audit_file);
+		tail += n;
+	}
+
+	fl2k_barrier();
+	dev->audit_tail = tail;
+
+	dropped = fl2k_take32(&dev->audit_dropped);
+	if (dropped)
+		fprintf(stderr, "Audit log full, %u records dropped\n",
+				dropped);
+}
+
 static fl2k_dongle_t *find_known_device(uint16_t vid, uint16_t pid)
 {
 	unsigned int i;
@@ -519,8 +1133,17 @@ int fl2k_open(fl2k_dev_t **out_dev, uint32_t index)
 
 	memset(dev, 0, sizeof(fl2k_dev_t));
 
+	pthread_mutex_init(&dev->ring_mutex, NULL);
+	pthread_cond_init(&dev->ring_cond, NULL);
+	pthread_mutex_init(&dev->log_mutex, NULL);
+	pthread_cond_init(&dev->log_cond, NULL);
+
 	r = libusb_init(&dev->ctx);
 	if(r < 0){
+		pthread_mutex_destroy(&dev->ring_mutex);
+		pthread_cond_destroy(&dev->ring_cond);
+		pthread_mutex_destroy(&dev->log_mutex);
+		pthread_cond_destroy(&dev->log_cond);
 		free(dev);
 		return -1;
 	}
@@ -612,6 +1235,10 @@ err:
 		if (dev->ctx)
 			libusb_exit(dev->ctx);
 
+		pthread_mutex_destroy(&dev->ring_mutex);
+		pthread_cond_destroy(&dev->ring_cond);
+		pthread_mutex_destroy(&dev->log_mutex);
+		pthread_cond_destroy(&dev->log_cond);
 		free(dev);
 	}
 
@@ -620,6 +1247,8 @@ err:
 
 int fl2k_close(fl2k_dev_t *dev)
 {
+	int i;
+
 	if (!dev)
 		return FL2K_ERROR_INVALID_PARAM;
 
@@ -635,6 +1264,26 @@ int fl2k_close(fl2k_dev_t *dev)
 	libusb_close(dev->devh);
 	libusb_exit(dev->ctx);
 
+	for (i = 0; i < 3; i++) {
+		free(dev->ring_buf[i]);
+		free(dev->ring_stage[i]);
+	}
+
+	free(dev->trace);
+	free(dev->trace_file);
+
+	if (dev->audit_file) {
+		fl2k_audit_flush(dev);
+		fclose(dev->audit_file);
+		dev->audit_file = NULL;
+	}
+	free(dev->audit_ring);
+
+	pthread_mutex_destroy(&dev->ring_mutex);
+	pthread_cond_destroy(&dev->ring_cond);
+	pthread_mutex_destroy(&dev->log_mutex);
+	pthread_cond_destroy(&dev->log_cond);
+
 	free(dev);
 
 	return 0;
@@ -655,6 +1304,12 @@ static struct libusb_transfer *fl2k_get_next_xfer(fl2k_dev_t *dev,
 
 		if (xfer_info->state == state) {
 			if (state == BUF_EMPTY) {
+				/* parked by the adaptive depth */
+				if (i >= dev->xfer_active)
+					continue;
+
+				FL2K_PROBE2(get_next_xfer, xfer_info->seq,
+					    state, i);
 				return dev->xfer[i];
 			} else if ((xfer_info->seq < next_seq) || next_buf < 0) {
 				next_seq = xfer_info->seq;
@@ -663,33 +1318,74 @@ static struct libusb_transfer *fl2k_get_next_xfer(fl2k_dev_t *dev,
 		}
 	}
 
+	FL2K_PROBE2(get_next_xfer, next_seq, state,
+		    (state == BUF_FILLED) ? next_buf : -1);
+
 	if ((state == BUF_FILLED) && (next_buf >= 0))
 		return dev->xfer[next_buf];
 	else
 		return NULL;
 }
 
+/* submit the oldest filled transfer, returns NULL if there is none */
+static struct libusb_transfer *fl2k_submit_filled(fl2k_dev_t *dev, int *r)
+{
+	struct libusb_transfer *xfer;
+	fl2k_xfer_info_t *xfer_info;
+
+	xfer = fl2k_get_next_xfer(dev, BUF_FILLED);
+	if (!xfer)
+		return NULL;
+
+	xfer_info = (fl2k_xfer_info_t *)xfer->user_data;
+
+	/* Submit next filled transfer */
+	xfer_info->state = BUF_SUBMITTED;
+	*r = libusb_submit_transfer(xfer);
+	FL2K_PROBE1(xfer_submit, xfer_info->seq, *r);
+	fl2k_audit_log(dev, xfer_info, 0);
+	fl2k_trace_event(dev, FL2K_TRACE_TRACK_USB, 'i', "submit",
+			 xfer_info->seq);
+
+	return xfer;
+}
+
 static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
 {
 	fl2k_xfer_info_t *xfer_info = (fl2k_xfer_info_t *)xfer->user_data;
-	fl2k_xfer_info_t *next_xfer_info;
 	fl2k_dev_t *dev = (fl2k_dev_t *)xfer_info->dev;
-	struct libusb_transfer *next_xfer = NULL;
-	int r = 0;
+	struct libusb_transfer *extra_xfer = NULL;
+	int r = 0, r2 = 0;
+
+	FL2K_PROBE1(xfer_complete, xfer_info->seq, xfer->status);
+	fl2k_trace_event(dev, FL2K_TRACE_TRACK_USB, 'i', "complete",
+			 xfer_info->seq);
 
 	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
 		/* resubmit transfer */
 		if (FL2K_RUNNING == dev->async_status) {
-			/* get next transfer */
-			next_xfer = fl2k_get_next_xfer(dev, BUF_FILLED);
+			if ((dev->xfer_inflight > dev->xfer_depth) &&
+			    (dev->xfer_inflight > 1)) {
+				/* the depth was reduced, retire this one */
+				dev->xfer_inflight--;
+				xfer_info->state = BUF_EMPTY;
+				pthread_cond_signal(&dev->buf_cond);
+			} else if (fl2k_submit_filled(dev, &r)) {
+				xfer_info->state = BUF_EMPTY;
 
-			if (next_xfer) {
-				next_xfer_info = (fl2k_xfer_info_t *) next_xfer->user_data;
+				/* the depth was increased, add another one */
+				if (dev->xfer_inflight < dev->xfer_depth)
+					extra_xfer = fl2k_submit_filled(dev, &r2);
+
+				if (extra_xfer && (r2 < 0)) {
+					/* keep it, and the current depth */
+					((fl2k_xfer_info_t *)extra_xfer->user_data)->state =
+						BUF_FILLED;
+					dev->xfer_depth = dev->xfer_inflight;
+				} else if (extra_xfer) {
+					dev->xfer_inflight++;
+				}
 
-				/* Submit next filled transfer */
-				next_xfer_info->state = BUF_SUBMITTED;
-				r = libusb_submit_transfer(next_xfer);
-				xfer_info->state = BUF_EMPTY;
 				pthread_cond_signal(&dev->buf_cond);
 			} else {
 				/* We need to re-submit the transfer
@@ -700,6 +1396,12 @@ static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
 				r = libusb_submit_transfer(xfer);
 				pthread_cond_signal(&dev->buf_cond);
 				dev->underflow_cnt++;
+				FL2K_PROBE1(underflow, xfer_info->seq,
+					    dev->underflow_cnt);
+				fl2k_trace_event(dev, FL2K_TRACE_TRACK_USB, 'i',
+						 "underflow", xfer_info->seq);
+				fl2k_audit_log(dev, xfer_info,
+					       FL2K_AUDIT_REPEAT);
 			}
 		}
 	}
@@ -825,6 +1527,10 @@ static int fl2k_alloc_submit_transfers(fl2k_dev_t *dev)
 		}
 	}
 
+	dev->xfer_inflight = i;
+	if (dev->xfer_depth > i)
+		dev->xfer_depth = i;
+
 	return 0;
 }
 
@@ -868,6 +1574,109 @@ static int _fl2k_free_async_buffers(fl2k_dev_t *dev)
 	return 0;
 }
 
+/* called with log_mutex held, the files are written without it */
+static void fl2k_log_flush(fl2k_dev_t *dev)
+{
+	uint64_t head = dev->trace_dump_head;
+	const char *req = dev->trace_req;
+	uint32_t seq = dev->trace_req_seq;
+	int r = 0;
+
+	pthread_mutex_unlock(&dev->log_mutex);
+
+	if (head) {
+		fl2k_barrier();
+		if (!fl2k_trace_write(dev, dev->trace_file, head))
+			fprintf(stderr, "Flight recorder written to %s\n",
+					dev->trace_file);
+		dev->trace_dump_head = 0;
+	}
+
+	if (req) {
+		fl2k_barrier();
+		r = fl2k_trace_write(dev, req, dev->trace_head);
+	}
+
+	fl2k_audit_flush(dev);
+
+	pthread_mutex_lock(&dev->log_mutex);
+
+	if (req) {
+		dev->trace_req = NULL;
+		dev->trace_req_result = r;
+		dev->trace_done_seq = seq;
+		pthread_cond_broadcast(&dev->log_cond);
+	}
+}
+
+static void *fl2k_log_worker(void *arg)
+{
+	fl2k_dev_t *dev = (fl2k_dev_t *)arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&dev->log_mutex);
+
+	while (!dev->log_quit) {
+		/* woken early by fl2k_trace_dump() requests */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOG_POLL_INTERVAL * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		if (!dev->trace_req)
+			pthread_cond_timedwait(&dev->log_cond, &dev->log_mutex,
+					       &ts);
+		fl2k_log_flush(dev);
+	}
+
+	/* pick up what was queued while quitting */
+	fl2k_log_flush(dev);
+
+	pthread_mutex_unlock(&dev->log_mutex);
+
+	return NULL;
+}
+
+/* only needed to write the flight recorder or the audit log */
+static int fl2k_log_start(fl2k_dev_t *dev, pthread_attr_t *attr)
+{
+	if (!dev->trace && !dev->audit_file)
+		return 0;
+
+	dev->log_quit = 0;
+	if (pthread_create(&dev->log_worker_thread, attr, fl2k_log_worker,
+			   (void *)dev))
+		return -1;
+
+	pthread_mutex_lock(&dev->log_mutex);
+	dev->log_running = 1;
+	pthread_mutex_unlock(&dev->log_mutex);
+
+	return 0;
+}
+
+static void fl2k_log_stop(fl2k_dev_t *dev)
+{
+	pthread_mutex_lock(&dev->log_mutex);
+	if (!dev->log_running) {
+		pthread_mutex_unlock(&dev->log_mutex);
+		return;
+	}
+
+	dev->log_quit = 1;
+	pthread_cond_broadcast(&dev->log_cond);
+	pthread_mutex_unlock(&dev->log_mutex);
+
+	pthread_join(dev->log_worker_thread, NULL);
+
+	pthread_mutex_lock(&dev->log_mutex);
+	dev->log_running = 0;
+	pthread_cond_broadcast(&dev->log_cond);
+	pthread_mutex_unlock(&dev->log_mutex);
+}
+
 static void *fl2k_usb_worker(void *arg)
 {
 	fl2k_dev_t *dev = (fl2k_dev_t *)arg;
@@ -933,6 +1742,8 @@ static void *fl2k_usb_worker(void *arg)
 
 	/* wait for sample worker thread to finish before freeing buffers */
 	pthread_join(dev->sample_worker_thread, NULL);
+
+	fl2k_log_stop(dev);
 	_fl2k_free_async_buffers(dev);
 	dev->async_status = next_status;
 
@@ -943,13 +1754,29 @@ static void *fl2k_usb_worker(void *arg)
 static inline void fl2k_convert_r(char *out,
 				  char *in,
 				  uint32_t len,
-				  uint8_t offset)
+				  uint8_t offset,
+				  const uint8_t *lut)
 {
 	unsigned int i, j = 0;
 
 	if (!in || !out)
 		return;
 
+	/* calibrated: the table already contains the offset */
+	if (lut) {
+		for (i = 0; i < len; i += 24) {
+			out[i+ 6] = lut[(uint8_t)in[j++]];
+			out[i+ 1] = lut[(uint8_t)in[j++]];
+			out[i+12] = lut[(uint8_t)in[j++]];
+			out[i+15] = lut[(uint8_t)in[j++]];
+			out[i+10] = lut[(uint8_t)in[j++]];
+			out[i+21] = lut[(uint8_t)in[j++]];
+			out[i+16] = lut[(uint8_t)in[j++]];
+			out[i+19] = lut[(uint8_t)in[j++]];
+		}
+		return;
+	}
+
 	for (i = 0; i < len; i += 24) {
 		out[i+ 6] = in[j++] + offset;
 		out[i+ 1] = in[j++] + offset;
@@ -965,13 +1792,29 @@ static inline void fl2k_convert_r(char *out,
 static inline void fl2k_convert_g(char *out,
 				  char *in,
 				  uint32_t len,
-				  uint8_t offset)
+				  uint8_t offset,
+				  const uint8_t *lut)
 {
 	unsigned int i, j = 0;
 
 	if (!in || !out)
 		return;
 
+	/* calibrated: the table already contains the offset */
+	if (lut) {
+		for (i = 0; i < len; i += 24) {
+			out[i+ 5] = lut[(uint8_t)in[j++]];
+			out[i+ 0] = lut[(uint8_t)in[j++]];
+			out[i+ 3] = lut[(uint8_t)in[j++]];
+			out[i+14] = lut[(uint8_t)in[j++]];
+			out[i+ 9] = lut[(uint8_t)in[j++]];
+			out[i+20] = lut[(uint8_t)in[j++]];
+			out[i+23] = lut[(uint8_t)in[j++]];
+			out[i+18] = lut[(uint8_t)in[j++]];
+		}
+		return;
+	}
+
 	for (i = 0; i < len; i += 24) {
 		out[i+ 5] = in[j++] + offset;
 		out[i+ 0] = in[j++] + offset;
@@ -987,13 +1830,29 @@ static inline void fl2k_convert_g(char *out,
 static inline void fl2k_convert_b(char *out,
 				  char *in,
 				  uint32_t len,
-				  uint8_t offset)
+				  uint8_t offset,
+				  const uint8_t *lut)
 {
 	unsigned int i, j = 0;
 
 	if (!in || !out)
 		return;
 
+	/* calibrated: the table already contains the offset */
+	if (lut) {
+		for (i = 0; i < len; i += 24) {
+			out[i+ 4] = lut[(uint8_t)in[j++]];
+			out[i+ 7] = lut[(uint8_t)in[j++]];
+			out[i+ 2] = lut[(uint8_t)in[j++]];
+			out[i+13] = lut[(uint8_t)in[j++]];
+			out[i+ 8] = lut[(uint8_t)in[j++]];
+			out[i+11] = lut[(uint8_t)in[j++]];
+			out[i+22] = lut[(uint8_t)in[j++]];
+			out[i+17] = lut[(uint8_t)in[j++]];
+		}
+		return;
+	}
+
 	for (i = 0; i < len; i += 24) {
 		out[i+ 4] = in[j++] + offset;
 		out[i+ 7] = in[j++] + offset;
@@ -1006,6 +1865,89 @@ static inline void fl2k_convert_b(char *out,
 	}
 }
 
+static inline const uint8_t *fl2k_dac_lut(fl2k_dev_t *dev,
+					  enum fl2k_dac dac,
+					  int sample_signed)
+{
+	if (!dev->dac_lut_enabled[dac])
+		return NULL;
+
+	return dev->dac_lut[dac][sample_signed ? 1 : 0];
+}
+
+/* Only snapshot the ring head here, the file is written by the log worker
+ * so the sample worker doesn't block on the file system right after it fell
+ * behind. */
+static void fl2k_trace_underflow_dump(fl2k_dev_t *dev)
+{
+	uint64_t now;
+
+	if (!dev->trace || !dev->trace_file)
+		return;
+
+	now = fl2k_trace_ts();
+	if (dev->trace_last_dump &&
+	    (now - dev->trace_last_dump < TRACE_DUMP_INTERVAL))
+		return;
+
+	fl2k_barrier();
+	dev->trace_dump_head = dev->trace_head;
+	dev->trace_last_dump = now;
+}
+
+/* Adapt the number of transfers to the deadline margin. Every buffer has one
+ * transfer period to be produced, the time it takes longer adds to a backlog
+ * that has to be covered by the spare transfers filled ahead, as a completed
+ * transfer is only replaced by one that is already filled. In adaptive mode
+ * there are as many spare transfers as transfers in flight. Grow both at once
+ * when the backlog eats up most of the spares or an underflow happened, shrink
+ * again after a period in which one transfer less would have been enough. */
+static void fl2k_adapt_depth(fl2k_dev_t *dev, uint64_t busy, uint64_t now,
+			     int underflow)
+{
+	double period, queue;
+	uint32_t depth = dev->xfer_depth;
+
+	if (dev->rate <= 0)
+		return;
+
+	period = FL2K_BUF_LEN * 1e9 / dev->rate;
+	queue = depth * period;
+
+	dev->adapt_backlog += busy - period;
+	if (dev->adapt_backlog < 0)
+		dev->adapt_backlog = 0;
+
+	if (dev->adapt_hold)
+		dev->adapt_hold--;
+
+	if (underflow || (dev->adapt_backlog > ADAPT_GROW_MARGIN * queue)) {
+		dev->adapt_quiet_since = now;
+
+		/* let the new transfer take effect before the next step */
+		if (dev->adapt_hold || (depth >= dev->xfer_max))
+			return;
+
+		depth++;
+	} else if (dev->adapt_backlog > ADAPT_SHRINK_MARGIN * (queue - period)) {
+		dev->adapt_quiet_since = now;
+		return;
+	} else if ((now - dev->adapt_quiet_since > ADAPT_QUIET_TIME) &&
+		   (depth > ADAPT_MIN_BUF_NUMBER)) {
+		dev->adapt_quiet_since = now;
+		depth--;
+	} else {
+		return;
+	}
+
+	dev->adapt_hold = depth;
+	dev->xfer_active = 2 * depth;
+	dev->xfer_depth = depth;
+
+	fprintf(stderr, "Buffer depth %d (backlog %.1f ms)\n", depth,
+			dev->adapt_backlog / 1e6);
+}
+
 static void *fl2k_sample_worker(void *arg)
 {
 	int r = 0;
@@ -1017,6 +1959,8 @@ static void *fl2k_sample_worker(void *arg)
 	fl2k_data_info_t data_info;
 	uint32_t underflows = 0;
 	uint64_t buf_cnt = 0;
+	uint64_t t_start = 0, t_end, t_busy = 0;
+	int underflow;
 
 	while (FL2K_RUNNING == dev->async_status) {
 		memset(&data_info, 0, sizeof(fl2k_data_info_t));
@@ -1025,15 +1969,31 @@ static void *fl2k_sample_worker(void *arg)
 		data_info.underflow_cnt = dev->underflow_cnt;
 		data_info.ctx = dev->cb_ctx;
 
-		if (dev->underflow_cnt > underflows) {
+		underflow = dev->underflow_cnt > underflows;
+		if (underflow) {
 			fprintf(stderr, "Underflow! Skipped %d buffers\n",
 					dev->underflow_cnt - underflows);
 			underflows = dev->underflow_cnt;
+			fl2k_trace_underflow_dump(dev);
 		}
 
+		/* the busy time is the callback plus the conversion, waiting
+		 * for a free transfer doesn't count against the deadline */
+		if (dev->xfer_max)
+			t_start = fl2k_trace_ts();
+
 		/* call application callback to get samples */
+		FL2K_PROBE(cb_enter, buf_cnt);
+		fl2k_trace_event(dev, FL2K_TRACE_TRACK_SAMPLE, 'B', "callback",
+				 buf_cnt);
 		if (dev->cb)
 			dev->cb(&data_info);
+		fl2k_trace_event(dev, FL2K_TRACE_TRACK_SAMPLE, 'E', "callback",
+				 buf_cnt);
+		FL2K_PROBE(cb_exit, buf_cnt);
+
+		if (dev->xfer_max)
+			t_busy = fl2k_trace_ts() - t_start;
 
 		xfer = fl2k_get_next_xfer(dev, BUF_EMPTY);
 
@@ -1055,18 +2015,46 @@ static void *fl2k_sample_worker(void *arg)
 		xfer_info = (fl2k_xfer_info_t *)xfer->user_data;
 		out_buf = (char *)xfer->buffer;
 
+		if (dev->xfer_max)
+			t_start = fl2k_trace_ts();
+
 		/* Re-arrange and copy bytes in buffer for DACs */
+		FL2K_PROBE(convert_start, buf_cnt);
+		fl2k_trace_event(dev, FL2K_TRACE_TRACK_SAMPLE, 'B', "convert",
+				 buf_cnt);
 		fl2k_convert_r(out_buf, data_info.r_buf, dev->xfer_buf_len,
-			       data_info.sampletype_signed_r ? 128 : 0);
+			       data_info.sampletype_signed_r ? 128 : 0,
+			       fl2k_dac_lut(dev, FL2K_DAC_R,
+					    data_info.sampletype_signed_r));
 
 		fl2k_convert_g(out_buf, data_info.g_buf, dev->xfer_buf_len,
-			       data_info.sampletype_signed_g ? 128 : 0);
+			       data_info.sampletype_signed_g ? 128 : 0,
+			       fl2k_dac_lut(dev, FL2K_DAC_G,
+					    data_info.sampletype_signed_g));
 
 		fl2k_convert_b(out_buf, data_info.b_buf, dev->xfer_buf_len,
-			       data_info.sampletype_signed_b ? 128 : 0);
+			       data_info.sampletype_signed_b ? 128 : 0,
+			       fl2k_dac_lut(dev, FL2K_DAC_B,
+					    data_info.sampletype_signed_b));
+
+		fl2k_trace_event(dev, FL2K_TRACE_TRACK_SAMPLE, 'E', "convert",
+				 buf_cnt);
+		FL2K_PROBE(convert_end, buf_cnt);
+
+		if (dev->xfer_max) {
+			t_end = fl2k_trace_ts();
+			t_busy += t_end - t_start;
+			fl2k_adapt_depth(dev, t_busy, t_end, underflow);
+		}
+
+		if (dev->audit_file)
+			xfer_info->hash = fl2k_audit_hash((uint8_t *)out_buf,
+							  dev->xfer_buf_len);
 
 		xfer_info->seq = buf_cnt++;
 		xfer_info->state = BUF_FILLED;
+		FL2K_PROBE1(xfer_fill, xfer_info->seq,
+			    xfer_info - dev->xfer_info);
 	}
 
 	/* notify application if we've lost the device */
@@ -1079,11 +2067,33 @@ static void *fl2k_sample_worker(void *arg)
 }
 
 
+int fl2k_set_adaptive_buffers(fl2k_dev_t *dev, uint32_t max_buf_num)
+{
+	if (!dev || (FL2K_INACTIVE != dev->async_status))
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (max_buf_num && (max_buf_num < ADAPT_MIN_BUF_NUMBER))
+		max_buf_num = ADAPT_MIN_BUF_NUMBER;
+
+	dev->xfer_max = max_buf_num;
+
+	return 0;
+}
+
+uint32_t fl2k_get_buffer_depth(fl2k_dev_t *dev)
+{
+	if (!dev)
+		return 0;
+
+	return dev->xfer_depth;
+}
+
 int fl2k_start_tx(fl2k_dev_t *dev, fl2k_tx_cb_t cb, void *ctx,
 		  uint32_t buf_num)
 {
 	int r = 0;
 	int i;
+	uint32_t zero_hash;
 	pthread_attr_t attr;
 
 	if (!dev || !cb)
@@ -1100,19 +2110,47 @@ int fl2k_start_tx(fl2k_dev_t *dev, fl2k_tx_cb_t cb, void *ctx,
 	else
 		dev->xfer_num = DEFAULT_BUF_NUMBER;
 
+	dev->xfer_depth = dev->xfer_num;
+
 	/* have two spare buffers that can be filled while the
 	 * others are submitted */
-	dev->xfer_buf_num = dev->xfer_num + 2;
+	if (dev->xfer_max) {
+		if (dev->xfer_num > dev->xfer_max)
+			dev->xfer_num = dev->xfer_max;
+
+		dev->xfer_depth = dev->xfer_num;
+		dev->xfer_buf_num = 2 * dev->xfer_max;
+		dev->xfer_active = 2 * dev->xfer_num;
+		dev->adapt_backlog = 0;
+		dev->adapt_quiet_since = fl2k_trace_ts();
+		dev->adapt_hold = 0;
+	} else {
+		dev->xfer_buf_num = dev->xfer_num + 2;
+		dev->xfer_active = dev->xfer_buf_num;
+	}
+
 	dev->xfer_buf_len = FL2K_XFER_LEN;
 
 	r = fl2k_alloc_submit_transfers(dev);
 	if (r < 0)
 		goto cleanup;
 
+	/* all buffers start out cleared */
+	if (dev->audit_file) {
+		zero_hash = fl2k_audit_hash(dev->xfer_buf[0], dev->xfer_buf_len);
+		for (i = 0; i < (int)dev->xfer_buf_num; i++)
+			dev->xfer_info[i].hash = zero_hash;
+	}
+
 	pthread_mutex_init(&dev->buf_mutex, NULL);
 	pthread_cond_init(&dev->buf_cond, NULL);
 	pthread_attr_init(&attr);
 
+	if (fl2k_log_start(dev, &attr) < 0) {
+		fprintf(stderr, "Error spawning log worker thread!\n");
+		goto cleanup;
+	}
+
 	r = pthread_create(&dev->usb_worker_thread, &attr,
 			   fl2k_usb_worker, (void *)dev);
 	if (r < 0) {
@@ -1132,11 +2170,456 @@ int fl2k_start_tx(fl2k_dev_t *dev, fl2k_tx_cb_t cb, void *ctx,
 	return 0;
 
 cleanup:
+	fl2k_log_stop(dev);
 	_fl2k_free_async_buffers(dev);
 	return FL2K_ERROR_BUSY;
 
 }
 
+static void fl2k_ring_wait(fl2k_dev_t *dev)
+{
+	struct timespec ts;
+
+	/* fl2k_stop_tx() may be called from a signal handler, it can't take
+	 * the ring mutex or signal the condition, the waiters see the new
+	 * async_status at the latest 100 ms later */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 100000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_cond_timedwait(&dev->ring_cond, &dev->ring_mutex, &ts);
+}
+
+/* clock discipline state after a planned block */
+typedef struct fl2k_clock_state {
+	double err;
+	uint64_t next;
+	int64_t slips;
+} fl2k_clock_state_t;
+
+/* Plan the clock slips of the next block, returns the number of ring samples
+ * it consumes. Slip positions are relative to ring_rd and ascending. The
+ * device state is left alone, the result is only applied with
+ * fl2k_clock_commit() once the block is handed out. */
+static uint32_t fl2k_clock_plan(fl2k_dev_t *dev, uint32_t *slip, int *drop,
+				int *num, fl2k_clock_state_t *st)
+{
+	uint32_t need = FL2K_BUF_LEN;
+	uint64_t at, end;
+	double drift, e, x;
+	int n = 0;
+
+	*num = 0;
+	st->err = dev->clock_err;
+	st->next = dev->clock_next;
+	st->slips = dev->clock_slips;
+
+	if (dev->clock_ref_rate <= 0 || dev->rate <= 0)
+		return need;
+
+	/* err is the error at the start of the block, it grows by drift
+	 * samples per sample */
+	drift = dev->clock_ref_rate / dev->rate - 1.0;
+
+	while (n < FL2K_MAX_SLIPS) {
+		/* block offset at which the error reaches one sample */
+		x = st->next - dev->ring_pos;
+		e = st->err + drift * x;
+
+		if (e >= 1.0 || e <= -1.0)
+			;
+		else if (drift > 0)
+			x = (1.0 - st->err) / drift;
+		else if (drift < 0)
+			x = (-1.0 - st->err) / drift;
+		else
+			break;
+
+		if (x >= need)
+			break;
+
+		/* first slip point at or behind it */
+		at = dev->ring_pos + (uint64_t)x;
+		if (st->next < at)
+			st->next += ((at - st->next + dev->clock_period - 1) /
+				     dev->clock_period) * dev->clock_period;
+
+		drop[n] = (st->err + drift *
+			   (double)(st->next - dev->ring_pos)) > 0;
+
+		/* the dropped or repeated sample has to be part of this block */
+		if (st->next >= dev->ring_pos + need - !drop[n])
+			break;
+
+		if (drop[n]) {
+			need++;
+			st->err -= 1.0;
+			st->slips++;
+		} else {
+			need--;
+			st->err += 1.0;
+			st->slips--;
+		}
+
+		slip[n++] = st->next - dev->ring_pos;
+		st->next += dev->clock_period;
+	}
+
+	/* skip the slip points this block passes without a correction */
+	end = dev->ring_pos + need;
+	if (st->next < end)
+		st->next += ((end - st->next + dev->clock_period - 1) /
+			     dev->clock_period) * dev->clock_period;
+
+	st->err += drift * FL2K_BUF_LEN;
+	*num = n;
+
+	return need;
+}
+
+static void fl2k_clock_commit(fl2k_dev_t *dev, const fl2k_clock_state_t *st)
+{
+	dev->clock_err = st->err;
+	dev->clock_next = st->next;
+	dev->clock_slips = st->slips;
+}
+
+/* copy len samples of one channel, starting from samples behind ring_rd */
+static void fl2k_ring_read(fl2k_dev_t *dev, int i, char *dst, uint32_t from,
+			   uint32_t len)
+{
+	uint32_t rd = (dev->ring_rd + from) % dev->ring_len;
+	uint32_t chunk = len;
+
+	if (chunk > dev->ring_len - rd)
+		chunk = dev->ring_len - rd;
+
+	memcpy(dst, dev->ring_buf[i] + rd, chunk);
+	memcpy(dst + chunk, dev->ring_buf[i], len - chunk);
+}
+
+/* Callback used in write mode, hands the next FL2K_BUF_LEN samples of the
+ * ring to the sample worker */
+static void fl2k_ring_cb(fl2k_data_info_t *data_info)
+{
+	fl2k_dev_t *dev = (fl2k_dev_t *)data_info->ctx;
+	char **buf[3] = { &data_info->r_buf, &data_info->g_buf,
+			  &data_info->b_buf };
+	uint32_t slip[FL2K_MAX_SLIPS];
+	int drop[FL2K_MAX_SLIPS];
+	fl2k_clock_state_t clock;
+	uint32_t need, in, out;
+	int i, k, num, stage = 0;
+
+	pthread_mutex_lock(&dev->ring_mutex);
+
+	/* the previous block has been converted by now */
+	if (dev->ring_busy) {
+		dev->ring_rd = (dev->ring_rd + dev->ring_busy) % dev->ring_len;
+		dev->ring_pos += dev->ring_busy;
+		dev->ring_busy = 0;
+		pthread_cond_broadcast(&dev->ring_cond);
+	}
+
+	/* planned again after every wait, fl2k_set_clock_discipline() may
+	 * have changed the slip points in the meantime */
+	need = fl2k_clock_plan(dev, slip, drop, &num, &clock);
+
+	while (!data_info->device_error &&
+	       (FL2K_RUNNING == dev->async_status) &&
+	       (dev->ring_fill < need)) {
+		fl2k_ring_wait(dev);
+		need = fl2k_clock_plan(dev, slip, drop, &num, &clock);
+	}
+
+	if (!data_info->device_error && (dev->ring_fill >= need)) {
+		fl2k_clock_commit(dev, &clock);
+
+		data_info->sampletype_signed_r = dev->ring_signed[0];
+		data_info->sampletype_signed_g = dev->ring_signed[1];
+		data_info->sampletype_signed_b = dev->ring_signed[2];
+
+		dev->ring_fill -= need;
+		dev->ring_busy = need;
+		stage = num || (dev->ring_rd + need > dev->ring_len);
+
+		for (i = 0; i < 3; i++) {
+			if (!dev->ring_active[i])
+				continue;
+
+			*buf[i] = stage ? dev->ring_stage[i] :
+					  dev->ring_buf[i] + dev->ring_rd;
+		}
+	}
+
+	pthread_cond_broadcast(&dev->ring_cond);
+	pthread_mutex_unlock(&dev->ring_mutex);
+
+	if (!stage)
+		return;
+
+	/* the busy part of the ring belongs to the sample worker, so the
+	 * staging copy doesn't need the lock either */
+	for (i = 0; i < 3; i++) {
+		if (!dev->ring_active[i])
+			continue;
+
+		in = 0;
+		out = 0;
+
+		for (k = 0; k < num; k++) {
+			fl2k_ring_read(dev, i, dev->ring_stage[i] + out, in,
+				       slip[k] - in);
+			out += slip[k] - in;
+			in = slip[k];
+
+			if (drop[k]) {
+				in++;
+			} else {
+				/* sample is copied again with the next span */
+				fl2k_ring_read(dev, i, dev->ring_stage[i] + out,
+					       in, 1);
+				out++;
+			}
+		}
+
+		fl2k_ring_read(dev, i, dev->ring_stage[i] + out, in, need - in);
+	}
+}
+
+int fl2k_start_tx_write(fl2k_dev_t *dev, uint32_t ring_len, uint32_t buf_num)
+{
+	int i;
+
+	if (!dev || (FL2K_INACTIVE != dev->async_status))
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (!ring_len)
+		ring_len = DEFAULT_BUF_NUMBER * FL2K_BUF_LEN;
+
+	/* round up, so a transfer only wraps around the end of the ring once
+	 * clock slips moved it out of alignment */
+	ring_len = ((ring_len + FL2K_BUF_LEN - 1) / FL2K_BUF_LEN) * FL2K_BUF_LEN;
+
+	/* one block is always held by the sample worker */
+	if (ring_len < 2 * FL2K_BUF_LEN)
+		ring_len = 2 * FL2K_BUF_LEN;
+
+	if (ring_len != dev->ring_len) {
+		for (i = 0; i < 3; i++) {
+			free(dev->ring_buf[i]);
+			dev->ring_buf[i] = malloc(ring_len);
+			if (!dev->ring_buf[i]) {
+				dev->ring_len = 0;
+				return FL2K_ERROR_NO_MEM;
+			}
+		}
+		dev->ring_len = ring_len;
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (!dev->ring_stage[i])
+			dev->ring_stage[i] = malloc(FL2K_BUF_LEN);
+		if (!dev->ring_stage[i])
+			return FL2K_ERROR_NO_MEM;
+	}
+
+	dev->ring_rd = 0;
+	dev->ring_fill = 0;
+	dev->ring_busy = 0;
+	dev->ring_pos = 0;
+
+	dev->clock_err = 0;
+	dev->clock_slips = 0;
+	dev->clock_next = dev->clock_offset;
+
+	for (i = 0; i < 3; i++) {
+		dev->ring_signed[i] = 0;
+		dev->ring_active[i] = 0;
+	}
+
+	return fl2k_start_tx(dev, fl2k_ring_cb, dev, buf_num);
+}
+
+int fl2k_write_begin(fl2k_dev_t *dev, fl2k_data_info_t *data_info,
+		     uint32_t len)
+{
+	uint32_t wr, space, chunk;
+	int r = 0;
+
+	if (!dev || !data_info || !dev->ring_len || !len)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&dev->ring_mutex);
+
+	while (1) {
+		if (FL2K_RUNNING != dev->async_status) {
+			r = FL2K_ERROR_NO_DEVICE;
+			break;
+		}
+
+		space = dev->ring_len - dev->ring_busy - dev->ring_fill;
+		if (!space) {
+			fl2k_ring_wait(dev);
+			continue;
+		}
+
+		wr = (dev->ring_rd + dev->ring_busy + dev->ring_fill) %
+		     dev->ring_len;
+
+		chunk = len;
+		if (chunk > space)
+			chunk = space;
+		if (chunk > dev->ring_len - wr)
+			chunk = dev->ring_len - wr;
+
+		/* the consumer never touches the free part of the ring,
+		 * so it can be written without holding the lock */
+		data_info->r_buf = dev->ring_buf[0] + wr;
+		data_info->g_buf = dev->ring_buf[1] + wr;
+		data_info->b_buf = dev->ring_buf[2] + wr;
+		data_info->len = chunk;
+		break;
+	}
+
+	pthread_mutex_unlock(&dev->ring_mutex);
+
+	return r;
+}
+
+int fl2k_write_end(fl2k_dev_t *dev, fl2k_data_info_t *data_info)
+{
+	char *in[3];
+	int i;
+
+	if (!dev || !data_info || !dev->ring_len)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	in[0] = data_info->r_buf;
+	in[1] = data_info->g_buf;
+	in[2] = data_info->b_buf;
+
+	pthread_mutex_lock(&dev->ring_mutex);
+
+	if (data_info->len > dev->ring_len - dev->ring_busy - dev->ring_fill) {
+		pthread_mutex_unlock(&dev->ring_mutex);
+		return FL2K_ERROR_INVALID_PARAM;
+	}
+
+	dev->ring_signed[0] = data_info->sampletype_signed_r;
+	dev->ring_signed[1] = data_info->sampletype_signed_g;
+	dev->ring_signed[2] = data_info->sampletype_signed_b;
+
+	for (i = 0; i < 3; i++) {
+		if (in[i])
+			dev->ring_active[i] = 1;
+	}
+
+	dev->ring_fill += data_info->len;
+
+	/* the sample worker only waits for a complete block */
+	if (dev->ring_fill >= FL2K_BUF_LEN)
+		pthread_cond_broadcast(&dev->ring_cond);
+
+	pthread_mutex_unlock(&dev->ring_mutex);
+
+	return 0;
+}
+
+int fl2k_write(fl2k_dev_t *dev, fl2k_data_info_t *data_info)
+{
+	fl2k_data_info_t ring;
+	char *in[3], *out[3];
+	uint32_t done = 0;
+	int i, r = 0;
+
+	if (!dev || !data_info || !dev->ring_len)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	in[0] = data_info->r_buf;
+	in[1] = data_info->g_buf;
+	in[2] = data_info->b_buf;
+
+	while (done < data_info->len) {
+		r = fl2k_write_begin(dev, &ring, data_info->len - done);
+		if (r < 0)
+			break;
+
+		out[0] = ring.r_buf;
+		out[1] = ring.g_buf;
+		out[2] = ring.b_buf;
+
+		for (i = 0; i < 3; i++) {
+			if (in[i])
+				memcpy(out[i], in[i] + done, ring.len);
+		}
+
+		ring.r_buf = in[0] ? ring.r_buf : NULL;
+		ring.g_buf = in[1] ? ring.g_buf : NULL;
+		ring.b_buf = in[2] ? ring.b_buf : NULL;
+		ring.sampletype_signed_r = data_info->sampletype_signed_r;
+		ring.sampletype_signed_g = data_info->sampletype_signed_g;
+		ring.sampletype_signed_b = data_info->sampletype_signed_b;
+
+		r = fl2k_write_end(dev, &ring);
+		if (r < 0)
+			break;
+
+		done += ring.len;
+	}
+
+	return r;
+}
+
+int fl2k_set_clock_discipline(fl2k_dev_t *dev, double ref_rate,
+			      uint32_t period, uint32_t offset)
+{
+	uint64_t pos;
+
+	if (!dev || (ref_rate < 0))
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (!period)
+		period = 1;
+
+	pthread_mutex_lock(&dev->ring_mutex);
+
+	/* the first slip point not yet planned into a block */
+	pos = dev->ring_pos + dev->ring_busy;
+	dev->clock_next = offset;
+	if (dev->clock_next < pos)
+		dev->clock_next += ((pos - offset + period - 1) / period) * period;
+
+	/* keep the accumulated error when only the rate is updated */
+	if (!ref_rate || (period != dev->clock_period))
+		dev->clock_err = 0;
+
+	dev->clock_ref_rate = ref_rate;
+	dev->clock_period = period;
+	dev->clock_offset = offset;
+
+	pthread_mutex_unlock(&dev->ring_mutex);
+
+	return 0;
+}
+
+int64_t fl2k_get_clock_slips(fl2k_dev_t *dev)
+{
+	int64_t slips;
+
+	if (!dev)
+		return 0;
+
+	pthread_mutex_lock(&dev->ring_mutex);
+	slips = dev->clock_slips;
+	pthread_mutex_unlock(&dev->ring_mutex);
+
+	return slips;
+}
+
 int fl2k_stop_tx(fl2k_dev_t *dev)
 {
 	if (!dev)
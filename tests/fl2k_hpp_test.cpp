@@ -0,0 +1,128 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Leases of fl2k.hpp across moves of their stream. The wrapper is header-only,
+ * so the parts of the C API it uses are replaced by a fake device here and no
+ * hardware is needed.
+ */
+
+#include <fl2k.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+
+static fl2k_dev_t *const fake_dev = reinterpret_cast<fl2k_dev_t *>(0x1000);
+static char ring[3][1024];
+static int writes, stops;
+static fl2k_data_info_t last;
+
+extern "C" {
+
+int fl2k_open(fl2k_dev_t **dev, uint32_t) { *dev = fake_dev; return 0; }
+int fl2k_close(fl2k_dev_t *) { return 0; }
+uint32_t fl2k_get_device_count(void) { return 1; }
+const char *fl2k_get_device_name(uint32_t) { return "fake"; }
+int fl2k_set_sample_rate(fl2k_dev_t *, uint32_t) { return 0; }
+uint32_t fl2k_get_sample_rate(fl2k_dev_t *) { return 0; }
+int fl2k_set_dac_lut(fl2k_dev_t *, enum fl2k_dac, const uint8_t *) { return 0; }
+int fl2k_set_adaptive_buffers(fl2k_dev_t *, uint32_t) { return 0; }
+int64_t fl2k_get_clock_slips(fl2k_dev_t *) { return 0; }
+int fl2k_start_tx_write(fl2k_dev_t *, uint32_t, uint32_t) { return 0; }
+
+int fl2k_stop_tx(fl2k_dev_t *)
+{
+	stops++;
+	return 0;
+}
+
+int fl2k_write_begin(fl2k_dev_t *dev, fl2k_data_info_t *info, uint32_t len)
+{
+	if (dev != fake_dev || stops)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	info->len = (len < sizeof(ring[0])) ? len : sizeof(ring[0]);
+	info->r_buf = ring[0];
+	info->g_buf = ring[1];
+	info->b_buf = ring[2];
+	return 0;
+}
+
+int fl2k_write_end(fl2k_dev_t *dev, fl2k_data_info_t *info)
+{
+	if (dev != fake_dev || stops)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	last = *info;
+	writes++;
+	return 0;
+}
+
+}
+
+#define CHECK(x) do { \
+	if (!(x)) { \
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #x); \
+		exit(1); \
+	} \
+} while (0)
+
+int main(void)
+{
+	fl2k::device dev(0);
+	fl2k::lease early, late;
+
+	{
+		fl2k::stream tx(dev);
+
+		/* a lease taken before the stream is moved */
+		early = tx.acquire(100);
+		CHECK(early && early.size() == 100);
+		early.r()[0] = 42;
+
+		fl2k::stream moved(std::move(tx));
+		CHECK(!tx.get());
+		CHECK(moved.get() == fake_dev);
+
+		/* settings of the new owner apply to the old lease */
+		moved.set_signed(FL2K_DAC_R, true);
+		early.commit();
+		CHECK(writes == 1);
+		CHECK(last.len == 100);
+		CHECK(last.r_buf == ring[0] && !last.g_buf && !last.b_buf);
+		CHECK(last.sampletype_signed_r == 1);
+		CHECK(!early);
+
+		/* the moved-from stream doesn't stop the device */
+		late = moved.acquire(50);
+		CHECK(late);
+	}
+
+	/* one stop by the stream that owned the device last */
+	CHECK(stops == 1);
+
+	/* a lease that outlived its stream is inert */
+	late.g()[0] = 1;
+	late.commit();
+	CHECK(writes == 1);
+	CHECK(!late);
+
+	return 0;
+}
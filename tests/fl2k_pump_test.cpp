@@ -0,0 +1,190 @@
+/*
+ * osmo-fl2k, turns FL2000-based USB 3.0 to VGA adapters into
+ * low cost DACs
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * stream::pump() over a small producer, on the same kind of fake device as
+ * fl2k_hpp_test. Every write is recorded, so the order and the count of the
+ * buffers reaching the device can be checked. The generator part only runs
+ * when the compiler has coroutines, the same producer as a plain range runs
+ * everywhere.
+ */
+
+#include <fl2k.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static fl2k_dev_t *const fake_dev = reinterpret_cast<fl2k_dev_t *>(0x1000);
+static char ring[3][1024];
+static int stops;
+
+/* what reached the device, one entry per fl2k_write_end() */
+struct record {
+	uint32_t len;
+	int first, end;
+};
+static std::vector<record> writes;
+static std::size_t limit = (std::size_t)-1;
+
+extern "C" {
+
+int fl2k_open(fl2k_dev_t **dev, uint32_t) { *dev = fake_dev; return 0; }
+int fl2k_close(fl2k_dev_t *) { return 0; }
+uint32_t fl2k_get_device_count(void) { return 1; }
+const char *fl2k_get_device_name(uint32_t) { return "fake"; }
+int fl2k_set_sample_rate(fl2k_dev_t *, uint32_t) { return 0; }
+uint32_t fl2k_get_sample_rate(fl2k_dev_t *) { return 0; }
+int fl2k_set_dac_lut(fl2k_dev_t *, enum fl2k_dac, const uint8_t *) { return 0; }
+int fl2k_set_adaptive_buffers(fl2k_dev_t *, uint32_t) { return 0; }
+int64_t fl2k_get_clock_slips(fl2k_dev_t *) { return 0; }
+int fl2k_start_tx_write(fl2k_dev_t *, uint32_t, uint32_t) { return 0; }
+
+int fl2k_stop_tx(fl2k_dev_t *)
+{
+	stops++;
+	return 0;
+}
+
+int fl2k_write_begin(fl2k_dev_t *dev, fl2k_data_info_t *info, uint32_t len)
+{
+	/* streaming stops after limit buffers */
+	if (dev != fake_dev || writes.size() >= limit)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	info->len = (len < sizeof(ring[0])) ? len : sizeof(ring[0]);
+	info->r_buf = ring[0];
+	info->g_buf = ring[1];
+	info->b_buf = ring[2];
+	return 0;
+}
+
+int fl2k_write_end(fl2k_dev_t *dev, fl2k_data_info_t *info)
+{
+	if (dev != fake_dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	writes.push_back({ info->len, (uint8_t)info->r_buf[0],
+			   (uint8_t)info->r_buf[info->len - 1] });
+	return 0;
+}
+
+}
+
+#define CHECK(x) do { \
+	if (!(x)) { \
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #x); \
+		exit(1); \
+	} \
+} while (0)
+
+/* block i has 100 * (i + 1) samples of value i + 1, the last one is longer
+ * than a buffer of the ring and its samples count up */
+static const int nb_blocks = 6;
+static const std::size_t long_len = 1500;
+
+static std::vector<uint8_t> samples(int i)
+{
+	if (i == nb_blocks - 1) {
+		std::vector<uint8_t> v(long_len);
+		for (std::size_t k = 0; k < long_len; k++)
+			v[k] = (uint8_t)k;
+		return v;
+	}
+
+	return std::vector<uint8_t>(100 * (i + 1), (uint8_t)(i + 1));
+}
+
+/* one write per short block, in order, the long one split in two */
+static void check_writes()
+{
+	CHECK(writes.size() == nb_blocks + 1);
+
+	for (int i = 0; i < nb_blocks - 1; i++) {
+		CHECK(writes[i].len == 100u * (i + 1));
+		CHECK(writes[i].first == i + 1 && writes[i].end == i + 1);
+	}
+
+	CHECK(writes[nb_blocks - 1].len == sizeof(ring[0]));
+	CHECK(writes[nb_blocks - 1].first == 0);
+	CHECK(writes[nb_blocks - 1].end == (uint8_t)(sizeof(ring[0]) - 1));
+	CHECK(writes[nb_blocks].len == long_len - sizeof(ring[0]));
+	CHECK(writes[nb_blocks].first == (uint8_t)sizeof(ring[0]));
+	CHECK(writes[nb_blocks].end == (uint8_t)(long_len - 1));
+}
+
+#ifdef FL2K_HAVE_COROUTINES
+static int produced;
+
+static fl2k::generator<fl2k::block> blocks()
+{
+	for (int i = 0; i < nb_blocks; i++) {
+		std::vector<uint8_t> r = samples(i);
+		produced++;
+		co_yield fl2k::block{ r, {}, {} };
+	}
+}
+#endif
+
+int main(void)
+{
+	fl2k::device dev(0);
+	std::vector<std::vector<uint8_t>> data;
+	std::vector<fl2k::block> range;
+
+	for (int i = 0; i < nb_blocks; i++)
+		data.push_back(samples(i));
+	for (const std::vector<uint8_t> &r : data)
+		range.push_back(fl2k::block{ r, {}, {} });
+
+	/* any range of blocks */
+	{
+		fl2k::stream tx(dev);
+		tx.pump(range);
+	}
+	check_writes();
+	CHECK(stops == 1);
+
+#ifdef FL2K_HAVE_COROUTINES
+	/* a generator, resumed once per block */
+	writes.clear();
+	{
+		fl2k::stream tx(dev);
+		tx.pump(blocks());
+	}
+	check_writes();
+	CHECK(produced == nb_blocks);
+	CHECK(stops == 2);
+
+	/* once streaming stops the generator isn't resumed again */
+	writes.clear();
+	produced = 0;
+	limit = 2;
+	{
+		fl2k::stream tx(dev);
+		tx.pump(blocks());
+	}
+	CHECK(writes.size() == 2);
+	CHECK(writes[0].first == 1 && writes[1].first == 2);
+	CHECK(produced == 3);
+#endif
+
+	return 0;
+}